@@ -12,6 +12,16 @@
 
 #include <Eigen/Core>
 
+// Source of the obj_bb bounding boxes: the rendered depth, the projected corners of the model bounding box (loose,
+// nothing rendered) or the projected convex hull of the model (exact silhouette extent, rendered only if the hull
+// reaches behind the camera)
+enum BoundingBoxMode
+{
+	BBOX_MODE_RENDERED = 0,
+	BBOX_MODE_BOX_CORNERS = 1,
+	BBOX_MODE_HULL = 2
+};
+
 class Configuration {
 
 public:
@@ -96,6 +106,56 @@ public:
 		image_height = p_height;
     }
 
+	bool get_headless() const
+    {
+		return headless;
+    }
+
+	void set_headless(bool p_headless)
+    {
+		headless = p_headless;
+    }
+
+	bool get_cpu_rendering() const
+    {
+		return cpu_rendering;
+    }
+
+	void set_cpu_rendering(bool p_cpu_rendering)
+    {
+		cpu_rendering = p_cpu_rendering;
+    }
+
+	int get_number_of_threads() const
+    {
+		return number_of_threads;
+    }
+
+	void set_number_of_threads(int p_number_of_threads)
+    {
+		number_of_threads = p_number_of_threads;
+    }
+
+	bool get_gt_info() const
+    {
+		return gt_info;
+    }
+
+	void set_gt_info(bool p_gt_info)
+    {
+		gt_info = p_gt_info;
+    }
+
+	BoundingBoxMode get_bbox_mode() const
+    {
+		return bbox_mode;
+    }
+
+	void set_bbox_mode(BoundingBoxMode p_bbox_mode)
+    {
+		bbox_mode = p_bbox_mode;
+    }
+
 private:	
 	Eigen::Matrix3f intrinsics;
 	std::string reference_models_dir;
@@ -107,6 +167,15 @@ private:
 	float focal_length_scale;
 	std::string out_dir;
 	bool copy_images;
+	// render with an offscreen EGL context instead of a hidden window, no display needed
+	bool headless = false;
+	// render with the software rasterizer, no OpenGL at all
+	bool cpu_rendering = false;
+	// threads converting frames, 0 for one per core. Rendering with a hidden window is limited to the main thread.
+	int number_of_threads = 0;
+	BoundingBoxMode bbox_mode = BBOX_MODE_RENDERED;
+	// write scene_gt_info.json and the object masks, which needs the recorded depth and a full resolution rendering
+	bool gt_info = false;
 };
 
 #endif
\ No newline at end of file
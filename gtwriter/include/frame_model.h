@@ -23,6 +23,15 @@ public:
 	int model_id;
 	Eigen::Matrix4f pose;
 	Eigen::Vector4i bbox;
+
+	// BOP scene_gt_info, only computed with gt_info: pixels of the silhouette, of those with recorded depth and of 
+	// the visible ones, bounding boxes [x, y, width, height] of the silhouette and of its visible part, -1 if empty
+	int px_count_all = 0;
+	int px_count_valid = 0;
+	int px_count_visib = 0;
+	float visib_fract = 0.0f;
+	Eigen::Vector4i bbox_obj = Eigen::Vector4i::Constant(-1);
+	Eigen::Vector4i bbox_visib = Eigen::Vector4i::Constant(-1);
 };
 
 #endif
@@ -12,6 +12,7 @@
 
 #include "model.h"
 #include <iostream>
+#include <map>
 #include "renderer.h"
 #include "configuration.h"
 
@@ -21,10 +22,26 @@ class ModelRenderer {
 public:
 	ModelRenderer(const Model &model, const Configuration &configuration, bool scale_focal_length = false);
 	void ModelRenderer::render(Eigen::Matrix4f &world_to_cam, cv::Mat &depth, cv::Mat &color);
+	// depth only, written into depth in place if it already has the image size
+	void render_depth(Eigen::Matrix4f &world_to_cam, cv::Mat &depth);
+	// depth of many poses in one batch
+	void render_depth_batch(std::vector<Eigen::Matrix4f> &world_to_cam_poses, std::vector<cv::Mat> &depths);
+	// corners of the bounding box of the model in model coordinates, one per column
+	Eigen::Matrix<float, 3, 8> get_bounding_box_corners();
+	// vertices of the convex hull of the model in model coordinates, fetched from the renderer once
+	const std::vector<Eigen::Vector3f> &get_hull_vertices();
 
 private:
 	std::shared_ptr<RendererInterface> renderer;
+	std::vector<Eigen::Vector3f> hull_vertices;
 
 };
 
+// Backend of all renderers: headless or hidden window OpenGL, or the cpu rasterizer
+RenderBackend get_render_backend(const Configuration &configuration);
+
+// Renderers by model file and whether their focal length is scaled. OpenGL renderers can only be used by the thread
+// they were created in, so every thread converting frames has its own.
+typedef std::map<std::pair<std::string, bool>, ModelRenderer> ModelRenderers;
+
 #endif
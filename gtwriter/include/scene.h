@@ -25,15 +25,28 @@ public:
 	Scene(const Configuration &p_configuration, const std::string &p_scene_dir, 
 		const std::vector<Model> &p_models, const std::vector<Eigen::Matrix4f> &p_camera_poses);
 
-	std::vector<Frame> convert_to_scene_frames();
 	size_t get_number_of_frames();
+	// frames are converted in chunks rendered together, chunks of all scenes can be converted in parallel
+	size_t get_number_of_chunks();
+	std::pair<size_t, size_t> get_chunk_frames(size_t chunk);
+
+	// Converts the frames of the chunk into frames, which has room for them. The renderers are those of the calling 
+	// thread, renderers of models missing there are added. With gt_info the object masks are written as the images
+	// from first_output_frame on.
+	void convert_chunk(size_t chunk, size_t first_output_frame, ModelRenderers &renderers, Frame *frames);
 
 
 private:
+	ModelRenderer &get_renderer(ModelRenderers &renderers, const Model &model, bool scale_focal_length);
+	// Visible fractions, pixel counts, silhouette and visible bounding boxes of the frame models from their rendered
+	// depth at full resolution and the recorded depth, and their masks. The rendered boxes marked in bbox_from_gt_info
+	// (by frame and model) are found in the same depth.
+	void add_visibility_info(size_t chunk_begin, size_t chunk_end, size_t first_output_frame, ModelRenderers &renderers,
+	                         Frame *frames, const std::vector<bool> &bbox_from_gt_info);
+
 	Configuration configuration;
 
 	std::vector<Model> models;
-	std::vector<ModelRenderer> scaled_renderers;
 	
 	std::vector<Eigen::Matrix4f> frame_poses;
 	std::string images_path;
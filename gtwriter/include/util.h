@@ -44,5 +44,13 @@ inline std::string get_image_filename_for_idx(size_t idx)
 	return filename;
 }
 
+// BOP mask of the object_idx-th object of an image
+inline std::string get_mask_filename_for_idx(size_t idx, size_t object_idx)
+{
+	std::stringstream filename_ss;
+	filename_ss << std::setfill('0') << std::setw(6) << idx << "_" << std::setw(6) << object_idx << ".png";
+	return filename_ss.str();
+}
+
 
 #endif
\ No newline at end of file
@@ -124,6 +124,20 @@ bool parse_configuration(const cv::CommandLineParser &parser, Configuration &con
 	configuration.set_out_dir(out_dir);
 	configuration.set_focal_length_scale(0.5f);
 	configuration.set_copy_images(copy_images);
+
+	const string bbox_mode = parser.get<string>("bbox_mode");
+	if (bbox_mode == "rendered") configuration.set_bbox_mode(BBOX_MODE_RENDERED);
+	else if (bbox_mode == "box") configuration.set_bbox_mode(BBOX_MODE_BOX_CORNERS);
+	else if (bbox_mode == "hull") configuration.set_bbox_mode(BBOX_MODE_HULL);
+	else
+	{
+		cerr << "Invalid bbox mode: " << bbox_mode << endl;
+		return false;
+	}
+	configuration.set_headless(parser.has("headless"));
+	configuration.set_cpu_rendering(parser.has("cpu_rendering"));
+	configuration.set_number_of_threads(parser.get<int>("threads"));
+	configuration.set_gt_info(parser.has("gt_info"));
 	configuration.set_scenes_dirs(scenes_dirs);
 	configuration.set_image_height(image_height);
 	configuration.set_image_width(image_width);
@@ -139,7 +153,12 @@ int main(int argc, char* argv[])
 		"{reference_models_dir           |     | directory with reference models         }"
 		"{scenes_dirs           |     | comma separated directories to be joined         }"
 		"{out_dir           |     | output directory         }"
-		"{copy_images           |     | should copy and reindex images         }";
+		"{copy_images           |     | should copy and reindex images         }"
+		"{headless              |     | render without a display         }"
+		"{cpu_rendering         |     | render on the cpu without OpenGL         }"
+		"{bbox_mode             | rendered | obj_bb from the rendered depth (rendered), projected bounding box corners (box) or projected convex hull (hull)         }"
+		"{threads               |  0  | threads converting frames, 0 for one per core         }"
+		"{gt_info               |     | write scene_gt_info.json and the object masks         }";
 
 	cv::CommandLineParser parser(argc, argv, arg_keys);
 
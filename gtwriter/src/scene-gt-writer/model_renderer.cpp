@@ -10,6 +10,13 @@
 #include "model_renderer.h"
 
 
+RenderBackend get_render_backend(const Configuration &configuration)
+{
+	if (configuration.get_cpu_rendering()) return RENDER_BACKEND_CPU;
+	return configuration.get_headless() ? RENDER_BACKEND_HEADLESS : RENDER_BACKEND_WIDGET;
+}
+
+
 ModelRenderer::ModelRenderer(const Model &model, const Configuration &configuration, bool scale_focal_length)
 {
 	RendererConfiguration renderer_config;
@@ -30,6 +37,9 @@ ModelRenderer::ModelRenderer(const Model &model, const Configuration &configurat
 	renderer_config.z_near = 0.001f;
 	renderer_config.z_far = 4.05f;
 	renderer_config.model_file = model.model_file;
+	renderer_config.backend = get_render_backend(configuration);
+	// unless a single thread converts the frames, the threads converting them keep the cores busy
+	renderer_config.cpu_threads = configuration.get_number_of_threads() == 1 ? 0 : 1;
 
 	renderer = std::shared_ptr<RendererInterface>(get_depth_renderer(renderer_config));
 }
@@ -38,3 +48,33 @@ void ModelRenderer::render(Eigen::Matrix4f &world_to_cam, cv::Mat &depth, cv::Ma
 {
 	renderer->render(world_to_cam, depth, color);
 }
+
+void ModelRenderer::render_depth(Eigen::Matrix4f &world_to_cam, cv::Mat &depth)
+{
+	cv::Mat no_color;
+	renderer->render(world_to_cam, 1.0f, RENDER_DEPTH, cv::Rect(), depth, no_color);
+}
+
+void ModelRenderer::render_depth_batch(std::vector<Eigen::Matrix4f> &world_to_cam_poses, std::vector<cv::Mat> &depths)
+{
+	renderer->render_batch(world_to_cam_poses, 1.0f, depths);
+}
+
+Eigen::Matrix<float, 3, 8> ModelRenderer::get_bounding_box_corners()
+{
+	Eigen::Vector3f bb_min, bb_max;
+	renderer->get_model_bounding_box(bb_min, bb_max);
+
+	Eigen::Matrix<float, 3, 8> corners;
+	for (int i = 0; i < 8; ++i)
+	{
+		corners.col(i) << (i & 1 ? bb_max : bb_min)(0), (i & 2 ? bb_max : bb_min)(1), (i & 4 ? bb_max : bb_min)(2);
+	}
+	return corners;
+}
+
+const std::vector<Eigen::Vector3f> &ModelRenderer::get_hull_vertices()
+{
+	if (hull_vertices.empty()) renderer->get_model_hull_vertices(hull_vertices);
+	return hull_vertices;
+}
@@ -81,6 +81,43 @@ json get_frame_entry(const Frame &frame)
 	return frame_entry;
 }
 
+inline vector<int> get_bbox_vector(const Vector4i &bbox)
+{
+	return { bbox(0), bbox(1), bbox(2), bbox(3) };
+}
+
+json get_frame_info_entry(const Frame &frame)
+{
+	json frame_entry = json::array();
+	for (const auto &frame_model : frame.frame_models)
+	{
+		json object_entry;
+		object_entry["bbox_obj"] = get_bbox_vector(frame_model.bbox_obj);
+		object_entry["bbox_visib"] = get_bbox_vector(frame_model.bbox_visib);
+		object_entry["px_count_all"] = frame_model.px_count_all;
+		object_entry["px_count_valid"] = frame_model.px_count_valid;
+		object_entry["px_count_visib"] = frame_model.px_count_visib;
+		object_entry["visib_fract"] = frame_model.visib_fract;
+
+		frame_entry.push_back(object_entry);
+	}
+
+	return frame_entry;
+}
+
+void write_scene_gt_info(const string &gt_info_file, const std::vector<Frame> &joined_sequences)
+{
+	json out_json;
+
+	for (size_t i = 0; i < joined_sequences.size(); ++i)
+	{
+		out_json[to_string(i)] = get_frame_info_entry(joined_sequences[i]);
+	}
+
+	std::ofstream ofs(gt_info_file);
+	ofs << std::setw(4) << out_json << std::endl;
+}
+
 void write_scene_gt_labels(const string &gt_scenes_file, const std::vector<Frame> &joined_sequences)
 {
 	json out_json;
@@ -161,6 +198,11 @@ void write_output(const Configuration &configuration, const std::vector<Frame> &
 	write_scene_gt_labels(gt_scene_file, joined_sequences);
 	write_gt_camera_labels(configuration, gt_camera_file, joined_sequences.size());
 
+	if (configuration.get_gt_info())
+	{
+		write_scene_gt_info((fs::path(out_dir) / "scene_gt_info.json").string(), joined_sequences);
+	}
+
 	if (configuration.get_copy_images())
 	{
 		copy_images(configuration, joined_sequences);
@@ -9,22 +9,27 @@
 
 #include "scene.h"
 #include <cmath>
+#include <limits>
 #include "frame.h"
+#include "util.h"
 #include <Eigen/Dense>
+#include <filesystem>
+#include <opencv2/imgcodecs.hpp>
 
+namespace fs = std::filesystem;
 using namespace std;
 using namespace Eigen;
 #define _USE_MATH_DEFINES
 
+// frames rendered together per model
+const size_t RENDER_BATCH_SIZE = 16;
+// rendered depth up to this far [m] behind the recorded depth is visible, as in the BOP toolkit
+const float VISIBILITY_TOLERANCE = 0.015f;
+
 Scene::Scene(const Configuration &p_configuration, const std::string &p_scene_dir, 
 		const std::vector<Model> &p_models, const std::vector<Eigen::Matrix4f> &p_camera_poses):
 configuration(p_configuration), models(p_models), frame_poses(p_camera_poses), scene_dir(p_scene_dir)
 {
-	for (const auto& model : models)
-	{
-		scaled_renderers.emplace_back(ModelRenderer(model, configuration, true));
-	}
-
 }
 
 size_t Scene::get_number_of_frames()
@@ -32,6 +37,17 @@ size_t Scene::get_number_of_frames()
 	return frame_poses.size();
 }
 
+size_t Scene::get_number_of_chunks()
+{
+	return (frame_poses.size() + RENDER_BATCH_SIZE - 1) / RENDER_BATCH_SIZE;
+}
+
+std::pair<size_t, size_t> Scene::get_chunk_frames(size_t chunk)
+{
+	const size_t chunk_begin = chunk * RENDER_BATCH_SIZE;
+	return { chunk_begin, min(chunk_begin + RENDER_BATCH_SIZE, frame_poses.size()) };
+}
+
 
 inline int get_scaled_coordinate(int x, int cx, float focal_length_scale)
 {
@@ -39,21 +55,36 @@ inline int get_scaled_coordinate(int x, int cx, float focal_length_scale)
 }
 
 
-Vector4i get_bounding_box(const cv::Mat& scaled_depth, const Matrix3f& scaled_intrinsics, float focal_length_scale)
+// bounding box in the full resolution image of the pixels from (min_x, min_y) to (max_x, max_y) of the scaled image
+Vector4i get_scaled_bounding_box(int min_x, int min_y, int max_x, int max_y, const Matrix3f& scaled_intrinsics, float focal_length_scale)
 {
 	float cx = scaled_intrinsics(0, 2);
 	float cy = scaled_intrinsics(1, 2);
 
+	int min_y_scaled = get_scaled_coordinate(min_y, cy, focal_length_scale) - 1;
+	int max_y_scaled = get_scaled_coordinate(max_y, cy, focal_length_scale) + 1;
+
+	int min_x_scaled = get_scaled_coordinate(min_x, cx, focal_length_scale) - 1;
+	int max_x_scaled = get_scaled_coordinate(max_x, cx, focal_length_scale) + 1;
+
+	return { min_x_scaled, min_y_scaled, max_x_scaled - min_x_scaled, max_y_scaled - min_y_scaled };
+}
+
+
+// only the region of the scaled depth is scanned, it has to contain all pixels of the model
+Vector4i get_bounding_box(const cv::Mat& scaled_depth, const cv::Rect& region, const Matrix3f& scaled_intrinsics, float focal_length_scale)
+{
 	int min_y = scaled_depth.rows - 1;
 	int min_x = scaled_depth.cols - 1;
 	int max_y = 0;
 	int max_x = 0;
 
-	for (int i = 0; i < scaled_depth.rows; ++i)
+	for (int i = region.y; i < region.y + region.height; ++i)
 	{
-		for (int j = 0; j < scaled_depth.cols; ++j)
+		const float* depth_row = scaled_depth.ptr<float>(i);
+		for (int j = region.x; j < region.x + region.width; ++j)
 		{
-			float val = scaled_depth.at<float>(i, j);
+			float val = depth_row[j];
 
 			if (isfinite(val) && val > 1e-3f)
 			{
@@ -78,19 +109,78 @@ Vector4i get_bounding_box(const cv::Mat& scaled_depth, const Matrix3f& scaled_in
 		}
 	}
 
-	int min_y_scaled = get_scaled_coordinate(min_y, cy, focal_length_scale) - 1;
-	int max_y_scaled = get_scaled_coordinate(max_y, cy, focal_length_scale) + 1;
+	return get_scaled_bounding_box(min_x, min_y, max_x, max_y, scaled_intrinsics, focal_length_scale);
+}
 
-	int min_x_scaled = get_scaled_coordinate(min_x, cx, focal_length_scale) - 1;
-	int max_x_scaled = get_scaled_coordinate(max_x, cx, focal_length_scale) + 1;
 
-	return { min_x_scaled, min_y_scaled, max_x_scaled - min_x_scaled, max_y_scaled - min_y_scaled };
+// Pixels of the scaled image the bounding box of the model can cover: the projection of its corners with a margin of
+// one pixel, the whole image if the box reaches behind the camera and an empty rect if it is outside the image.
+cv::Rect get_projected_region(const Matrix<float, 3, 8>& corners, const Matrix4f& model_pose, const Matrix3f& scaled_intrinsics, const cv::Rect& image_rect)
+{
+	const Matrix<float, 3, 8> camera_corners = (model_pose.topLeftCorner<3, 3>() * corners).colwise() + model_pose.topRightCorner<3, 1>();
+
+	if ((camera_corners.row(2).array() <= 0.0f).all()) return cv::Rect();
+	if ((camera_corners.row(2).array() <= 0.0f).any()) return image_rect;
+
+	const Matrix<float, 3, 8> projected = scaled_intrinsics * camera_corners;
+	const Array<float, 1, 8> x = projected.row(0).array() / projected.row(2).array();
+	const Array<float, 1, 8> y = projected.row(1).array() / projected.row(2).array();
+
+	// the pixel (x, y) covers [x, x + 1) x [y, y + 1)
+	const cv::Point top_left(static_cast<int>(floor(x.minCoeff())) - 1, static_cast<int>(floor(y.minCoeff())) - 1);
+	const cv::Point bottom_right(static_cast<int>(floor(x.maxCoeff())) + 2, static_cast<int>(floor(y.maxCoeff())) + 2);
+
+	return cv::Rect(top_left, bottom_right) & image_rect;
 }
 
 
-vector<Frame> Scene::convert_to_scene_frames()
+// Exact bounding box of the model from its hull vertices projected with the full intrinsics, like the rendered boxes
+// it may extend beyond the image borders. False if the hull reaches behind the camera.
+bool get_hull_bounding_box(const vector<Vector3f>& hull_vertices, const Matrix4f& model_pose, const Matrix3f& intrinsics, cv::Rect& bbox)
+{
+	const Matrix3f rotation = model_pose.topLeftCorner<3, 3>();
+	const Vector3f translation = model_pose.topRightCorner<3, 1>();
+
+	float min_x = numeric_limits<float>::max(), min_y = numeric_limits<float>::max();
+	float max_x = -numeric_limits<float>::max(), max_y = -numeric_limits<float>::max();
+
+	for (const Vector3f& vertex : hull_vertices)
+	{
+		const Vector3f projected = intrinsics * (rotation * vertex + translation);
+		if (projected(2) <= 0.0f) return false;
+
+		const float x = projected(0) / projected(2), y = projected(1) / projected(2);
+		min_x = min(min_x, x);
+		max_x = max(max_x, x);
+		min_y = min(min_y, y);
+		max_y = max(max_y, y);
+	}
+
+	// the pixel (x, y) covers [x, x + 1) x [y, y + 1)
+	const cv::Point top_left(static_cast<int>(floor(min_x)), static_cast<int>(floor(min_y)));
+	const cv::Point bottom_right(static_cast<int>(floor(max_x)) + 1, static_cast<int>(floor(max_y)) + 1);
+	bbox = cv::Rect(top_left, bottom_right);
+
+	return true;
+}
+
+
+ModelRenderer &Scene::get_renderer(ModelRenderers &renderers, const Model &model, bool scale_focal_length)
+{
+	const auto key = make_pair(model.model_file, scale_focal_length);
+
+	auto renderer = renderers.find(key);
+	if (renderer == renderers.end())
+	{
+		renderer = renderers.emplace(key, ModelRenderer(model, configuration, scale_focal_length)).first;
+	}
+
+	return renderer->second;
+}
+
+
+void Scene::convert_chunk(size_t chunk, size_t first_output_frame, ModelRenderers &renderers, Frame *frames)
 {
-	size_t number_of_frames = frame_poses.size();
 	size_t number_of_models = models.size();
 
 	Matrix3f scaled_intrinsics = configuration.get_intrinsics();
@@ -99,35 +189,209 @@ vector<Frame> Scene::convert_to_scene_frames()
 	scaled_intrinsics(0, 0) = focal_length_scale * scaled_intrinsics(0, 0);
 	scaled_intrinsics(1, 1) = focal_length_scale * scaled_intrinsics(1, 1);
 
-	vector<Frame> scene_frames(number_of_frames);
+	const cv::Rect image_rect(0, 0, configuration.get_image_width(), configuration.get_image_height());
+
+	size_t chunk_begin, chunk_end;
+	tie(chunk_begin, chunk_end) = get_chunk_frames(chunk);
 
-	for (int frame_idx = 0; frame_idx < number_of_frames; frame_idx++)
+	const BoundingBoxMode bbox_mode = configuration.get_bbox_mode();
+	const bool gt_info = configuration.get_gt_info();
+	// without focal length scaling the full resolution depth of the gt info is the scaled depth, so the rendered boxes
+	// are found in it instead of rendering twice
+	const bool bboxes_from_gt_info = gt_info && focal_length_scale == 1.0f;
+	// by frame and model, whether the box is found in the depth of the gt info
+	vector<bool> bbox_from_gt_info((chunk_end - chunk_begin) * number_of_models, false);
+
+	for (size_t frame_idx = chunk_begin; frame_idx < chunk_end; frame_idx++)
 	{
-		Frame frame;
-		frame.frame_id = frame_idx;
-		frame.scene_dir = scene_dir;
+		frames[frame_idx - chunk_begin].frame_id = static_cast<int>(frame_idx);
+		frames[frame_idx - chunk_begin].scene_dir = scene_dir;
+	}
 
-		cout << "Frame : " << frame_idx << endl;
-		Matrix4f world_to_cam = frame_poses[frame_idx].inverse();
+	// the poses of the chunk are rendered in one batch per model, poses whose bounding box projects outside the image
+	// are not rendered
+	vector<cv::Mat> scaled_depths;
+	vector<Matrix4f> model_poses, visible_poses;
+	vector<cv::Rect> regions, hull_bboxes;
+	vector<bool> rendered;
 
-		for (int model_idx = 0; model_idx < number_of_models; model_idx++)
+	for (int model_idx = 0; model_idx < number_of_models; model_idx++)
+	{
+		const Model& model = models[model_idx];
+
+		// the model space box and hull are the same for both, the scaled renderer is only needed for its depth
+		ModelRenderer& renderer = get_renderer(renderers, model, !bboxes_from_gt_info);
+		const Matrix<float, 3, 8> corners = renderer.get_bounding_box_corners();
+
+		model_poses.clear();
+		visible_poses.clear();
+		regions.clear();
+		hull_bboxes.clear();
+		rendered.clear();
+		for (size_t frame_idx = chunk_begin; frame_idx < chunk_end; frame_idx++)
 		{
-			const Model& model = models[model_idx];
+			model_poses.push_back(frame_poses[frame_idx].inverse() * model.canonical_pose);
+			regions.push_back(get_projected_region(corners, model_poses.back(), scaled_intrinsics, image_rect));
 
-			ModelRenderer& scaled_renderer = scaled_renderers[model_idx];
+			// hull boxes need no rendering unless the hull reaches behind the camera
+			cv::Rect hull_bbox;
+			const bool has_hull_bbox = bbox_mode == BBOX_MODE_HULL && regions.back().area() > 0 &&
+				get_hull_bounding_box(renderer.get_hull_vertices(), model_poses.back(), configuration.get_intrinsics(), hull_bbox);
+			hull_bboxes.push_back(hull_bbox);
+
+			const bool needs_depth = regions.back().area() > 0 && bbox_mode != BBOX_MODE_BOX_CORNERS && !has_hull_bbox;
+			bbox_from_gt_info[(frame_idx - chunk_begin) * number_of_models + model_idx] = needs_depth && bboxes_from_gt_info;
+			rendered.push_back(needs_depth && !bboxes_from_gt_info);
+			if (rendered.back()) visible_poses.push_back(model_poses.back());
+		}
+
+		if (!visible_poses.empty()) renderer.render_depth_batch(visible_poses, scaled_depths);
+
+		size_t visible_idx = 0;
+		for (size_t frame_idx = chunk_begin; frame_idx < chunk_end; frame_idx++)
+		{
+			const cv::Rect& region = regions[frame_idx - chunk_begin];
 
-			cv::Mat scaled_depth;
-			cv::Mat scaled_color;
+			const cv::Rect& hull_bbox = hull_bboxes[frame_idx - chunk_begin];
 
-			Matrix4f model_pose = world_to_cam * model.canonical_pose;
-			scaled_renderer.render(model_pose, scaled_depth, scaled_color);
-			
-			auto bbox = get_bounding_box(scaled_depth, scaled_intrinsics, focal_length_scale);
-			frame.frame_models.emplace_back(FrameModel(model.model_id, model_pose, bbox));
+			Vector4i bbox;
+			if (rendered[frame_idx - chunk_begin])
+			{
+				bbox = get_bounding_box(scaled_depths[visible_idx++], region, scaled_intrinsics, focal_length_scale);
+			}
+			else if (region.area() == 0 || bbox_from_gt_info[(frame_idx - chunk_begin) * number_of_models + model_idx])
+			{
+				// as found in an empty depth image, boxes from the gt info depth replace it below
+				bbox = get_scaled_bounding_box(image_rect.width - 1, image_rect.height - 1, 0, 0, scaled_intrinsics, focal_length_scale);
+			}
+			else if (bbox_mode == BBOX_MODE_HULL)
+			{
+				bbox = { hull_bbox.x, hull_bbox.y, hull_bbox.width, hull_bbox.height };
+			}
+			else
+			{
+				bbox = get_scaled_bounding_box(region.x, region.y, region.x + region.width - 1, region.y + region.height - 1, scaled_intrinsics, focal_length_scale);
+			}
+
+			frames[frame_idx - chunk_begin].frame_models.emplace_back(FrameModel(model.model_id, model_poses[frame_idx - chunk_begin], bbox));
 		}
+	}
 
-		scene_frames[frame_idx] = frame;
+	if (gt_info) add_visibility_info(chunk_begin, chunk_end, first_output_frame, renderers, frames, bbox_from_gt_info);
+}
+
+
+void Scene::add_visibility_info(size_t chunk_begin, size_t chunk_end, size_t first_output_frame, ModelRenderers &renderers,
+                                Frame *frames, const vector<bool> &bbox_from_gt_info)
+{
+	const Matrix3f& intrinsics = configuration.get_intrinsics();
+	const cv::Rect image_rect(0, 0, configuration.get_image_width(), configuration.get_image_height());
+	const fs::path out_dir(configuration.get_out_dir());
+
+	// recorded depth in meters, 0 where it is missing
+	vector<cv::Mat> recorded_depths(chunk_end - chunk_begin);
+	for (size_t frame_idx = chunk_begin; frame_idx < chunk_end; frame_idx++)
+	{
+		const fs::path depth_file = fs::path(scene_dir) / "images" / "depth" / get_image_filename_for_idx(frame_idx);
+		cv::Mat& recorded_depth = recorded_depths[frame_idx - chunk_begin];
+
+		cv::imread(depth_file.string(), -1).convertTo(recorded_depth, CV_32FC1, 0.001);
+		if (recorded_depth.size() != image_rect.size())
+		{
+			cerr << "Invalid depth image: " << depth_file << ", all pixels count as visible" << endl;
+			recorded_depth = cv::Mat::zeros(image_rect.size(), CV_32FC1);
+		}
 	}
 
-	return scene_frames;
+	// full resolution depth of the chunk, rendered in one batch per model like the scaled depth
+	vector<cv::Mat> depths;
+	vector<Matrix4f> visible_poses;
+	vector<cv::Rect> regions;
+	cv::Mat mask, mask_visib;
+
+	for (size_t model_idx = 0; model_idx < models.size(); model_idx++)
+	{
+		ModelRenderer& renderer = get_renderer(renderers, models[model_idx], false);
+		const Matrix<float, 3, 8> corners = renderer.get_bounding_box_corners();
+
+		visible_poses.clear();
+		regions.clear();
+		for (size_t frame_idx = chunk_begin; frame_idx < chunk_end; frame_idx++)
+		{
+			const Matrix4f& pose = frames[frame_idx - chunk_begin].frame_models[model_idx].pose;
+			regions.push_back(get_projected_region(corners, pose, intrinsics, image_rect));
+			if (regions.back().area() > 0) visible_poses.push_back(pose);
+		}
+
+		if (!visible_poses.empty()) renderer.render_depth_batch(visible_poses, depths);
+
+		size_t visible_idx = 0;
+		for (size_t frame_idx = chunk_begin; frame_idx < chunk_end; frame_idx++)
+		{
+			FrameModel& frame_model = frames[frame_idx - chunk_begin].frame_models[model_idx];
+			const cv::Rect& region = regions[frame_idx - chunk_begin];
+			const cv::Mat& recorded_depth = recorded_depths[frame_idx - chunk_begin];
+
+			mask = cv::Mat::zeros(image_rect.size(), CV_8UC1);
+			mask_visib = cv::Mat::zeros(image_rect.size(), CV_8UC1);
+
+			// min x, min y, max x, max y
+			Vector4i bounds_obj(image_rect.width, image_rect.height, -1, -1);
+			Vector4i bounds_visib = bounds_obj;
+			int px_count_all = 0, px_count_valid = 0, px_count_visib = 0;
+
+			if (region.area() > 0)
+			{
+				const cv::Mat& depth = depths[visible_idx++];
+				if (bbox_from_gt_info[(frame_idx - chunk_begin) * models.size() + model_idx])
+				{
+					frame_model.bbox = get_bounding_box(depth, region, intrinsics, 1.0f);
+				}
+
+				for (int i = region.y; i < region.y + region.height; ++i)
+				{
+					const float* depth_row = depth.ptr<float>(i);
+					const float* recorded_row = recorded_depth.ptr<float>(i);
+					uchar* mask_row = mask.ptr<uchar>(i);
+					uchar* mask_visib_row = mask_visib.ptr<uchar>(i);
+
+					for (int j = region.x; j < region.x + region.width; ++j)
+					{
+						if (!(depth_row[j] > 0.0f)) continue;
+
+						mask_row[j] = 255;
+						++px_count_all;
+						bounds_obj = Vector4i(min(bounds_obj(0), j), min(bounds_obj(1), i), max(bounds_obj(2), j), max(bounds_obj(3), i));
+
+						const bool has_recorded_depth = recorded_row[j] > 0.0f;
+						if (has_recorded_depth) ++px_count_valid;
+
+						// pixels without recorded depth cannot be occluded
+						if (!has_recorded_depth || depth_row[j] <= recorded_row[j] + VISIBILITY_TOLERANCE)
+						{
+							mask_visib_row[j] = 255;
+							++px_count_visib;
+							bounds_visib = Vector4i(min(bounds_visib(0), j), min(bounds_visib(1), i), max(bounds_visib(2), j), max(bounds_visib(3), i));
+						}
+					}
+				}
+			}
+
+			auto to_bbox = [](const Vector4i& bounds)
+			{
+				return bounds(2) < 0 ? Vector4i::Constant(-1) : Vector4i(bounds(0), bounds(1), bounds(2) - bounds(0) + 1, bounds(3) - bounds(1) + 1);
+			};
+
+			frame_model.px_count_all = px_count_all;
+			frame_model.px_count_valid = px_count_valid;
+			frame_model.px_count_visib = px_count_visib;
+			frame_model.visib_fract = px_count_all > 0 ? static_cast<float>(px_count_visib) / px_count_all : 0.0f;
+			frame_model.bbox_obj = to_bbox(bounds_obj);
+			frame_model.bbox_visib = to_bbox(bounds_visib);
+
+			const string mask_filename = get_mask_filename_for_idx(first_output_frame + frame_idx - chunk_begin, model_idx);
+			cv::imwrite((out_dir / "mask" / mask_filename).string(), mask);
+			cv::imwrite((out_dir / "mask_visib" / mask_filename).string(), mask_visib);
+		}
+	}
 }
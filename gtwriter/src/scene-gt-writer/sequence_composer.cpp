@@ -8,7 +8,10 @@
 //#######################################################################
 
 #include "sequence_composer.h"
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include "scene.h"
 #include <io_utils.hpp>
 
@@ -185,16 +188,68 @@ bool compose_joined_sequence(const Configuration& configuration, std::vector<Fra
 	vector<Scene> scenes;
 	if (!compose_scenes(configuration, scenes)) return false;
 
-	size_t total_number_of_frames = 0;
+	// the chunks of all scenes with the first slot of their frames in the joined sequence, which keeps the scene order
+	struct SceneChunk
+	{
+		Scene* scene;
+		size_t chunk;
+		size_t first_frame;
+	};
 
-	for (auto& scene : scenes) total_number_of_frames += scene.get_number_of_frames();
-	joined_sequences.reserve(total_number_of_frames);
+	vector<SceneChunk> chunks;
+	size_t total_number_of_frames = 0;
 
 	for (auto& scene : scenes)
 	{
-		auto scene_frames = scene.convert_to_scene_frames();
-		joined_sequences.insert(joined_sequences.end(), scene_frames.begin(), scene_frames.end());
+		for (size_t chunk = 0; chunk < scene.get_number_of_chunks(); ++chunk)
+		{
+			chunks.push_back({ &scene, chunk, total_number_of_frames + scene.get_chunk_frames(chunk).first });
+		}
+		total_number_of_frames += scene.get_number_of_frames();
+	}
+	joined_sequences.resize(total_number_of_frames);
+
+	// a hidden window can only render from the thread it was created in
+	size_t number_of_threads = 1;
+	if (configuration.get_headless() || configuration.get_cpu_rendering())
+	{
+		number_of_threads = configuration.get_number_of_threads() > 0 ? configuration.get_number_of_threads() : max(1u, thread::hardware_concurrency());
+	}
+	number_of_threads = min(number_of_threads, chunks.size());
+
+	// the masks are written by the threads
+	if (configuration.get_gt_info())
+	{
+		fs::create_directories(fs::path(configuration.get_out_dir()) / "mask");
+		fs::create_directories(fs::path(configuration.get_out_dir()) / "mask_visib");
 	}
 
+	// the application and the shared contexts belong to this thread, the others only create their own contexts
+	initialize_rendering(get_render_backend(configuration));
+
+	atomic<size_t> next_chunk(0);
+	mutex output_mutex;
+
+	auto worker = [&]()
+	{
+		ModelRenderers renderers;
+		for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++)
+		{
+			const SceneChunk& chunk = chunks[i];
+			{
+				const auto frames = chunk.scene->get_chunk_frames(chunk.chunk);
+				lock_guard<mutex> lock(output_mutex);
+				cout << "Frames : " << frames.first << " - " << frames.second - 1 << endl;
+			}
+			chunk.scene->convert_chunk(chunk.chunk, chunk.first_frame, renderers, &joined_sequences[chunk.first_frame]);
+		}
+	};
+
+	vector<thread> threads;
+	for (size_t i = 1; i < number_of_threads; ++i) threads.emplace_back(worker);
+
+	worker();
+	for (auto& thread : threads) thread.join();
+
 	return true;
 }
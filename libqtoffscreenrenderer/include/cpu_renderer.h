@@ -0,0 +1,115 @@
+//######################################################################
+//#   Liboffscreenrenderer Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#ifndef CPU_RENDERER_H
+#define CPU_RENDERER_H
+
+#include "renderer.h"
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+
+struct RasterInstance
+{
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	const Model *model;
+	// model to camera
+	Eigen::Isometry3f pose;
+	// written to the object ids, 0 is the background
+	int id;
+};
+
+typedef std::vector<RasterInstance, Eigen::aligned_allocator<RasterInstance>> RasterInstances;
+
+// Tile based software rasterizer giving the same images as the painter: metric depth with 0 for the background,
+// the perspective-correct interpolated vertex colors (BGR) and the object ids. The triangles are binned into tiles
+// which are rasterized by number_of_threads threads (0 uses all cores) of a pool shared by all rasterizers, four pixels
+// at a time.
+// Triangles reaching in front of the near plane are dropped instead of clipped.
+class CpuRasterizer
+{
+public:
+	CpuRasterizer(float z_near, float z_far, int number_of_threads = 0);
+
+	// Renders the rect of the image seen with the intrinsics, the pixel (x, y) covers [x, x + 1) x [y, y + 1)
+	// of the projection like the framebuffer of the painter. Every output is optional and gets the size of the rect.
+	void render(const RasterInstances &instances, const Eigen::Matrix3f &intrinsics, const cv::Rect &rect,
+	            cv::Mat *depth, cv::Mat *color, cv::Mat *object_ids);
+
+private:
+	struct Triangle
+	{
+		// edge functions a * x + b * y + c of the edges opposite to each vertex, normalized to give the barycentric weights
+		Eigen::Vector3f a, b, c;
+		Eigen::Vector3f inverse_depths;
+		// colors of the vertices divided by their depth, one per column
+		Eigen::Matrix3f colors_over_depth;
+		int id;
+		// covered pixels of the rect, inclusive
+		int min_x, min_y, max_x, max_y;
+	};
+
+	void rasterize_tile(int tile, const cv::Rect &tile_rect, cv::Mat &depth, cv::Mat *color, cv::Mat *object_ids) const;
+
+	float z_near;
+	float z_far;
+	int number_of_threads;
+
+	// kept between render calls to avoid allocations
+	std::vector<Triangle> triangles;
+	std::vector<std::vector<int>> tile_triangles;
+	std::vector<Eigen::Vector3f> projected_vertices;
+	cv::Mat depth_buffer;
+};
+
+class CpuRenderer : public RendererInterface
+{
+public:
+	CpuRenderer(RendererConfiguration &configuration);
+	void render(Eigen::Matrix4f &pose_matrix, cv::Mat &depth, cv::Mat &color);
+	void render(Eigen::Matrix4f &pose_matrix, float scale, cv::Mat &depth, cv::Mat &color);
+	void get_model_edges(Eigen::Matrix4f &pose_matrix, float crease_angle, std::vector<Eigen::Vector3f> &edge_points);
+	void render(Eigen::Matrix4f &pose_matrix, float scale, int buffers, const cv::Rect &roi, cv::Mat &depth, cv::Mat &color);
+	// the poses are rendered in parallel on up to cpu_threads threads, one pose per thread at a time
+	void render_batch(std::vector<Eigen::Matrix4f> &pose_matrices, float scale, std::vector<cv::Mat> &depths);
+	void get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max);
+	void get_model_hull_vertices(std::vector<Eigen::Vector3f> &hull_vertices);
+private:
+	Eigen::Matrix3f get_scaled_intrinsics(float scale) const;
+	cv::Rect get_scaled_image_rect(float scale) const;
+
+	Eigen::Matrix3f intrinsics;
+	int width;
+	int height;
+
+	std::shared_ptr<Model> model;
+	CpuRasterizer rasterizer;
+	int number_of_threads;
+	// single threaded rasterizers of the batch threads, kept between batches
+	std::vector<CpuRasterizer> batch_rasterizers;
+
+	float z_near;
+	float z_far;
+};
+
+class CpuSceneRenderer : public SceneRendererInterface
+{
+public:
+	CpuSceneRenderer(SceneRendererConfiguration &configuration);
+	void render(std::vector<Eigen::Matrix4f> &pose_matrices, cv::Mat &depth, cv::Mat &object_ids);
+private:
+	Eigen::Matrix3f intrinsics;
+	int width;
+	int height;
+
+	std::vector<std::shared_ptr<Model>> models;
+	CpuRasterizer rasterizer;
+};
+
+#endif
@@ -14,12 +14,21 @@
 
 #include <Eigen/Core>
 #include <opencv2/core.hpp>
+#include <cstdint>
 
 #include "painter.h"
 
 using namespace std;
 
 
+// Mesh edge with its adjacent faces, the second face is -1 on open boundaries.
+struct MeshEdge
+{
+    Eigen::Vector2i vertices;
+    Eigen::Vector2i faces;
+};
+
+
 class Model : public PaintObject
 {
 public:
@@ -31,7 +40,8 @@ public:
     ~Model();
 
     void paint();
-    void bindVBOs();
+    void paintWithColor(GLubyte r, GLubyte g, GLubyte b);
+    void bindVBOs(Painter &painter);
 
     void computeBoundingBox();
 
@@ -43,7 +53,23 @@ public:
 
     void computeLocalCoordsColors();
 
-    vector<bool> computeEdgePoints();
+    vector<bool> computeEdgePoints() const;
+
+    void computeFaceNormals();
+
+    void computeMeshEdges();
+
+    // Indices into m_mesh_edges of the open boundary edges and of the creases with a dihedral angle above
+    // crease_angle (degrees), independent of the view. Like computeViewEdges it only reads the face normals and mesh
+    // edges of loadPLY, so renderers of several threads can share the model; point clouds have no edges.
+    vector<int> computeFeatureEdges(float crease_angle) const;
+
+    // Indices of the points on the convex hull, e.g. to find the exact image bounding box of the model
+    void computeConvexHull();
+
+    // Appends the endpoints (in model coordinates, two per edge) of the silhouette edges as seen from the
+    // model_to_camera pose and of the creases with a dihedral angle above crease_angle (degrees) facing the camera.
+    void computeViewEdges(const Eigen::Isometry3f &model_to_camera, float crease_angle, vector<Eigen::Vector3f> &edge_points) const;
 
     vector<Eigen::Vector3f> &getPoints() {return m_points;}
     vector<Eigen::Vector3f> &getColors() {return m_colors;}
@@ -51,7 +77,10 @@ public:
     vector<Eigen::Vector3i> &getFaces() {return m_faces;}
 
     float getCubeSize() {return m_cube_size;}
-    bool loadPLY(string filename);
+    // the vertex buffers are created with the painter, renderers drawing without OpenGL pass none.
+    // The parsed mesh with its normals, colors, bounding box and edges is cached in filename + ".cache", 
+    // which is used instead of parsing the ply again as long as the hash of the ply matches.
+    bool loadPLY(string filename, Painter *painter = 0);
     void savePLY(string filename);
 
 	Eigen::Vector3f bb_min,bb_max, centroid;
@@ -61,6 +90,13 @@ public:
     vector<Eigen::Vector3f> m_normals, m_colors, m_points, m_localCoordColors;
     vector<Eigen::Vector3i> m_faces;
 
+    // Face normals and unique edges, only computed on demand for the view edges
+    vector<Eigen::Vector3f> m_face_normals;
+    vector<MeshEdge> m_mesh_edges;
+
+    // Convex hull vertices, computed when loading
+    vector<int> m_hull_vertices;
+
     // Subsampled cloud for intermediate computations
     vector<Eigen::Vector3f> m_subpoints, m_subnormals;
     vector<cv::Vec3b> m_subcolors;
@@ -68,6 +104,14 @@ public:
     
 private:
 
+    void setBoundingBoxCorners();
+
+    // Vertex to face adjacency in compressed rows, the faces of vertex v are vertex_faces[offsets[v]..offsets[v+1])
+    void computeVertexFaces(vector<int> &offsets, vector<int> &vertex_faces) const;
+
+    bool loadCache(const string &cache_file, uint64_t source_hash);
+    void saveCache(const string &cache_file, uint64_t source_hash) const;
+
     // Length of voxel [m] for subsampling.
     float m_cube_size;
 
@@ -79,5 +123,23 @@ private:
     vector<Eigen::Vector3f> m_vertex_data;
 
 }; 
+
+
+// A model placed in the scene with its own pose, painted in a flat color encoding its id.
+class ModelInstance : public PaintObject
+{
+public:
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    ModelInstance(Model *model, const Eigen::Isometry3f &pose, int id);
+    void paint();
+
+    Model *m_model;
+    // Model to camera transformation.
+    Eigen::Isometry3f m_pose;
+    // Id encoded into the red and green channels, 0 is reserved for the background.
+    int m_id;
+};
 #endif
 
@@ -12,11 +12,16 @@
 
 #include <QtOpenGL>
 #include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
 
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <opencv2/core.hpp>
 
 
@@ -32,14 +37,120 @@ public:
 };
 
 
-class SingletonPainter : public QGLWidget, protected QOpenGLFunctions
+// OpenGL context of the renderers: a hidden Qt widget, which needs a display, or a headless offscreen context (EGL).
+// The backend is chosen by the first renderer of a process and shared by all later ones.
+// The cpu backend rasterizes in software (cpu_renderer.h) and does not use the painter at all.
+enum RenderBackend
+{
+    RENDER_BACKEND_WIDGET = 0,
+    RENDER_BACKEND_HEADLESS = 1,
+    RENDER_BACKEND_CPU = 2
+};
+
+// OpenGL context the painter renders with, all drawing goes into framebuffer objects
+class RenderContext
+{
+public:
+    virtual ~RenderContext(){}
+    virtual bool isValid()=0;
+    virtual void makeCurrent()=0;
+    virtual void doneCurrent()=0;
+    // new context of the same kind sharing buffer objects with this one, created on the calling thread
+    virtual RenderContext* createShared()=0;
+};
+
+
+// Context of a hidden QGLWidget, needs a QApplication and a display (X server or Xvfb)
+class WidgetRenderContext : public RenderContext
+{
+public:
+    WidgetRenderContext(const QGLWidget *share=0);
+    bool isValid();
+    void makeCurrent(){m_widget.makeCurrent();}
+    void doneCurrent(){m_widget.doneCurrent();}
+    RenderContext* createShared(){return new WidgetRenderContext(&m_widget);}
+
+private:
+    QGLWidget m_widget;
+};
+
+
+// Context without any window. With the minimalegl platform and EGL_PLATFORM=surfaceless (Mesa, the defaults set by
+// Painter) it needs no display, so many processes can render in parallel on a server.
+// With core_profile it is an OpenGL 3.3 core context for the shader painter, which also uses it with the widget backend.
+// Offscreen surfaces have to be created on the gui thread, so the contexts of all threads are made current on the
+// surface of Painter::getOffscreenSurface; with surfaceless EGL contexts it is no EGL surface at all.
+class HeadlessRenderContext : public RenderContext
+{
+public:
+    HeadlessRenderContext(QOffscreenSurface *surface, QOpenGLContext *share=0, bool core_profile=false);
+    bool isValid(){return m_context.isValid();}
+    void makeCurrent(){m_context.makeCurrent(m_surface);}
+    void doneCurrent(){m_context.doneCurrent();}
+    RenderContext* createShared(){return new HeadlessRenderContext(m_surface,&m_context,m_core_profile);}
+
+    static QSurfaceFormat getFormat(bool core_profile);
+
+private:
+    bool m_core_profile;
+    QOffscreenSurface *m_surface;
+    QOpenGLContext m_context;
+};
+
+
+// Tile layout and readback of batch framebuffers, shared by the painters: images of one size are drawn into the tiles
+// of a framebuffer in chunks, and every chunk is read back through one of two pixel buffer objects, so that the
+// readback of one chunk overlaps with drawing the next. Without OpenGL 3.2 fences the tiles are read synchronously.
+// All calls need the context of the owning painter to be current.
+class TiledBatch : protected QOpenGLExtraFunctions
+{
+public:
+
+    // Chooses the tiles of a chunk for up to tiles images within the renderbuffer size and sizes the pixel buffers.
+    // Returns true if the framebuffer has to be (re)created with getWidth() x getHeight(), a framebuffer large
+    // enough for earlier batches is kept.
+    bool prepare(int tiles, int tile_width, int tile_height);
+
+    int getChunkSize() const {return m_chunk_size;}
+    int getWidth() const {return m_columns*m_tile_width;}
+    int getHeight() const {return m_rows*m_tile_height;}
+    cv::Point getTileOrigin(int tile) const {return cv::Point((tile%m_columns)*m_tile_width,(tile/m_columns)*m_tile_height);}
+
+    // Draws count images in chunks with draw_chunk(begin, end), which leaves the batch framebuffer bound with the tile
+    // i - begin of every image i, and reads the read_rect of every tile with the format (a single float channel)
+    // into depths. convert, if set, is applied to each of them.
+    void paint(size_t count, const std::function<void(size_t, size_t)> &draw_chunk, GLenum format,
+               const cv::Rect &read_rect, vector<cv::Mat> &depths, const std::function<void(cv::Mat&)> &convert);
+
+    // Deletes the pixel buffers, the owner calls it with its context current before deleting the context
+    void destroy();
+
+private:
+
+    void copyTiles(int buffer, size_t begin, size_t end, const cv::Rect &read_rect, vector<cv::Mat> &depths,
+                   const std::function<void(cv::Mat&)> &convert);
+
+    bool m_initialized = false;
+    bool m_async_readback = false;
+    int m_tile_width = 0, m_tile_height = 0;
+    int m_columns = 0, m_rows = 0;
+    int m_chunk_size = 0;
+    GLuint m_pbos[2] = {0, 0};
+    GLsync m_fences[2] = {nullptr, nullptr};
+};
+
+
+// Paints into framebuffer objects of one size with its own context. A context belongs to the thread that created it,
+// so every painter is only used by one thread, see Painter.
+class FramebufferPainter : protected QOpenGLExtraFunctions
 {
 public:
 	
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-    SingletonPainter(float p_near,float p_far,int width,int height);
-    ~SingletonPainter();
+    // takes ownership of the context
+    FramebufferPainter(float p_near,float p_far,int width,int height,RenderContext *context);
+    ~FramebufferPainter();
 
     int getHeight(){return m_fbo->size().height();}
     int getWidth(){return m_fbo->size().width();}
@@ -53,14 +164,32 @@ public:
 	
     void paint(int x=0,int y=0,int w=0,int h=0);
 
+    // Draws the objects without reading anything back, followed by the read calls for the buffers needed.
+    // They read the rect of the framebuffer straight into dest, which is only (re)allocated if its size or type differ.
+    void draw();
+    void readDepth(const cv::Rect &rect, cv::Mat &dest);
+    void readColor(const cv::Rect &rect, cv::Mat &dest);
+
+    // Paints every list of objects into its own tile of a batch framebuffer and returns the depth of the read_rect 
+    // of each tile. The tiles are read back in chunks through two pixel buffer objects, so that the readback of one 
+    // chunk overlaps with drawing the next. Falls back to synchronous reads without OpenGL 3.2 fences.
+    void paintBatch(const vector<vector<PaintObject*>> &batch, const cv::Rect &read_rect, vector<cv::Mat> &depths);
+
+    // The buffers are shared by all contexts, so every painter can draw the models bound by another one
     void bindVBOs(vector<Eigen::Vector3f> &vertex_data, vector<Eigen::Vector3i> &faces_data, GLuint &vert, GLuint &ind);
     void drawVBOs(GLuint vert, GLuint ind, int count);
 
+    // painter whose context is current on the calling thread, for the paint objects
+    static FramebufferPainter* current(){return m_current;}
+
     inline void copyColorTo(cv::Mat &dest){m_color(copy_rect).copyTo(dest);}
     inline void copyDepthTo(cv::Mat &dest){m_depth(copy_rect).copyTo(dest);}
 
 protected:
     
+    void makeCurrent(){m_context->makeCurrent();m_current=this;}
+    void doneCurrent(){m_context->doneCurrent();m_current=0;}
+
     void convertZBufferToDepth(cv::Mat &depth);
     void resizeGL(int w,int h);
 	void paintGL();
@@ -77,66 +206,73 @@ private:
 	cv::Mat m_depth,m_color;
     //Vector of objects that is painted (in this order).
     vector<PaintObject*> m_objects;
+    //Context of the widget or headless backend.
+    RenderContext *m_context;
     //QT framebuffer object for offline rendering.
     QOpenGLFramebufferObject *m_fbo;
+
+    //Tiled framebuffer for batches and its readback.
+    QOpenGLFramebufferObject *m_batch_fbo = nullptr;
+    TiledBatch m_batch;
+
+    static thread_local FramebufferPainter *m_current;
 };
 
 
-class Painter : protected QOpenGLFunctions
+// Handle of the framebuffer painter of the calling thread for a size and depth range. Painters are pooled: handles
+// created on the same thread with the same parameters share one painter and its context, handles of other threads or
+// sizes get their own, so renderers of different resolutions coexist and threads can render concurrently. A handle
+// must only be used on the thread that created it and must not outlive it. The painters of a thread are destroyed when
+// it exits, their buffers shared with the other contexts stay.
+class Painter
 {
 
 public:
 	
-    Painter()
-    {}
+    Painter(int width, int height, float z_near, float z_far, RenderBackend backend=RENDER_BACKEND_WIDGET);
 
     ~Painter(){}
 
-    int getHeight(){return getSingleton()->getHeight();}
-    int getWidth(){return getSingleton()->getWidth();}
-    float getNear(){return getSingleton()->getNear();}
-    float getFar(){return getSingleton()->getFar();}
+    int getHeight(){return m_painter->getHeight();}
+    int getWidth(){return m_painter->getWidth();}
+    float getNear(){return m_painter->getNear();}
+    float getFar(){return m_painter->getFar();}
     inline float getAspect(){return static_cast<float>(getWidth())/static_cast<float>(getHeight());}
 
-    void setBackground(Eigen::Vector3f &col){getSingleton()->clearBackground(col(0),col(1),col(2));}
-    void setBackground(float r,float g,float b){getSingleton()->clearBackground(r,g,b);}
-    void clearObjects(){getSingleton()->clearObjects();}
+    void setBackground(Eigen::Vector3f &col){m_painter->clearBackground(col(0),col(1),col(2));}
+    void setBackground(float r,float g,float b){m_painter->clearBackground(r,g,b);}
+    void clearObjects(){m_painter->clearObjects();}
 
-    inline void addPaintObject(PaintObject *object){getSingleton()->addPaintObject(object);}
+    inline void addPaintObject(PaintObject *object){m_painter->addPaintObject(object);}
 	
-    inline void paint(int x=0,int y=0,int w=0,int h=0){getSingleton()->paint(x,y,w,h);}
+    inline void paint(int x=0,int y=0,int w=0,int h=0){m_painter->paint(x,y,w,h);}
 
-    inline void copyColorTo(cv::Mat &dest){getSingleton()->copyColorTo(dest);}
-    inline void copyDepthTo(cv::Mat &dest){getSingleton()->copyDepthTo(dest);}
+    inline void copyColorTo(cv::Mat &dest){m_painter->copyColorTo(dest);}
+    inline void copyDepthTo(cv::Mat &dest){m_painter->copyDepthTo(dest);}
 
-	static float z_near;
-	static float z_far;
-	
-	static int width;
-	static int height;
-
-	static SingletonPainter* getSingleton()
-	{
-		if (m_singleton == 0)
-		{
-			int argc = 0;
-			char **argv = 0;
-			if (!QApplication::instance()) new QApplication(argc, argv);
-			if (!QGLFormat::hasOpenGL() || !QGLFramebufferObject::hasOpenGLFramebufferObjects())
-			{
-				cerr << "OpenGL error: No support of OpenGL/framebuffer objects." << endl;
-				exit(0);
-			}
-			m_singleton = new SingletonPainter(z_near, z_far, width, height);
-
-		}
-		return m_singleton;
-	}
+    inline void draw(){m_painter->draw();}
+    inline void readDepth(const cv::Rect &rect, cv::Mat &dest){m_painter->readDepth(rect,dest);}
+    inline void readColor(const cv::Rect &rect, cv::Mat &dest){m_painter->readColor(rect,dest);}
+    inline void paintBatch(const vector<vector<PaintObject*>> &batch, const cv::Rect &read_rect, vector<cv::Mat> &depths)
+        {m_painter->paintBatch(batch,read_rect,depths);}
+
+    inline void bindVBOs(vector<Eigen::Vector3f> &vertex_data, vector<Eigen::Vector3i> &faces_data, GLuint &vert, GLuint &ind)
+        {m_painter->bindVBOs(vertex_data,faces_data,vert,ind);}
+
+    // Creates the application and the first context of the backend, which all later contexts share the buffers with, and
+    // the offscreen surfaces. Qt needs them on the main (gui) thread: call it there before renderers are created on
+    // other threads. Painters created on the main thread initialize on first use, later calls do nothing.
+    static void initialize(RenderBackend backend);
+
+    // Surface of the headless contexts of all threads, created by initialize
+    static QOffscreenSurface* getOffscreenSurface(bool core_profile);
 
 private:
+
+    // Creates the context of a new painter on the calling thread, sharing its buffers with the first context
+    static RenderContext* createContext(RenderBackend backend);
 	
-    //We need only ony QT framebuffer object in which we paint
-    static SingletonPainter *m_singleton;
+    std::shared_ptr<FramebufferPainter> m_painter;
 	
 };
 
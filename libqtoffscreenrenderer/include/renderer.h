@@ -13,8 +13,10 @@
 #include <Eigen/Core>
 #include "model.h"
 #include "painter.h"
+#include "shader_painter.h"
 #include <iostream>
 #include <memory>
+#include <vector>
 
 #ifdef _WIN32
 
@@ -39,31 +41,130 @@ struct RendererConfiguration
 	float z_far;
 
 	std::string model_file;
+	RenderBackend backend = RENDER_BACKEND_WIDGET;
+	// threads of a cpu backend render call, 0 for all cores; 1 if the callers already render in parallel
+	int cpu_threads = 0;
+};
+
+// Buffers read back by a render call
+enum RenderBuffers
+{
+	RENDER_DEPTH = 1,
+	RENDER_COLOR = 2
 };
 
 class RendererInterface {
 
 public:
+	virtual ~RendererInterface() = default;
+
 	virtual void render(Eigen::Matrix4f &pose_matrix, cv::Mat &depth, cv::Mat &color) = 0;
+
+	// Renders with the intrinsics scaled by scale (0 < scale <= 1) into an image of 
+	// the correspondingly reduced size, e.g. for coarse levels of an image pyramid.
+	virtual void render(Eigen::Matrix4f &pose_matrix, float scale, cv::Mat &depth, cv::Mat &color) = 0;
+
+	// Endpoints of the silhouette and crease edges of the model (pairs of points in model coordinates)
+	// for the pose, computed from the mesh without rendering. Edges hidden by other parts of the model are included.
+	virtual void get_model_edges(Eigen::Matrix4f &pose_matrix, float crease_angle, std::vector<Eigen::Vector3f> &edge_points) = 0;
+
+	// Reads back only the requested buffers (RenderBuffers flags) and only the roi in pixels of the scaled image,
+	// an empty roi covers the whole image. Mats already of the roi size and type, e.g. buffers reused across frames 
+	// or views into larger images, are written in place without allocations.
+	virtual void render(Eigen::Matrix4f &pose_matrix, float scale, int buffers, const cv::Rect &roi, cv::Mat &depth, cv::Mat &color) = 0;
+
+	// Renders the depth of many poses at once, tiled into one framebuffer and read back asynchronously. 
+	// depths gets one image per pose, images of the right size are reused.
+	virtual void render_batch(std::vector<Eigen::Matrix4f> &pose_matrices, float scale, std::vector<cv::Mat> &depths) = 0;
+
+	// Axis aligned bounding box of the model in model coordinates, e.g. to cull poses outside the image before rendering
+	virtual void get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max) = 0;
+
+	// Vertices of the convex hull of the model in model coordinates, their projections bound the model in any image
+	virtual void get_model_hull_vertices(std::vector<Eigen::Vector3f> &hull_vertices) = 0;
 };
 
 typedef RendererInterface* RendererInterfaceHandle;
 
+struct SceneRendererConfiguration
+{
+	int width;
+	int height;
+
+	Eigen::Matrix3f intrinsics;
+
+	float z_near;
+	float z_far;
+
+	std::vector<std::string> model_files;
+	RenderBackend backend = RENDER_BACKEND_WIDGET;
+	// threads of a cpu backend render call, 0 for all cores; 1 if the callers already render in parallel
+	int cpu_threads = 0;
+};
+
+class SceneRendererInterface {
+
+public:
+	virtual ~SceneRendererInterface() = default;
+
+	// Renders all models in a single pass, one pose per model file. Object ids (CV_16UC1) hold
+	// the index of the closest model + 1 for every pixel and 0 for the background.
+	virtual void render(std::vector<Eigen::Matrix4f> &pose_matrices, cv::Mat &depth, cv::Mat &object_ids) = 0;
+};
+
+typedef SceneRendererInterface* SceneRendererInterfaceHandle;
+
+// Painters of the renderers: the shader painter serves the widget and the headless backend whenever OpenGL 3.3 core
+// profile is available, the fixed function painter is only created as its fallback. The cpu backend uses neither.
 class Renderer : public RendererInterface
 {
 public:
 	Renderer(RendererConfiguration &configuration);
 	void render(Eigen::Matrix4f &pose_matrix, cv::Mat &depth, cv::Mat &color);
+	void render(Eigen::Matrix4f &pose_matrix, float scale, cv::Mat &depth, cv::Mat &color);
+	void get_model_edges(Eigen::Matrix4f &pose_matrix, float crease_angle, std::vector<Eigen::Vector3f> &edge_points);
+	void render(Eigen::Matrix4f &pose_matrix, float scale, int buffers, const cv::Rect &roi, cv::Mat &depth, cv::Mat &color);
+	void render_batch(std::vector<Eigen::Matrix4f> &pose_matrices, float scale, std::vector<cv::Mat> &depths);
+	void get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max);
+	void get_model_hull_vertices(std::vector<Eigen::Vector3f> &hull_vertices);
 private: 
+	Eigen::Matrix3f get_scaled_intrinsics(float scale) const;
+	cv::Rect get_scaled_image_rect(float scale);
+
 	Eigen::Matrix3f intrinsics;
 
-	Model model;
-	Painter painter;
+	std::shared_ptr<Model> model;
+	// fixed function fallback, null when the shader painter is available
+	std::unique_ptr<Painter> painter;
+	// metric depth straight from the shader, null without OpenGL 3.3 core profile
+	std::shared_ptr<ShaderPainter> shader_painter;
 	
+	int width;
+	int height;
 	float z_near;
 	float z_far;
 };
 
+class SceneRenderer : public SceneRendererInterface
+{
+public:
+	SceneRenderer(SceneRendererConfiguration &configuration);
+	void render(std::vector<Eigen::Matrix4f> &pose_matrices, cv::Mat &depth, cv::Mat &object_ids);
+private:
+	Eigen::Matrix3f intrinsics;
+
+	std::vector<std::shared_ptr<Model>> models;
+	// fixed function fallback, null when the shader painter is available
+	std::unique_ptr<Painter> painter;
+	// single pass rendering of all models, null without OpenGL 3.3 core profile
+	std::shared_ptr<ShaderPainter> shader_painter;
+
+	// color buffer the object ids are decoded from, kept between frames
+	cv::Mat id_color;
+};
+
+std::shared_ptr<Model> get_shared_model(const std::string &model_file, Painter *painter = nullptr);
+
 #ifdef _WIN32
 
 #ifdef __cplusplus
@@ -74,9 +175,21 @@ private:
 
 #endif
 
+// Creates the OpenGL application and contexts shared by all renderers of the backend. Qt needs them on the main thread:
+// call it there before renderers are created on other threads.
+#ifdef _WIN32
+EXTERN_C RendererAPI
+#endif
+void initialize_rendering(RenderBackend backend);
+
 #ifdef _WIN32
 EXTERN_C RendererAPI
 #endif
 RendererInterfaceHandle get_depth_renderer(RendererConfiguration &configuration);
 
+#ifdef _WIN32
+EXTERN_C RendererAPI
+#endif
+SceneRendererInterfaceHandle get_scene_renderer(SceneRendererConfiguration &configuration);
+
 #endif
@@ -0,0 +1,109 @@
+//######################################################################
+//#   Liboffscreenrenderer Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#ifndef SHADER_PAINTER_H
+#define SHADER_PAINTER_H
+
+#include "model.h"
+#include <Eigen/StdVector>
+#include <map>
+#include <memory>
+#include <mutex>
+
+
+typedef vector<ModelInstance, Eigen::aligned_allocator<ModelInstance>> ModelInstances;
+
+
+// Core profile (OpenGL 3.3) painter drawing all model instances of a view in a single pass. The poses and ids of the
+// instances are stored in a uniform buffer and all instances of the same model are drawn by one instanced call.
+// Besides the vertex colors the fragment shader writes the metric depth along the optical axis (R32F, 0 for the
+// background) and the object ids (R16UI, 0 for the background), which are read back without any conversion,
+// so no pass over the pixels like Painter's z-buffer conversion is needed.
+class ShaderPainter : protected QOpenGLExtraFunctions
+{
+public:
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    // takes ownership of the context
+    ShaderPainter(float p_near,float p_far,int width,int height,RenderContext *context);
+    ~ShaderPainter();
+
+    // Shader painter of the calling thread for the size and depth range, pooled per thread like the painters of Painter.
+    // Painter::initialize has to have created the application of the backend before. Null without OpenGL 3.3 core
+    // profile support, the renderers then fall back to the fixed function painter.
+    static std::shared_ptr<ShaderPainter> acquire(int width, int height, float z_near, float z_far);
+
+    int getWidth(){return m_width;}
+    int getHeight(){return m_height;}
+
+    // Draws the instances seen with the intrinsics, the image row 0 is the framebuffer row 0 as with the painter
+    void draw(const Eigen::Matrix3f &intrinsics, const ModelInstances &instances);
+
+    // Read the rect of the framebuffer straight into dest, which is only (re)allocated if its size or type differ
+    void readColor(const cv::Rect &rect, cv::Mat &dest);
+    void readDepth(const cv::Rect &rect, cv::Mat &dest);
+    void readObjectIds(const cv::Rect &rect, cv::Mat &dest);
+
+    // Metric depth of the read_rect for every pose of the model, like Painter::paintBatch: the poses of a chunk go
+    // into the tiles of a batch framebuffer with a single instanced draw call (clipped to the tiles), the chunks 
+    // are read back asynchronously through two pixel buffer objects.
+    void paintBatch(const Eigen::Matrix3f &intrinsics, const Model *model, 
+                    const vector<Eigen::Isometry3f, Eigen::aligned_allocator<Eigen::Isometry3f>> &poses,
+                    const cv::Rect &read_rect, vector<cv::Mat> &depths);
+
+private:
+
+    struct MeshBuffers
+    {
+        GLuint vertices = 0;
+        GLuint indices = 0;
+    };
+
+    bool initialize();
+    GLuint compileShader(GLenum type, const char *source);
+    GLuint getVertexArray(const Model *model);
+    Eigen::Matrix4f getProjection(const Eigen::Matrix3f &intrinsics);
+    void readAttachment(GLenum attachment, GLenum format, GLenum type, int mat_type, const cv::Rect &rect, cv::Mat &dest);
+
+    // (Re)creates the metric depth and depth test buffers of the batch framebuffer in the size of m_batch
+    void createBatchFramebuffer();
+
+    void makeCurrent(){m_context->makeCurrent();}
+    void doneCurrent(){m_context->doneCurrent();}
+
+    float m_near,m_far;
+    int m_width,m_height;
+    RenderContext *m_context;
+    bool m_valid = false;
+
+    //Framebuffer with the color, depth and id attachments and the depth buffer for the depth test.
+    GLuint m_fbo = 0;
+    GLuint m_attachments[3] = {0, 0, 0};
+    GLuint m_depth_buffer = 0;
+
+    //Tiled depth framebuffer for batches and its readback.
+    GLuint m_batch_fbo = 0;
+    GLuint m_batch_buffers[2] = {0, 0};
+    TiledBatch m_batch;
+
+    GLuint m_program = 0;
+    GLuint m_objects_ubo = 0;
+    GLint m_projection_location = -1;
+    GLint m_first_object_location = -1;
+
+    //Vertex arrays are not shared between contexts, one per model.
+    std::map<const Model*, GLuint> m_vertex_arrays;
+
+    //Vertex and index buffers of the models, shared by all shader painter contexts.
+    static std::map<const Model*, MeshBuffers> s_mesh_buffers;
+    static std::mutex s_mesh_buffers_mutex;
+};
+
+#endif
@@ -0,0 +1,447 @@
+//######################################################################
+//#   Liboffscreenrenderer Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#include "cpu_renderer.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+	// tiles are square, small enough to balance the threads and to keep their part of the buffers in the cache
+	const int TILE_SIZE = 64;
+
+	int get_number_of_threads(int requested)
+	{
+		if (requested > 0) return requested;
+		return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	}
+
+	Eigen::Isometry3f to_isometry(const Eigen::Matrix4f &pose_matrix)
+	{
+		Eigen::Isometry3f pose;
+		pose.setIdentity();
+
+		pose.linear() = pose_matrix.block<3, 3>(0, 0);
+		pose.translation() = pose_matrix.block<3, 1>(0, 3);
+
+		return pose;
+	}
+
+	// One thread less than cores, started on first use and shared by all rasterizers of the process, so render calls
+	// neither start threads nor run more of them than there are cores.
+	class ThreadPool
+	{
+	public:
+		static ThreadPool &instance()
+		{
+			static ThreadPool pool;
+			return pool;
+		}
+
+		int size() const {return static_cast<int>(threads.size());}
+
+		void submit(std::function<void()> job)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				jobs.push_back(std::move(job));
+			}
+			job_available.notify_one();
+		}
+
+		// jobs of the pool threads run their loops in place, waiting for the pool there could block all of its threads
+		static bool is_pool_thread() {return in_pool_thread;}
+
+	private:
+		ThreadPool()
+		{
+			const int number_of_threads = get_number_of_threads(0) - 1;
+			for (int i = 0; i < number_of_threads; ++i) threads.emplace_back([this]() { work(); });
+		}
+
+		~ThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			job_available.notify_all();
+			for (auto &thread : threads) thread.join();
+		}
+
+		void work()
+		{
+			in_pool_thread = true;
+			while (true)
+			{
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					job_available.wait(lock, [this]() { return stopping || !jobs.empty(); });
+					if (jobs.empty()) return;
+
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+		std::vector<std::thread> threads;
+		std::deque<std::function<void()>> jobs;
+		std::mutex mutex;
+		std::condition_variable job_available;
+		bool stopping = false;
+
+		static thread_local bool in_pool_thread;
+	};
+
+	thread_local bool ThreadPool::in_pool_thread = false;
+
+	// runs task(i) for i in [0, count) on the calling thread and up to number_of_threads - 1 threads of the pool
+	template <typename Task>
+	void parallel_for(int count, int number_of_threads, const Task &task)
+	{
+		number_of_threads = std::min(number_of_threads, count);
+		if (ThreadPool::is_pool_thread()) number_of_threads = 1;
+		else if (number_of_threads > 1) number_of_threads = std::min(number_of_threads, ThreadPool::instance().size() + 1);
+
+		if (number_of_threads <= 1)
+		{
+			for (int i = 0; i < count; ++i) task(i);
+			return;
+		}
+
+		std::atomic<int> next(0);
+		auto worker = [&]()
+		{
+			for (int i = next++; i < count; i = next++) task(i);
+		};
+
+		// the helpers signal under the lock, so the state on this stack outlives their last access
+		int finished_helpers = 0;
+		std::mutex finished_mutex;
+		std::condition_variable finished;
+		for (int i = 1; i < number_of_threads; ++i)
+		{
+			ThreadPool::instance().submit([&]()
+			{
+				worker();
+				std::lock_guard<std::mutex> lock(finished_mutex);
+				++finished_helpers;
+				finished.notify_one();
+			});
+		}
+
+		worker();
+
+		std::unique_lock<std::mutex> lock(finished_mutex);
+		finished.wait(lock, [&]() { return finished_helpers == number_of_threads - 1; });
+	}
+}
+
+CpuRasterizer::CpuRasterizer(float z_near, float z_far, int number_of_threads) :
+  z_near(z_near), z_far(z_far), number_of_threads(get_number_of_threads(number_of_threads))
+{
+}
+
+void CpuRasterizer::render(const RasterInstances &instances, const Eigen::Matrix3f &intrinsics, const cv::Rect &rect,
+                           cv::Mat *depth, cv::Mat *color, cv::Mat *object_ids)
+{
+	// the depth is needed for the depth test even if it is not read back
+	cv::Mat &z_buffer = depth ? *depth : depth_buffer;
+	z_buffer.create(rect.size(), CV_32FC1);
+	z_buffer.setTo(0);
+
+	if (color)
+	{
+		color->create(rect.size(), CV_8UC3);
+		color->setTo(cv::Scalar::all(0));
+	}
+
+	if (object_ids)
+	{
+		object_ids->create(rect.size(), CV_16UC1);
+		object_ids->setTo(0);
+	}
+
+	if (rect.area() <= 0) return;
+
+	// triangle setup, the vertices are projected into the pixel coordinates of the rect
+	triangles.clear();
+	for (const RasterInstance &instance : instances)
+	{
+		const Model &model = *instance.model;
+
+		const Eigen::Matrix3f projection = intrinsics * instance.pose.linear();
+		const Eigen::Vector3f offset = intrinsics * instance.pose.translation();
+
+		projected_vertices.resize(model.m_points.size());
+		for (size_t i = 0; i < model.m_points.size(); ++i)
+		{
+			const Eigen::Vector3f p = projection * model.m_points[i] + offset;
+			projected_vertices[i] = p.z() > 0 ? Eigen::Vector3f(p.x() / p.z() - rect.x, p.y() / p.z() - rect.y, p.z()) : p;
+		}
+
+		for (const Eigen::Vector3i &face : model.m_faces)
+		{
+			const Eigen::Vector3f &p0 = projected_vertices[face(0)];
+			const Eigen::Vector3f &p1 = projected_vertices[face(1)];
+			const Eigen::Vector3f &p2 = projected_vertices[face(2)];
+
+			if (p0.z() < z_near || p1.z() < z_near || p2.z() < z_near) continue;
+			if (p0.z() > z_far && p1.z() > z_far && p2.z() > z_far) continue;
+
+			const float area = (p1.x() - p0.x()) * (p2.y() - p0.y()) - (p1.y() - p0.y()) * (p2.x() - p0.x());
+			if (std::abs(area) < 1e-12f) continue;
+
+			Triangle triangle;
+
+			// pixels are sampled at their centers
+			triangle.min_x = std::max(0, static_cast<int>(std::ceil(std::min({ p0.x(), p1.x(), p2.x() }) - 0.5f)));
+			triangle.min_y = std::max(0, static_cast<int>(std::ceil(std::min({ p0.y(), p1.y(), p2.y() }) - 0.5f)));
+			triangle.max_x = std::min(rect.width - 1, static_cast<int>(std::floor(std::max({ p0.x(), p1.x(), p2.x() }) - 0.5f)));
+			triangle.max_y = std::min(rect.height - 1, static_cast<int>(std::floor(std::max({ p0.y(), p1.y(), p2.y() }) - 0.5f)));
+			if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y) continue;
+
+			// dividing by the signed area makes the weights positive inside for both windings, no faces are culled
+			auto set_edge = [&](int k, const Eigen::Vector3f &from, const Eigen::Vector3f &to)
+			{
+				triangle.a(k) = -(to.y() - from.y()) / area;
+				triangle.b(k) = (to.x() - from.x()) / area;
+				triangle.c(k) = -(triangle.a(k) * from.x() + triangle.b(k) * from.y());
+			};
+			set_edge(0, p1, p2);
+			set_edge(1, p2, p0);
+			set_edge(2, p0, p1);
+
+			triangle.inverse_depths = Eigen::Vector3f(1.0f / p0.z(), 1.0f / p1.z(), 1.0f / p2.z());
+			for (int k = 0; k < 3; ++k)
+			{
+				triangle.colors_over_depth.col(k) = model.m_colors[face(k)] * triangle.inverse_depths(k);
+			}
+			triangle.id = instance.id;
+
+			triangles.push_back(triangle);
+		}
+	}
+
+	// binning by the bounding boxes
+	const int tiles_x = (rect.width + TILE_SIZE - 1) / TILE_SIZE;
+	const int tiles_y = (rect.height + TILE_SIZE - 1) / TILE_SIZE;
+
+	tile_triangles.resize(tiles_x * tiles_y);
+	for (auto &tile : tile_triangles) tile.clear();
+
+	for (size_t i = 0; i < triangles.size(); ++i)
+	{
+		const Triangle &triangle = triangles[i];
+		for (int ty = triangle.min_y / TILE_SIZE; ty <= triangle.max_y / TILE_SIZE; ++ty)
+		{
+			for (int tx = triangle.min_x / TILE_SIZE; tx <= triangle.max_x / TILE_SIZE; ++tx)
+			{
+				tile_triangles[ty * tiles_x + tx].push_back(static_cast<int>(i));
+			}
+		}
+	}
+
+	// the tiles do not overlap, every thread writes only to the pixels of its tiles
+	parallel_for(tiles_x * tiles_y, number_of_threads, [&](int tile)
+	{
+		const cv::Rect tile_rect(cv::Point((tile % tiles_x) * TILE_SIZE, (tile / tiles_x) * TILE_SIZE), cv::Size(TILE_SIZE, TILE_SIZE));
+		rasterize_tile(tile, tile_rect & cv::Rect(cv::Point(0, 0), rect.size()), z_buffer, color, object_ids);
+	});
+}
+
+void CpuRasterizer::rasterize_tile(int tile, const cv::Rect &tile_rect, cv::Mat &depth, cv::Mat *color, cv::Mat *object_ids) const
+{
+	const Eigen::Array4f lane_centers(0.5f, 1.5f, 2.5f, 3.5f);
+
+	for (int index : tile_triangles[tile])
+	{
+		const Triangle &triangle = triangles[index];
+
+		const int x0 = std::max(triangle.min_x, tile_rect.x);
+		const int x1 = std::min(triangle.max_x, tile_rect.x + tile_rect.width - 1);
+		const int y0 = std::max(triangle.min_y, tile_rect.y);
+		const int y1 = std::min(triangle.max_y, tile_rect.y + tile_rect.height - 1);
+
+		for (int y = y0; y <= y1; ++y)
+		{
+			const float py = y + 0.5f;
+			const Eigen::Array3f row_offsets = triangle.b.array() * py + triangle.c.array();
+
+			float *depth_row = depth.ptr<float>(y);
+			cv::Vec3b *color_row = color ? color->ptr<cv::Vec3b>(y) : nullptr;
+			ushort *ids_row = object_ids ? object_ids->ptr<ushort>(y) : nullptr;
+
+			// four pixels of the row at a time
+			for (int x = x0; x <= x1; x += 4)
+			{
+				const Eigen::Array4f px = lane_centers + static_cast<float>(x);
+				const Eigen::Array4f w0 = triangle.a(0) * px + row_offsets(0);
+				const Eigen::Array4f w1 = triangle.a(1) * px + row_offsets(1);
+				const Eigen::Array4f w2 = triangle.a(2) * px + row_offsets(2);
+
+				const Eigen::Array<bool, 4, 1> inside = w0.min(w1).min(w2) >= 0.0f;
+				if (!inside.any()) continue;
+
+				const Eigen::Array4f inverse_depth = w0 * triangle.inverse_depths(0) + w1 * triangle.inverse_depths(1) + w2 * triangle.inverse_depths(2);
+
+				const int lanes = std::min(4, x1 - x + 1);
+				for (int lane = 0; lane < lanes; ++lane)
+				{
+					if (!inside(lane)) continue;
+
+					const float z = 1.0f / inverse_depth(lane);
+					if (z < z_near || z > z_far) continue;
+
+					float &stored_z = depth_row[x + lane];
+					if (stored_z != 0 && stored_z <= z) continue;
+					stored_z = z;
+
+					if (color_row)
+					{
+						const Eigen::Vector3f rgb = triangle.colors_over_depth * Eigen::Vector3f(w0(lane), w1(lane), w2(lane)) * z;
+						color_row[x + lane] = cv::Vec3b(cv::saturate_cast<uchar>(rgb.z() * 255.0f),
+						                                cv::saturate_cast<uchar>(rgb.y() * 255.0f),
+						                                cv::saturate_cast<uchar>(rgb.x() * 255.0f));
+					}
+
+					if (ids_row) ids_row[x + lane] = static_cast<ushort>(triangle.id);
+				}
+			}
+		}
+	}
+}
+
+CpuRenderer::CpuRenderer(RendererConfiguration &configuration) :
+  intrinsics(configuration.intrinsics), width(configuration.width), height(configuration.height),
+  rasterizer(configuration.z_near, configuration.z_far, configuration.cpu_threads),
+  number_of_threads(get_number_of_threads(configuration.cpu_threads)), z_near(configuration.z_near), z_far(configuration.z_far)
+{
+	model = get_shared_model(configuration.model_file);
+}
+
+void CpuRenderer::render(Eigen::Matrix4f &pose_matrix, cv::Mat &depth, cv::Mat &color)
+{
+	render(pose_matrix, 1.0f, depth, color);
+}
+
+void CpuRenderer::render(Eigen::Matrix4f &pose_matrix, float scale, cv::Mat &depth, cv::Mat &color)
+{
+	render(pose_matrix, scale, RENDER_DEPTH | RENDER_COLOR, cv::Rect(), depth, color);
+}
+
+void CpuRenderer::render(Eigen::Matrix4f &pose_matrix, float scale, int buffers, const cv::Rect &roi, cv::Mat &depth, cv::Mat &color)
+{
+	const cv::Rect image_rect = get_scaled_image_rect(scale);
+	const cv::Rect read_rect = roi.area() > 0 ? (roi & image_rect) : image_rect;
+
+	RasterInstances instances = { { model.get(), to_isometry(pose_matrix), 1 } };
+	rasterizer.render(instances, get_scaled_intrinsics(scale), read_rect,
+	                  (buffers & RENDER_DEPTH) ? &depth : nullptr, (buffers & RENDER_COLOR) ? &color : nullptr, nullptr);
+}
+
+void CpuRenderer::render_batch(std::vector<Eigen::Matrix4f> &pose_matrices, float scale, std::vector<cv::Mat> &depths)
+{
+	const Eigen::Matrix3f scaled_intrinsics = get_scaled_intrinsics(scale);
+	const cv::Rect image_rect = get_scaled_image_rect(scale);
+	const int number_of_poses = static_cast<int>(pose_matrices.size());
+
+	depths.resize(pose_matrices.size());
+
+	// whole render calls are spread over the threads, each with its own single threaded rasterizer
+	const int number_of_batch_threads = std::min(number_of_threads, number_of_poses);
+	if (static_cast<int>(batch_rasterizers.size()) < number_of_batch_threads)
+	{
+		batch_rasterizers.resize(number_of_batch_threads, CpuRasterizer(z_near, z_far, 1));
+	}
+	std::atomic<int> next_pose(0);
+
+	parallel_for(number_of_batch_threads, number_of_batch_threads, [&](int thread)
+	{
+		for (int i = next_pose++; i < number_of_poses; i = next_pose++)
+		{
+			RasterInstances instances = { { model.get(), to_isometry(pose_matrices[i]), 1 } };
+			batch_rasterizers[thread].render(instances, scaled_intrinsics, image_rect, &depths[i], nullptr, nullptr);
+		}
+	});
+}
+
+Eigen::Matrix3f CpuRenderer::get_scaled_intrinsics(float scale) const
+{
+	scale = std::min(std::max(scale, 0.0f), 1.0f);
+
+	Eigen::Matrix3f scaled_intrinsics = intrinsics;
+	scaled_intrinsics.block<2, 3>(0, 0) *= scale;
+
+	return scaled_intrinsics;
+}
+
+cv::Rect CpuRenderer::get_scaled_image_rect(float scale) const
+{
+	scale = std::min(std::max(scale, 0.0f), 1.0f);
+
+	cv::Rect image_rect(0, 0, width, height);
+	if (scale < 1.0f)
+	{
+		image_rect.width = std::max(1, static_cast<int>(width * scale + 0.5f));
+		image_rect.height = std::max(1, static_cast<int>(height * scale + 0.5f));
+	}
+
+	return image_rect;
+}
+
+void CpuRenderer::get_model_edges(Eigen::Matrix4f &pose_matrix, float crease_angle, std::vector<Eigen::Vector3f> &edge_points)
+{
+	edge_points.clear();
+	model->computeViewEdges(to_isometry(pose_matrix), crease_angle, edge_points);
+}
+
+void CpuRenderer::get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max)
+{
+	bb_min = model->bb_min;
+	bb_max = model->bb_max;
+}
+
+void CpuRenderer::get_model_hull_vertices(std::vector<Eigen::Vector3f> &hull_vertices)
+{
+	hull_vertices.clear();
+	for (int i : model->m_hull_vertices) hull_vertices.push_back(model->m_points[i]);
+}
+
+CpuSceneRenderer::CpuSceneRenderer(SceneRendererConfiguration &configuration) :
+  intrinsics(configuration.intrinsics), width(configuration.width), height(configuration.height),
+  rasterizer(configuration.z_near, configuration.z_far, configuration.cpu_threads)
+{
+	for (const auto& model_file : configuration.model_files)
+	{
+		models.push_back(get_shared_model(model_file));
+	}
+}
+
+void CpuSceneRenderer::render(std::vector<Eigen::Matrix4f> &pose_matrices, cv::Mat &depth, cv::Mat &object_ids)
+{
+	RasterInstances instances;
+	instances.reserve(models.size());
+
+	for (size_t i = 0; i < models.size(); ++i)
+	{
+		instances.push_back({ models[i].get(), to_isometry(pose_matrices[i]), static_cast<int>(i) + 1 });
+	}
+
+	rasterizer.render(instances, intrinsics, cv::Rect(0, 0, width, height), &depth, nullptr, &object_ids);
+}
@@ -11,6 +11,18 @@
 #include <string>
 #include <fstream>
 #include <filesystem>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <opencv2/viz.hpp>
 
@@ -25,6 +37,110 @@ using namespace Eigen;
 #define USE_VBO
 
 
+namespace
+{
+	// Read-only view of a whole file, mapped into memory where possible
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const string& filename)
+		{
+#ifndef _WIN32
+			const int fd = open(filename.c_str(), O_RDONLY);
+			if (fd < 0) return;
+			struct stat status;
+			if (fstat(fd, &status) == 0 && status.st_size > 0)
+			{
+				void* mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapped != MAP_FAILED)
+				{
+					m_data = static_cast<const char*>(mapped);
+					m_size = status.st_size;
+				}
+			}
+			close(fd);
+#else
+			ifstream file(filename, ios::in | ios::binary);
+			m_buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+			m_data = m_buffer.data();
+			m_size = m_buffer.size();
+#endif
+		}
+
+		~MappedFile()
+		{
+#ifndef _WIN32
+			if (m_data) munmap(const_cast<char*>(m_data), m_size);
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const char* data() const { return m_data; }
+		size_t size() const { return m_size; }
+
+	private:
+		const char* m_data = nullptr;
+		size_t m_size = 0;
+#ifdef _WIN32
+		vector<char> m_buffer;
+#endif
+	};
+
+	// FNV-1a, the cache only has to notice a changed ply
+	uint64_t hash_file(const MappedFile& file)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t i = 0; i < file.size(); ++i)
+		{
+			hash ^= static_cast<unsigned char>(file.data()[i]);
+			hash *= 1099511628211ull;
+		}
+		return hash ^ file.size();
+	}
+
+	const char MESH_CACHE_MAGIC[8] = { 'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H' };
+	// increased with every change of the layout below
+	const uint32_t MESH_CACHE_VERSION = 2;
+
+	// Followed by the points, normals, colors, local coordinate colors, faces, face normals, mesh edges and hull vertices
+	struct MeshCacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t source_hash;
+		uint64_t number_of_points;
+		uint64_t number_of_faces;
+		uint64_t number_of_edges;
+		uint64_t number_of_hull_vertices;
+		float bb_min[3];
+		float bb_max[3];
+		float centroid[3];
+		float diameter;
+	};
+
+	static_assert(sizeof(Vector3f) == 3 * sizeof(float), "points are cached as packed floats");
+	static_assert(sizeof(Vector3i) == 3 * sizeof(int), "faces are cached as packed ints");
+	static_assert(sizeof(MeshEdge) == 4 * sizeof(int), "mesh edges are cached as packed ints");
+
+	template <typename T>
+	void write_array(ofstream& file, const vector<T>& array)
+	{
+		file.write(reinterpret_cast<const char*>(array.data()), array.size() * sizeof(T));
+	}
+
+	template <typename T>
+	const char* read_array(const char* data, size_t size, vector<T>& array)
+	{
+		array.resize(size);
+		memcpy(array.data(), data, size * sizeof(T));
+		return data + size * sizeof(T);
+	}
+}
+
+
 
 Model::Model(): m_cube_size(0.005)
 {
@@ -49,8 +165,8 @@ void Model::paint()
 		glEnableClientState(GL_VERTEX_ARRAY);
 		glEnableClientState(GL_COLOR_ARRAY);
 #ifdef USE_VBO
-		if (!m_faces.empty()) Painter::getSingleton()->drawVBOs(m_vbo_vertices, m_vbo_indices, m_faces.size() * 3);
-		else Painter::getSingleton()->drawVBOs(m_vbo_vertices, 0, m_points.size());
+		if (!m_faces.empty()) FramebufferPainter::current()->drawVBOs(m_vbo_vertices, m_vbo_indices, m_faces.size() * 3);
+		else FramebufferPainter::current()->drawVBOs(m_vbo_vertices, 0, m_points.size());
 #else
         glVertexPointer(3,GL_FLOAT,2*sizeof(Vector3f),&(vertex_data[0]));
         glColorPointer (3,GL_FLOAT,2*sizeof(Vector3f),&(vertex_data[1]));
@@ -63,8 +179,40 @@ void Model::paint()
 }
 
 
+void Model::paintWithColor(GLubyte r, GLubyte g, GLubyte b)
+{
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+	glDepthMask(GL_TRUE);
+	if (!m_points.empty())
+	{
+		// No color array, so the whole model gets the same color
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glColor3ub(r, g, b);
+		if (!m_faces.empty()) FramebufferPainter::current()->drawVBOs(m_vbo_vertices, m_vbo_indices, m_faces.size() * 3);
+		else FramebufferPainter::current()->drawVBOs(m_vbo_vertices, 0, m_points.size());
+		glDisableClientState(GL_VERTEX_ARRAY);
+	}
+}
+
+
+ModelInstance::ModelInstance(Model* model, const Isometry3f& pose, int id) : m_model(model), m_pose(pose), m_id(id)
+{
+}
+
+
+void ModelInstance::paint()
+{
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glMultMatrixf(m_pose.matrix().data());
+	m_model->paintWithColor(static_cast<GLubyte>(m_id & 0xFF), static_cast<GLubyte>((m_id >> 8) & 0xFF), 0);
+	glPopMatrix();
+}
+
 
-void Model::bindVBOs()
+
+void Model::bindVBOs(Painter &painter)
 {
 	// Interleaving vertex and color data for faster rendering
 	m_vertex_data.resize(m_points.size() * 2);
@@ -75,7 +223,7 @@ void Model::bindVBOs()
 		//m_vertex_data[i*2+1] = m_localCoordColors[i];
 	}
 #ifdef USE_VBO  // Bind VBO data onto GPU
-	Painter::getSingleton()->bindVBOs(m_vertex_data, m_faces, m_vbo_vertices, m_vbo_indices);
+	painter.bindVBOs(m_vertex_data, m_faces, m_vbo_vertices, m_vbo_indices);
 #endif
 }
 
@@ -107,41 +255,394 @@ void Model::computeLocalCoordsColors()
 }
 
 
-vector<bool> Model::computeEdgePoints()
+vector<bool> Model::computeEdgePoints() const
+{
+	// Vertices on an edge with a single face, none for point clouds
+	vector<bool> list(m_points.size(), false);
+	for (const MeshEdge& edge : m_mesh_edges)
+	{
+		if (edge.faces(1) >= 0) continue;
+		list[edge.vertices(0)] = true;
+		list[edge.vertices(1)] = true;
+	}
+
+	return list;
+}
+
+
+void Model::computeVertexFaces(vector<int>& offsets, vector<int>& vertex_faces) const
+{
+	// Counting sort of the face corners by vertex, the faces of each vertex stay in ascending order
+	offsets.assign(m_points.size() + 1, 0);
+	for (const Vector3i& tri : m_faces)
+		for (int k = 0; k < 3; ++k) ++offsets[tri(k) + 1];
+
+	for (size_t i = 0; i < m_points.size(); ++i) offsets[i + 1] += offsets[i];
+
+	vector<int> cursor(offsets.begin(), offsets.end() - 1);
+	vertex_faces.resize(m_faces.size() * 3);
+	for (int i = 0; i < static_cast<int>(m_faces.size()); ++i)
+		for (int k = 0; k < 3; ++k) vertex_faces[cursor[m_faces[i](k)]++] = i;
+}
+
+
+void Model::computeFaceNormals()
+{
+	m_face_normals.resize(m_faces.size());
+	parallel_for_(Range(0, static_cast<int>(m_faces.size())), [&](const Range& range)
+	{
+		for (int i = range.start; i < range.end; ++i)
+		{
+			const Vector3i& f = m_faces[i];
+			Vector3f normal = (m_points[f(1)] - m_points[f(0)]).cross(m_points[f(2)] - m_points[f(0)]);
+			// degenerate faces keep a zero normal and never form an edge
+			float norm = normal.norm();
+			m_face_normals[i] = norm > 0 ? Vector3f(normal / norm) : Vector3f::Zero();
+		}
+	});
+}
+
+
+void Model::computeMeshEdges()
 {
 	assert(!m_faces.empty());
 
-	vector<bool> list(m_points.size(), false);
+	// Half edges (larger vertex, face) bucketed by their smaller vertex with a counting sort, so that the faces
+	// sharing an edge end up in the same small bucket
+	vector<int> offsets(m_points.size() + 1, 0);
+	for (const Vector3i& tri : m_faces)
+		for (int k = 0; k < 3; ++k) ++offsets[min(tri(k), tri((k + 1) % 3)) + 1];
 
-	// Extract all edges and vertex2face info
-	vector<Vector2i> edges;
-	vector<vector<int>> vert2face(m_points.size());
-	for (uint i = 0; i < m_faces.size(); ++i)
+	for (size_t i = 0; i < m_points.size(); ++i) offsets[i + 1] += offsets[i];
+
+	vector<int> cursor(offsets.begin(), offsets.end() - 1);
+	vector<Vector2i> half_edges(m_faces.size() * 3);
+	for (int i = 0; i < static_cast<int>(m_faces.size()); ++i)
 	{
 		const Vector3i& tri = m_faces[i];
-		edges.push_back(Vector2i(tri(0), tri(1)));
-		edges.push_back(Vector2i(tri(1), tri(2)));
-		edges.push_back(Vector2i(tri(2), tri(0)));
-		vert2face[tri(0)].push_back(i);
-		vert2face[tri(1)].push_back(i);
-		vert2face[tri(2)].push_back(i);
+		for (int k = 0; k < 3; ++k)
+		{
+			int a = tri(k), b = tri((k + 1) % 3);
+			half_edges[cursor[min(a, b)]++] = Vector2i(max(a, b), i);
+		}
 	}
 
-	for (Vector2i& e : edges)
+	parallel_for_(Range(0, static_cast<int>(m_points.size())), [&](const Range& range)
+	{
+		for (int v = range.start; v < range.end; ++v)
+		{
+			sort(half_edges.begin() + offsets[v], half_edges.begin() + offsets[v + 1], [](const Vector2i& e1, const Vector2i& e2)
+			{
+				return e1(0) != e2(0) ? e1(0) < e2(0) : e1(1) < e2(1);
+			});
+		}
+	});
+
+	m_mesh_edges.clear();
+	for (int v = 0; v < static_cast<int>(m_points.size()); ++v)
 	{
-		// For each edge, count if it is connected to more than 1 face
-		int counter = 0;
-		for (int i : vert2face[e(0)])
+		for (int i = offsets[v]; i < offsets[v + 1];)
 		{
-			Vector3i& tri = m_faces[i];
-			if (tri(0) == e(1) || tri(1) == e(1) || tri(2) == e(1))
-				counter++;
+			int j = i + 1;
+			while (j < offsets[v + 1] && half_edges[j](0) == half_edges[i](0)) ++j;
+
+			// non-manifold edges only keep their first two faces
+			MeshEdge edge;
+			edge.vertices = Vector2i(v, half_edges[i](0));
+			edge.faces = Vector2i(half_edges[i](1), j - i > 1 ? half_edges[i + 1](1) : -1);
+			m_mesh_edges.push_back(edge);
+
+			i = j;
 		}
-		list[e(0)] = list[e(0)] | (counter < 2);
-		list[e(1)] = list[e(1)] | (counter < 2);
 	}
+}
 
-	return list;
+
+vector<int> Model::computeFeatureEdges(float crease_angle) const
+{
+	// point clouds have no edges
+	if (m_faces.empty()) return vector<int>();
+
+	const float crease_cos = cos(crease_angle * 3.14159265f / 180.0f);
+
+	vector<int> feature_edges;
+	for (int i = 0; i < static_cast<int>(m_mesh_edges.size()); ++i)
+	{
+		const int f0 = m_mesh_edges[i].faces(0), f1 = m_mesh_edges[i].faces(1);
+		if (m_face_normals[f0].isZero() || (f1 >= 0 && m_face_normals[f1].isZero())) continue;
+
+		if (f1 < 0 || m_face_normals[f0].dot(m_face_normals[f1]) < crease_cos) feature_edges.push_back(i);
+	}
+
+	return feature_edges;
+}
+
+
+void Model::computeViewEdges(const Isometry3f& model_to_camera, float crease_angle, vector<Vector3f>& edge_points) const
+{
+	// point clouds have no edges
+	if (m_faces.empty()) return;
+
+	const Vector3f camera_center = model_to_camera.inverse().translation();
+	const float crease_cos = cos(crease_angle * 3.14159265f / 180.0f);
+
+	auto is_front_facing = [&](int face)
+	{
+		return m_face_normals[face].dot(camera_center - m_points[m_faces[face](0)]) > 0;
+	};
+
+	for (const MeshEdge& edge : m_mesh_edges)
+	{
+		const int f0 = edge.faces(0), f1 = edge.faces(1);
+		if (m_face_normals[f0].isZero() || (f1 >= 0 && m_face_normals[f1].isZero())) continue;
+
+		const bool front0 = is_front_facing(f0);
+		bool is_view_edge;
+
+		if (f1 < 0)
+		{
+			is_view_edge = front0;
+		}
+		else
+		{
+			const bool front1 = is_front_facing(f1);
+			is_view_edge = (front0 != front1) || (front0 && m_face_normals[f0].dot(m_face_normals[f1]) < crease_cos);
+		}
+
+		if (!is_view_edge) continue;
+
+		edge_points.push_back(m_points[edge.vertices(0)]);
+		edge_points.push_back(m_points[edge.vertices(1)]);
+	}
+}
+
+
+namespace
+{
+	struct HullFace
+	{
+		int vertices[3];
+		// outward unit normal and its dot product with the vertices
+		Vector3d normal;
+		double offset;
+		// points in front of the face that were not yet added to the hull
+		vector<int> outside;
+		bool deleted;
+	};
+
+	uint64_t get_edge_key(int a, int b)
+	{
+		return (static_cast<uint64_t>(a) << 32) | static_cast<uint32_t>(b);
+	}
+}
+
+
+void Model::computeConvexHull()
+{
+	// Quickhull: starting from a tetrahedron, the farthest point in front of a face is added until no point is left
+	// in front of any face, the faces it can see are replaced by a fan over their horizon.
+	m_hull_vertices.clear();
+
+	vector<Vector3d> points(m_points.size());
+	for (size_t i = 0; i < m_points.size(); ++i) points[i] = m_points[i].cast<double>();
+
+	const int number_of_points = static_cast<int>(points.size());
+	auto keep_all_points = [&]()
+	{
+		// flat or tiny models, the bounding boxes from all points are just as exact
+		m_hull_vertices.resize(number_of_points);
+		for (int i = 0; i < number_of_points; ++i) m_hull_vertices[i] = i;
+	};
+
+	if (number_of_points < 4)
+	{
+		keep_all_points();
+		return;
+	}
+
+	// points closer than this to a face count as on the face
+	const double epsilon = 1e-7 * max(1.0, static_cast<double>((bb_max - bb_min).norm()));
+
+	// initial tetrahedron from the farthest pair of axis extremes, the farthest point from their line and from their plane
+	int extremes[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < number_of_points; ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			if (points[i](k) < points[extremes[2 * k]](k)) extremes[2 * k] = i;
+			if (points[i](k) > points[extremes[2 * k + 1]](k)) extremes[2 * k + 1] = i;
+		}
+
+	int v0 = extremes[0], v1 = extremes[1];
+	for (int a = 0; a < 6; ++a)
+		for (int b = a + 1; b < 6; ++b)
+			if ((points[extremes[a]] - points[extremes[b]]).squaredNorm() > (points[v0] - points[v1]).squaredNorm())
+			{
+				v0 = extremes[a];
+				v1 = extremes[b];
+			}
+
+	const Vector3d direction = (points[v1] - points[v0]).normalized();
+	int v2 = -1, v3 = -1;
+	double max_distance = epsilon;
+	for (int i = 0; i < number_of_points; ++i)
+	{
+		const Vector3d offset = points[i] - points[v0];
+		const double distance = (offset - offset.dot(direction) * direction).norm();
+		if (distance > max_distance)
+		{
+			max_distance = distance;
+			v2 = i;
+		}
+	}
+	if (v2 < 0)
+	{
+		keep_all_points();
+		return;
+	}
+
+	const Vector3d base_normal = (points[v1] - points[v0]).cross(points[v2] - points[v0]).normalized();
+	max_distance = epsilon;
+	for (int i = 0; i < number_of_points; ++i)
+	{
+		const double distance = abs(base_normal.dot(points[i] - points[v0]));
+		if (distance > max_distance)
+		{
+			max_distance = distance;
+			v3 = i;
+		}
+	}
+	if (v3 < 0)
+	{
+		keep_all_points();
+		return;
+	}
+
+	vector<HullFace> faces;
+	unordered_map<uint64_t, int> edge_faces;
+	vector<int> pending_faces;
+
+	auto add_face = [&](int a, int b, int c) -> int
+	{
+		HullFace face;
+		face.vertices[0] = a;
+		face.vertices[1] = b;
+		face.vertices[2] = c;
+		face.normal = (points[b] - points[a]).cross(points[c] - points[a]).normalized();
+		face.offset = face.normal.dot(points[a]);
+		face.deleted = false;
+
+		const int index = static_cast<int>(faces.size());
+		for (int k = 0; k < 3; ++k) edge_faces[get_edge_key(face.vertices[k], face.vertices[(k + 1) % 3])] = index;
+		faces.push_back(std::move(face));
+		return index;
+	};
+
+	auto assign_outside = [&](int point, const vector<int>& candidates)
+	{
+		for (int f : candidates)
+		{
+			if (faces[f].normal.dot(points[point]) - faces[f].offset > epsilon)
+			{
+				faces[f].outside.push_back(point);
+				return;
+			}
+		}
+	};
+
+	// oriented so that the fourth vertex is behind every face
+	const int tetrahedron[4][4] = { { v0, v1, v2, v3 }, { v0, v2, v3, v1 }, { v0, v3, v1, v2 }, { v1, v3, v2, v0 } };
+	vector<int> initial_faces;
+	for (const auto& t : tetrahedron)
+	{
+		const Vector3d normal = (points[t[1]] - points[t[0]]).cross(points[t[2]] - points[t[0]]);
+		initial_faces.push_back(normal.dot(points[t[3]] - points[t[0]]) > 0 ? add_face(t[0], t[2], t[1]) : add_face(t[0], t[1], t[2]));
+	}
+
+	for (int i = 0; i < number_of_points; ++i)
+	{
+		if (i == v0 || i == v1 || i == v2 || i == v3) continue;
+		assign_outside(i, initial_faces);
+	}
+	pending_faces = initial_faces;
+
+	vector<int> visible_faces, horizon, new_faces, stack;
+	while (!pending_faces.empty())
+	{
+		const int face_index = pending_faces.back();
+		pending_faces.pop_back();
+		if (faces[face_index].deleted || faces[face_index].outside.empty()) continue;
+
+		// the farthest point in front of the face is a hull vertex
+		const HullFace& face = faces[face_index];
+		int apex = face.outside[0];
+		for (int p : face.outside)
+			if (face.normal.dot(points[p]) > face.normal.dot(points[apex])) apex = p;
+
+		// faces seen from the apex, connected to the face
+		visible_faces.clear();
+		stack.assign(1, face_index);
+		faces[face_index].deleted = true;
+		while (!stack.empty())
+		{
+			const int f = stack.back();
+			stack.pop_back();
+			visible_faces.push_back(f);
+
+			for (int k = 0; k < 3; ++k)
+			{
+				const auto neighbor = edge_faces.find(get_edge_key(faces[f].vertices[(k + 1) % 3], faces[f].vertices[k]));
+				if (neighbor == edge_faces.end()) continue;
+
+				HullFace& other = faces[neighbor->second];
+				if (!other.deleted && other.normal.dot(points[apex]) - other.offset > epsilon)
+				{
+					other.deleted = true;
+					stack.push_back(neighbor->second);
+				}
+			}
+		}
+
+		// edges between seen and unseen faces, in the orientation of the seen face
+		horizon.clear();
+		for (int f : visible_faces)
+			for (int k = 0; k < 3; ++k)
+			{
+				const int a = faces[f].vertices[k], b = faces[f].vertices[(k + 1) % 3];
+				const auto neighbor = edge_faces.find(get_edge_key(b, a));
+				if (neighbor != edge_faces.end() && !faces[neighbor->second].deleted)
+				{
+					horizon.push_back(a);
+					horizon.push_back(b);
+				}
+			}
+
+		for (int f : visible_faces)
+			for (int k = 0; k < 3; ++k) edge_faces.erase(get_edge_key(faces[f].vertices[k], faces[f].vertices[(k + 1) % 3]));
+
+		new_faces.clear();
+		for (size_t i = 0; i < horizon.size(); i += 2) new_faces.push_back(add_face(horizon[i], horizon[i + 1], apex));
+
+		for (int f : visible_faces)
+		{
+			vector<int> outside;
+			outside.swap(faces[f].outside);
+			for (int p : outside)
+				if (p != apex) assign_outside(p, new_faces);
+		}
+
+		for (int f : new_faces)
+			if (!faces[f].outside.empty()) pending_faces.push_back(f);
+	}
+
+	vector<bool> is_hull_vertex(number_of_points, false);
+	for (const HullFace& face : faces)
+	{
+		if (face.deleted) continue;
+		for (int v : face.vertices) is_hull_vertex[v] = true;
+	}
+
+	for (int i = 0; i < number_of_points; ++i)
+		if (is_hull_vertex[i]) m_hull_vertices.push_back(i);
 }
 
 
@@ -149,28 +650,32 @@ void Model::computeVertexNormals()
 {
 	assert(!m_faces.empty());
 
-	// Extract vertex2face info
-	m_normals.clear();
-	vector<vector<int>> vert2face(m_points.size());
-	for (uint i = 0; i < m_faces.size(); ++i)
+	vector<int> offsets, vertex_faces;
+	computeVertexFaces(offsets, vertex_faces);
+
+	// Area weighted face normals, gathered per vertex so that the vertices are independent
+	vector<Vector3f> face_normals(m_faces.size());
+	parallel_for_(Range(0, static_cast<int>(m_faces.size())), [&](const Range& range)
 	{
-		vert2face[m_faces[i](0)].push_back(i);
-		vert2face[m_faces[i](1)].push_back(i);
-		vert2face[m_faces[i](2)].push_back(i);
-	}
+		for (int i = range.start; i < range.end; ++i)
+		{
+			const Vector3i& f = m_faces[i];
+			face_normals[i] = (m_points[f(1)] - m_points[f(0)]).cross(m_points[f(2)] - m_points[f(0)]);
+		}
+	});
 
 	// Build average vertex normal over all adjacent faces
-	for (uint i = 0; i < m_points.size(); ++i)
+	m_normals.resize(m_points.size());
+	parallel_for_(Range(0, static_cast<int>(m_points.size())), [&](const Range& range)
 	{
-		Vector3f normal(0, 0, 0);
-		for (int v : vert2face[i])
+		for (int i = range.start; i < range.end; ++i)
 		{
-			Vector3i& f = m_faces[v];
-			normal += (m_points[f(1)] - m_points[f(0)]).cross(m_points[f(2)] - m_points[f(0)]);
+			Vector3f normal(0, 0, 0);
+			for (int k = offsets[i]; k < offsets[i + 1]; ++k) normal += face_normals[vertex_faces[k]];
+			assert(normal.allFinite());
+			m_normals[i] = normal.normalized();
 		}
-		assert(normal.allFinite());
-		m_normals.push_back(normal.normalized());
-	}
+	});
 }
 
 
@@ -185,6 +690,12 @@ void Model::computeBoundingBox()
 		for (int k = 0; k < 3; ++k) bb_min(k) = min(bb_min(k), p(k));
 		for (int k = 0; k < 3; ++k) bb_max(k) = max(bb_max(k), p(k));
 	}
+	setBoundingBoxCorners();
+}
+
+
+void Model::setBoundingBoxCorners()
+{
 	boundingBox.col(0) << bb_min(0), bb_min(1), bb_min(2);
 	boundingBox.col(1) << bb_min(0), bb_max(1), bb_min(2);
 	boundingBox.col(2) << bb_max(0), bb_max(1), bb_min(2);
@@ -295,7 +806,89 @@ void Model::savePLY(string filename)
 }
 
 
-bool Model::loadPLY(string filename)
+bool Model::loadCache(const string& cache_file, uint64_t source_hash)
+{
+	if (!fs::is_regular_file(cache_file)) return false;
+
+	MappedFile cache(cache_file);
+	if (cache.size() < sizeof(MeshCacheHeader)) return false;
+
+	MeshCacheHeader header;
+	memcpy(&header, cache.data(), sizeof(header));
+	if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != MESH_CACHE_VERSION ||
+		header.source_hash != source_hash) return false;
+
+	const size_t expected_size = sizeof(MeshCacheHeader) + header.number_of_points * 4 * sizeof(Vector3f) +
+		header.number_of_faces * (sizeof(Vector3i) + sizeof(Vector3f)) + header.number_of_edges * sizeof(MeshEdge) +
+		header.number_of_hull_vertices * sizeof(int);
+	if (cache.size() != expected_size) return false;
+
+	const char* data = cache.data() + sizeof(MeshCacheHeader);
+	data = read_array(data, header.number_of_points, m_points);
+	data = read_array(data, header.number_of_points, m_normals);
+	data = read_array(data, header.number_of_points, m_colors);
+	data = read_array(data, header.number_of_points, m_localCoordColors);
+	data = read_array(data, header.number_of_faces, m_faces);
+	data = read_array(data, header.number_of_faces, m_face_normals);
+	data = read_array(data, header.number_of_edges, m_mesh_edges);
+	read_array(data, header.number_of_hull_vertices, m_hull_vertices);
+
+	bb_min = Map<const Vector3f>(header.bb_min);
+	bb_max = Map<const Vector3f>(header.bb_max);
+	centroid = Map<const Vector3f>(header.centroid);
+	m_diameter = header.diameter;
+	setBoundingBoxCorners();
+
+	return true;
+}
+
+
+void Model::saveCache(const string& cache_file, uint64_t source_hash) const
+{
+	MeshCacheHeader header;
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = MESH_CACHE_VERSION;
+	header.reserved = 0;
+	header.source_hash = source_hash;
+	header.number_of_points = m_points.size();
+	header.number_of_faces = m_faces.size();
+	header.number_of_edges = m_mesh_edges.size();
+	header.number_of_hull_vertices = m_hull_vertices.size();
+	Map<Vector3f>(header.bb_min) = bb_min;
+	Map<Vector3f>(header.bb_max) = bb_max;
+	Map<Vector3f>(header.centroid) = centroid;
+	header.diameter = m_diameter;
+
+	// written under a unique name and renamed, so that processes loading the same model never read a partial cache
+	const string temporary_file = cache_file + "." + to_string(random_device()()) + ".tmp";
+	{
+		ofstream file(temporary_file, ios::out | ios::binary);
+		if (!file) return; // e.g. a read-only models directory, the ply is parsed again next time
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		write_array(file, m_points);
+		write_array(file, m_normals);
+		write_array(file, m_colors);
+		write_array(file, m_localCoordColors);
+		write_array(file, m_faces);
+		write_array(file, m_face_normals);
+		write_array(file, m_mesh_edges);
+		write_array(file, m_hull_vertices);
+		if (!file) 
+		{
+			file.close();
+			fs::remove(temporary_file);
+			return;
+		}
+	}
+
+	error_code error;
+	fs::rename(temporary_file, cache_file, error);
+	if (error) fs::remove(temporary_file, error);
+}
+
+
+bool Model::loadPLY(string filename, Painter *painter)
 {
 	if (!fs::is_regular_file(filename))
 	{
@@ -303,6 +896,14 @@ bool Model::loadPLY(string filename)
 		return false;
 	}
 
+	const string cache_file = filename + ".cache";
+	const uint64_t source_hash = hash_file(MappedFile(filename));
+	if (loadCache(cache_file, source_hash))
+	{
+		if (painter) bindVBOs(*painter);
+		return true;
+	}
+
 
 	cv::viz::Mesh mesh = cv::viz::Mesh::load(filename);
 
@@ -352,9 +953,17 @@ bool Model::loadPLY(string filename)
 	computeBoundingBox();
 	computeVertexNormals();
 	computeLocalCoordsColors();
-	bindVBOs();
+	computeConvexHull();
+	if (!m_faces.empty())
+	{
+		computeFaceNormals();
+		computeMeshEdges();
+	}
+	if (painter) bindVBOs(*painter);
 	//subsampleCloud(m_cube_size);
 	m_diameter = (bb_max - bb_min).norm();
+
+	saveCache(cache_file, source_hash);
 	return true;
 }
 
@@ -8,6 +8,10 @@
 //#######################################################################
 
 #include <iostream>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
 #include "painter.h"
 
 
@@ -16,13 +20,137 @@ using namespace cv;
 using namespace Eigen;
 
 
-float Painter::z_near;
-float Painter::z_far;
-int Painter::width;
-int Painter::height;
+// tiles per batch chunk, e.g. 4x4 images of 640x480 
+const int MAX_BATCH_TILES = 16;
 
-SingletonPainter::SingletonPainter(float p_near,float p_far,int width,int height):
-    QGLWidget(QGLFormat(QGLFormat::defaultFormat()),0),m_near(p_near),m_far(p_far)
+thread_local FramebufferPainter *FramebufferPainter::m_current = 0;
+
+
+WidgetRenderContext::WidgetRenderContext(const QGLWidget *share):
+    m_widget(QGLFormat(QGLFormat::defaultFormat()),0,share)
+{
+}
+
+
+bool WidgetRenderContext::isValid()
+{
+    return QGLFormat::hasOpenGL() && QGLFramebufferObject::hasOpenGLFramebufferObjects() && m_widget.isValid();
+}
+
+
+HeadlessRenderContext::HeadlessRenderContext(QOffscreenSurface *surface, QOpenGLContext *share, bool core_profile):
+    m_core_profile(core_profile),m_surface(surface)
+{
+    m_context.setFormat(getFormat(core_profile));
+    m_context.setShareContext(share);
+    m_context.create();
+}
+
+
+QSurfaceFormat HeadlessRenderContext::getFormat(bool core_profile)
+{
+    // the painter uses the fixed function pipeline, the shader painter OpenGL 3.3
+    QSurfaceFormat format;
+    format.setRenderableType(QSurfaceFormat::OpenGL);
+    if (core_profile)
+    {
+        format.setVersion(3,3);
+        format.setProfile(QSurfaceFormat::CoreProfile);
+    }
+    else format.setProfile(QSurfaceFormat::CompatibilityProfile);
+    return format;
+}
+
+
+namespace
+{
+    std::mutex s_initialize_mutex;
+    // the first context, all later ones share the vertex buffers of the models with it
+    RenderContext *s_share_context = 0;
+    RenderBackend s_share_backend = RENDER_BACKEND_WIDGET;
+    // compatibility and core profile surfaces
+    QOffscreenSurface *s_surfaces[2] = {0, 0};
+}
+
+
+Painter::Painter(int width, int height, float z_near, float z_far, RenderBackend backend)
+{
+    typedef std::tuple<int,int,float,float> PainterKey;
+    // destroyed with the thread, whose id may be reused by a later one that must not get its contexts
+    static thread_local std::map<PainterKey,std::shared_ptr<FramebufferPainter>> painters;
+
+    std::shared_ptr<FramebufferPainter> &painter = painters[PainterKey(width,height,z_near,z_far)];
+    if (!painter) painter.reset(new FramebufferPainter(z_near,z_far,width,height,createContext(backend)));
+
+    m_painter = painter;
+}
+
+
+void Painter::initialize(RenderBackend backend)
+{
+    // Qt keeps references to the arguments
+    static int argc = 0;
+    static char **argv = 0;
+
+    std::lock_guard<std::mutex> lock(s_initialize_mutex);
+    if (s_share_context || backend == RENDER_BACKEND_CPU) return;
+
+    if (backend == RENDER_BACKEND_HEADLESS)
+    {
+        // no display needed, the environment still overrides both choices
+        if (qgetenv("QT_QPA_PLATFORM").isEmpty()) qputenv("QT_QPA_PLATFORM", "minimalegl");
+        if (qgetenv("EGL_PLATFORM").isEmpty()) qputenv("EGL_PLATFORM", "surfaceless");
+
+        if (!QGuiApplication::instance()) new QGuiApplication(argc, argv);
+    }
+    else if (!QApplication::instance()) new QApplication(argc, argv);
+
+    // also for the core profile contexts of the shader painter with the widget backend
+    for (int core_profile = 0; core_profile < 2; ++core_profile)
+    {
+        s_surfaces[core_profile] = new QOffscreenSurface();
+        s_surfaces[core_profile]->setFormat(HeadlessRenderContext::getFormat(core_profile));
+        s_surfaces[core_profile]->create();
+    }
+
+    if (backend == RENDER_BACKEND_HEADLESS) s_share_context = new HeadlessRenderContext(s_surfaces[0]);
+    else s_share_context = new WidgetRenderContext();
+    s_share_backend = backend;
+
+    if (!s_share_context->isValid())
+    {
+        cerr << "OpenGL error: No support of OpenGL/framebuffer objects." << endl;
+        exit(0);
+    }
+}
+
+
+QOffscreenSurface* Painter::getOffscreenSurface(bool core_profile)
+{
+    std::lock_guard<std::mutex> lock(s_initialize_mutex);
+    return s_surfaces[core_profile ? 1 : 0];
+}
+
+
+RenderContext* Painter::createContext(RenderBackend backend)
+{
+    initialize(backend);
+
+    if (backend != s_share_backend) cerr << "Painter: the first renderer chose another backend, which is used instead" << endl;
+    RenderContext *context = s_share_context->createShared();
+
+    if (!context->isValid())
+    {
+        cerr << "OpenGL error: No support of OpenGL/framebuffer objects." << endl;
+        exit(0);
+    }
+
+    return context;
+}
+
+
+FramebufferPainter::FramebufferPainter(float p_near,float p_far,int width,int height,RenderContext *context):
+    m_near(p_near),m_far(p_far),m_context(context)
 {
     //create the framebuffer object - make sure to have a current context before creating it
     makeCurrent();
@@ -38,13 +166,18 @@ SingletonPainter::SingletonPainter(float p_near,float p_far,int width,int height
 
 }
 
-SingletonPainter::~SingletonPainter()
+FramebufferPainter::~FramebufferPainter()
 {
+    makeCurrent();
+    m_batch.destroy();
+    delete m_batch_fbo;
     delete m_fbo;
+    doneCurrent();
+    delete m_context;
 }
 
 
-void SingletonPainter::paint(int x,int y,int w,int h)
+void FramebufferPainter::paint(int x,int y,int w,int h)
 {
     if(x==0&&w==0&&y==0&&h==0) render_rect = Rect(0,0,getWidth(),getHeight());
     else render_rect = Rect(x,y,w,h);
@@ -54,7 +187,18 @@ void SingletonPainter::paint(int x,int y,int w,int h)
 }
 
 
-void SingletonPainter::paintGL()
+void FramebufferPainter::paintGL()
+{
+    draw();
+
+    Mat color_rect = m_color(copy_rect);
+    Mat depth_rect = m_depth(copy_rect);
+    readColor(render_rect,color_rect);
+    readDepth(render_rect,depth_rect);
+}
+
+
+void FramebufferPainter::draw()
 {
     makeCurrent();
     m_fbo->bind();
@@ -68,26 +212,217 @@ void SingletonPainter::paintGL()
 
     for(auto &m : m_objects) m->paint();
 
-    glPixelStorei(GL_PACK_ALIGNMENT, (m_color.step & 3) ? 1 : 4);
-    glPixelStorei(GL_PACK_ROW_LENGTH,m_color.step/m_color.elemSize());
-    glReadPixels(render_rect.x,render_rect.y,render_rect.width,render_rect.height,GL_BGR,GL_UNSIGNED_BYTE,m_color.data);
+    m_fbo->release();
+    doneCurrent();
+}
+
+
+void FramebufferPainter::readDepth(const Rect &rect, Mat &dest)
+{
+    dest.create(rect.height,rect.width,CV_32FC1);
+
+    makeCurrent();
+    m_fbo->bind();
+    // the row length also covers dest being a view into a larger image
     glPixelStorei(GL_PACK_ALIGNMENT,4);
-    glPixelStorei(GL_PACK_ROW_LENGTH,m_depth.step/m_depth.elemSize());
-    glReadPixels(render_rect.x,render_rect.y,render_rect.width,render_rect.height,GL_DEPTH_COMPONENT,GL_FLOAT,m_depth.data);
-    convertZBufferToDepth(m_depth);
+    glPixelStorei(GL_PACK_ROW_LENGTH,dest.step/dest.elemSize());
+    glReadPixels(rect.x,rect.y,rect.width,rect.height,GL_DEPTH_COMPONENT,GL_FLOAT,dest.data);
+    glPixelStorei(GL_PACK_ROW_LENGTH,0);
+    m_fbo->release();
+    doneCurrent();
 
+    convertZBufferToDepth(dest);
+}
+
+
+void FramebufferPainter::readColor(const Rect &rect, Mat &dest)
+{
+    dest.create(rect.height,rect.width,CV_8UC3);
+
+    makeCurrent();
+    m_fbo->bind();
+    glPixelStorei(GL_PACK_ALIGNMENT, (dest.step & 3) ? 1 : 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH,dest.step/dest.elemSize());
+    glReadPixels(rect.x,rect.y,rect.width,rect.height,GL_BGR,GL_UNSIGNED_BYTE,dest.data);
+    glPixelStorei(GL_PACK_ALIGNMENT,4);
+    glPixelStorei(GL_PACK_ROW_LENGTH,0);
     m_fbo->release();
     doneCurrent();
 }
 
-void SingletonPainter::resizeGL(int w, int h){w=h=0;}
+void FramebufferPainter::paintBatch(const vector<vector<PaintObject*>> &batch, const Rect &read_rect, vector<Mat> &depths)
+{
+    depths.resize(batch.size());
+    if (batch.empty()) return;
+
+    makeCurrent();
+    if (m_batch.prepare(static_cast<int>(batch.size()), getWidth(), getHeight()))
+    {
+        delete m_batch_fbo;
+        m_batch_fbo = new QOpenGLFramebufferObject(m_batch.getWidth(), m_batch.getHeight(), QOpenGLFramebufferObject::Depth);
+    }
+
+    m_batch.paint(batch.size(), [&](size_t chunk_begin, size_t chunk_end)
+    {
+        m_batch_fbo->bind();
+        glViewport(0,0,m_batch_fbo->width(),m_batch_fbo->height());
+        glClearColor(m_background[0],m_background[1],m_background[2],1.0f);
+        glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+        glDisable(GL_BLEND);
+        glEnable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+
+        for (size_t i = chunk_begin; i < chunk_end; ++i)
+        {
+            const Point origin = m_batch.getTileOrigin(static_cast<int>(i - chunk_begin));
+            glViewport(origin.x,origin.y,getWidth(),getHeight());
+            for(auto &m : batch[i]) m->paint();
+        }
+    }, GL_DEPTH_COMPONENT, read_rect, depths, [this](Mat &depth) { convertZBufferToDepth(depth); });
+
+    m_batch_fbo->release();
+    doneCurrent();
+}
+
+
+bool TiledBatch::prepare(int tiles, int tile_width, int tile_height)
+{
+    if (!m_initialized)
+    {
+        initializeOpenGLFunctions();
+        m_async_readback = QOpenGLContext::currentContext()->format().version() >= qMakePair(3, 2);
+        if (m_async_readback) glGenBuffers(2, m_pbos);
+        m_initialized = true;
+    }
+
+    tiles = std::max(1, std::min(tiles, MAX_BATCH_TILES));
+
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+    const int max_columns = std::max(1, static_cast<int>(max_size) / tile_width);
+    const int max_rows = std::max(1, static_cast<int>(max_size) / tile_height);
+
+    const int columns = std::min(tiles, max_columns);
+    const int rows = std::min((tiles + columns - 1) / columns, max_rows);
+
+    if (m_tile_width == tile_width && m_tile_height == tile_height && m_columns >= columns && m_rows >= rows)
+    {
+        m_chunk_size = std::min(tiles, m_columns * m_rows);
+        return false;
+    }
+
+    m_tile_width = tile_width;
+    m_tile_height = tile_height;
+    m_columns = columns;
+    m_rows = rows;
+    m_chunk_size = std::min(tiles, columns * rows);
+
+    if (m_async_readback)
+    {
+        for (GLuint pbo : m_pbos)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, getWidth()*getHeight()*sizeof(float), nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    return true;
+}
+
+
+void TiledBatch::paint(size_t count, const std::function<void(size_t, size_t)> &draw_chunk, GLenum format,
+                       const Rect &read_rect, vector<Mat> &depths, const std::function<void(Mat&)> &convert)
+{
+    const size_t chunk_size = static_cast<size_t>(m_chunk_size);
+
+    // chunk whose readback is in flight
+    size_t pending_begin = 0, pending_end = 0;
+    int pending_buffer = 0;
+
+    for (size_t chunk_begin = 0; chunk_begin < count; chunk_begin += chunk_size)
+    {
+        const size_t chunk_end = std::min(chunk_begin + chunk_size, count);
+        const int buffer = static_cast<int>((chunk_begin / chunk_size) % 2);
+
+        draw_chunk(chunk_begin, chunk_end);
+
+        if (!m_async_readback)
+        {
+            for (size_t i = chunk_begin; i < chunk_end; ++i)
+            {
+                depths[i].create(read_rect.height,read_rect.width,CV_32FC1);
+                glPixelStorei(GL_PACK_ALIGNMENT,4);
+                glPixelStorei(GL_PACK_ROW_LENGTH,depths[i].step/depths[i].elemSize());
+                const Point origin = getTileOrigin(static_cast<int>(i - chunk_begin)) + read_rect.tl();
+                glReadPixels(origin.x,origin.y,read_rect.width,read_rect.height,format,GL_FLOAT,depths[i].data);
+                glPixelStorei(GL_PACK_ROW_LENGTH,0);
+                if (convert) convert(depths[i]);
+            }
+            continue;
+        }
+
+        // returns immediately, the copy into the pixel buffer completes in the background
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[buffer]);
+        glPixelStorei(GL_PACK_ALIGNMENT,4);
+        glReadPixels(0,0,getWidth(),getHeight(),format,GL_FLOAT,nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        m_fences[buffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        // the previous chunk was transferred while this one was drawn
+        if (pending_end > pending_begin) copyTiles(pending_buffer, pending_begin, pending_end, read_rect, depths, convert);
+
+        pending_begin = chunk_begin;
+        pending_end = chunk_end;
+        pending_buffer = buffer;
+    }
+
+    if (pending_end > pending_begin) copyTiles(pending_buffer, pending_begin, pending_end, read_rect, depths, convert);
+}
+
 
-void SingletonPainter::clearBackground(float r,float g,float b)
+void TiledBatch::copyTiles(int buffer, size_t begin, size_t end, const Rect &read_rect, vector<Mat> &depths,
+                           const std::function<void(Mat&)> &convert)
+{
+    while (glClientWaitSync(m_fences[buffer], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+    glDeleteSync(m_fences[buffer]);
+    m_fences[buffer] = nullptr;
+
+    const int width = getWidth();
+    const int height = getHeight();
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[buffer]);
+    void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, width*height*sizeof(float), GL_MAP_READ_BIT);
+    const Mat batch_depth(height, width, CV_32FC1, data);
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        const Rect tile_rect(getTileOrigin(static_cast<int>(i - begin)) + read_rect.tl(), read_rect.size());
+        // in place if the destination already has the read size
+        batch_depth(tile_rect).copyTo(depths[i]);
+        if (convert) convert(depths[i]);
+    }
+
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+
+void TiledBatch::destroy()
+{
+    if (m_pbos[0] != 0) glDeleteBuffers(2, m_pbos);
+    m_pbos[0] = m_pbos[1] = 0;
+}
+
+
+void FramebufferPainter::resizeGL(int w, int h){w=h=0;}
+
+void FramebufferPainter::clearBackground(float r,float g,float b)
 {
     m_background << r,g,b;
 }
 
-void SingletonPainter::bindVBOs(vector<Vector3f> &vertex, vector<Vector3i> &faces, GLuint &vert, GLuint &ind)
+void FramebufferPainter::bindVBOs(vector<Vector3f> &vertex, vector<Vector3i> &faces, GLuint &vert, GLuint &ind)
 {
     makeCurrent();
     glGenBuffers(1, &vert);
@@ -100,11 +435,13 @@ void SingletonPainter::bindVBOs(vector<Vector3f> &vertex, vector<Vector3i> &face
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ind);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Vector3i)*faces.size(),faces.data(),GL_STATIC_DRAW);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    // the contexts of other threads may draw with the buffers right away
+    glFinish();
     doneCurrent();
 }
 
 
-void SingletonPainter::drawVBOs(GLuint vert, GLuint ind, int count)
+void FramebufferPainter::drawVBOs(GLuint vert, GLuint ind, int count)
 {
     glBindBuffer(GL_ARRAY_BUFFER, vert);
     glVertexPointer(3,GL_FLOAT,2*sizeof(Vector3f),0);
@@ -116,18 +453,19 @@ void SingletonPainter::drawVBOs(GLuint vert, GLuint ind, int count)
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
-void SingletonPainter::convertZBufferToDepth(Mat &depth)
+void FramebufferPainter::convertZBufferToDepth(Mat &depth)
 {
 	const float mult = (m_near*m_far) / (m_near - m_far);
 	const float addi = m_far / (m_near - m_far);
-	float *ptr = depth.ptr<float>(0);
-	for (int i = 0; i < depth.rows*depth.cols; ++i, ++ptr)
-		if (*ptr != 1.0) *ptr = mult / (*ptr + addi);
-		else *ptr = 0;
+	// row by row, depth may be a view into a larger image
+	for (int i = 0; i < depth.rows; ++i)
+	{
+		float *ptr = depth.ptr<float>(i);
+		for (int j = 0; j < depth.cols; ++j)
+			ptr[j] = ptr[j] != 1.0f ? mult / (ptr[j] + addi) : 0.0f;
+	}
 }
 
-SingletonPainter* Painter::m_singleton= 0;
-
 
 RealWorldCamera::RealWorldCamera(Matrix3f &kma,Isometry3f &transform, float p_near, float p_far)
 {
@@ -147,11 +485,12 @@ void RealWorldCamera::paint(void)
     mat.block(2,0,1,4) *= -(m_near+m_far); // scale factor
     mat(2,3) += m_near*m_far; //offset
 
+    // image coordinates map onto the viewport, also if it is a tile with an offset
     GLint viewport[4];
     glGetIntegerv(GL_VIEWPORT,viewport);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    glOrtho(viewport[0],viewport[2],viewport[1],viewport[3],m_near,m_far);
+    glOrtho(0,viewport[2],0,viewport[3],m_near,m_far);
     glMultMatrixf(mat.data());
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
@@ -8,19 +8,165 @@
 //#######################################################################
 
 #include "renderer.h"
+#include "cpu_renderer.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+// Models are loaded once per process and shared by all renderers, e.g. across the scenes of a batch.
+// Their vertex buffers are created with the fixed function painter of the first renderer and shared by all painter
+// contexts. Models without a painter (cpu renderers or the shader painter, which creates its own buffers) are kept apart
+// since they have no vertex buffers.
+std::shared_ptr<Model> get_shared_model(const std::string &model_file, Painter *painter)
+{
+	static std::map<std::pair<std::string, bool>, std::shared_ptr<Model>> models;
+	static std::mutex models_mutex;
+
+	std::lock_guard<std::mutex> lock(models_mutex);
+
+	std::shared_ptr<Model> &model = models[std::make_pair(model_file, painter != nullptr)];
+	if (!model)
+	{
+		model.reset(new Model());
+		// with the edges, computed on first use they would race between renderers called from several threads at once
+		model->loadPLY(model_file, painter);
+	}
+
+	return model;
+}
 
 Renderer::Renderer(RendererConfiguration& configuration) :
-  intrinsics(configuration.intrinsics), z_near(configuration.z_near), z_far(configuration.z_far)
+  intrinsics(configuration.intrinsics),
+  width(configuration.width), height(configuration.height),
+  z_near(configuration.z_near), z_far(configuration.z_far)
 {	
-	Painter::z_near = configuration.z_near;
-	Painter::z_far= configuration.z_far;
-	Painter::width = configuration.width;
-	Painter::height = configuration.height;
+	Painter::initialize(configuration.backend);
 
-	model.loadPLY(configuration.model_file);
+	shader_painter = ShaderPainter::acquire(configuration.width, configuration.height, configuration.z_near, configuration.z_far);
+	if (!shader_painter)
+	{
+		painter.reset(new Painter(configuration.width, configuration.height, configuration.z_near, configuration.z_far, configuration.backend));
+	}
+
+	model = get_shared_model(configuration.model_file, painter.get());
 }
 
 void Renderer::render(Eigen::Matrix4f &pose_matrix, cv::Mat &depth, cv::Mat &color)
+{
+	render(pose_matrix, 1.0f, depth, color);
+}
+
+void Renderer::render(Eigen::Matrix4f &pose_matrix, float scale, cv::Mat &depth, cv::Mat &color)
+{
+	render(pose_matrix, scale, RENDER_DEPTH | RENDER_COLOR, cv::Rect(), depth, color);
+}
+
+void Renderer::render(Eigen::Matrix4f &pose_matrix, float scale, int buffers, const cv::Rect &roi, cv::Mat &depth, cv::Mat &color)
+{
+	Eigen::Isometry3f pose;
+	pose.setIdentity();
+
+	pose.linear() = pose_matrix.block<3, 3>(0, 0);
+	pose.translation() = pose_matrix.block<3, 1>(0, 3);
+
+	Eigen::Matrix3f scaled_intrinsics = get_scaled_intrinsics(scale);
+	const cv::Rect image_rect = get_scaled_image_rect(scale);
+	const cv::Rect read_rect = roi.area() > 0 ? (roi & image_rect) : image_rect;
+
+	// the metric depth is read as it is, without converting the z-buffer
+	if (shader_painter)
+	{
+		const ModelInstances instances{ ModelInstance(model.get(), pose, 1) };
+		shader_painter->draw(scaled_intrinsics, instances);
+
+		if (buffers & RENDER_DEPTH) shader_painter->readDepth(read_rect, depth);
+		if (buffers & RENDER_COLOR) shader_painter->readColor(read_rect, color);
+		return;
+	}
+
+	RealWorldCamera cam(scaled_intrinsics, pose, z_near, z_far);
+
+	painter->clearObjects();
+	painter->setBackground(0, 0, 0);
+	painter->addPaintObject(&cam);
+	painter->addPaintObject(model.get());
+	painter->draw();
+
+	if (buffers & RENDER_DEPTH) painter->readDepth(read_rect, depth);
+	if (buffers & RENDER_COLOR) painter->readColor(read_rect, color);
+}
+
+void Renderer::render_batch(std::vector<Eigen::Matrix4f> &pose_matrices, float scale, std::vector<cv::Mat> &depths)
+{
+	Eigen::Matrix3f scaled_intrinsics = get_scaled_intrinsics(scale);
+
+	if (shader_painter)
+	{
+		std::vector<Eigen::Isometry3f, Eigen::aligned_allocator<Eigen::Isometry3f>> poses;
+		poses.reserve(pose_matrices.size());
+
+		for (const Eigen::Matrix4f &pose_matrix : pose_matrices)
+		{
+			Eigen::Isometry3f pose;
+			pose.setIdentity();
+
+			pose.linear() = pose_matrix.block<3, 3>(0, 0);
+			pose.translation() = pose_matrix.block<3, 1>(0, 3);
+
+			poses.push_back(pose);
+		}
+
+		shader_painter->paintBatch(scaled_intrinsics, model.get(), poses, get_scaled_image_rect(scale), depths);
+		return;
+	}
+
+	std::vector<RealWorldCamera, Eigen::aligned_allocator<RealWorldCamera>> cameras;
+	cameras.reserve(pose_matrices.size());
+
+	for (const Eigen::Matrix4f &pose_matrix : pose_matrices)
+	{
+		Eigen::Isometry3f pose;
+		pose.setIdentity();
+
+		pose.linear() = pose_matrix.block<3, 3>(0, 0);
+		pose.translation() = pose_matrix.block<3, 1>(0, 3);
+
+		cameras.emplace_back(scaled_intrinsics, pose, z_near, z_far);
+	}
+
+	std::vector<std::vector<PaintObject*>> batch(cameras.size());
+	for (size_t i = 0; i < cameras.size(); ++i) batch[i] = { &cameras[i], model.get() };
+
+	painter->setBackground(0, 0, 0);
+	painter->paintBatch(batch, get_scaled_image_rect(scale), depths);
+}
+
+Eigen::Matrix3f Renderer::get_scaled_intrinsics(float scale) const
+{
+	scale = std::min(std::max(scale, 0.0f), 1.0f);
+
+	Eigen::Matrix3f scaled_intrinsics = intrinsics;
+	scaled_intrinsics.block<2, 3>(0, 0) *= scale;
+
+	return scaled_intrinsics;
+}
+
+// the scaled image covers only the bottom left part of the framebuffer, only this part is read back
+cv::Rect Renderer::get_scaled_image_rect(float scale)
+{
+	scale = std::min(std::max(scale, 0.0f), 1.0f);
+
+	cv::Rect image_rect(0, 0, width, height);
+	if (scale < 1.0f)
+	{
+		image_rect.width = std::max(1, static_cast<int>(width * scale + 0.5f));
+		image_rect.height = std::max(1, static_cast<int>(height * scale + 0.5f));
+	}
+
+	return image_rect;
+}
+
+void Renderer::get_model_edges(Eigen::Matrix4f &pose_matrix, float crease_angle, std::vector<Eigen::Vector3f> &edge_points)
 {
 	Eigen::Isometry3f pose;
 	pose.setIdentity();
@@ -28,17 +174,100 @@ void Renderer::render(Eigen::Matrix4f &pose_matrix, cv::Mat &depth, cv::Mat &col
 	pose.linear() = pose_matrix.block<3, 3>(0, 0);
 	pose.translation() = pose_matrix.block<3, 1>(0, 3);
 
-	RealWorldCamera cam(intrinsics, pose, painter.getNear(), painter.getFar());
+	edge_points.clear();
+	model->computeViewEdges(pose, crease_angle, edge_points);
+}
+
+void Renderer::get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max)
+{
+	bb_min = model->bb_min;
+	bb_max = model->bb_max;
+}
+
+void Renderer::get_model_hull_vertices(std::vector<Eigen::Vector3f> &hull_vertices)
+{
+	hull_vertices.clear();
+	for (int i : model->m_hull_vertices) hull_vertices.push_back(model->m_points[i]);
+}
+
+SceneRenderer::SceneRenderer(SceneRendererConfiguration& configuration) :
+  intrinsics(configuration.intrinsics)
+{
+	Painter::initialize(configuration.backend);
+
+	shader_painter = ShaderPainter::acquire(configuration.width, configuration.height, configuration.z_near, configuration.z_far);
+	if (!shader_painter)
+	{
+		painter.reset(new Painter(configuration.width, configuration.height, configuration.z_near, configuration.z_far, configuration.backend));
+	}
+
+	for (const auto& model_file : configuration.model_files)
+	{
+		models.push_back(get_shared_model(model_file, painter.get()));
+	}
+}
+
+void SceneRenderer::render(std::vector<Eigen::Matrix4f> &pose_matrices, cv::Mat &depth, cv::Mat &object_ids)
+{
+	ModelInstances instances;
+	instances.reserve(models.size());
+
+	for (size_t i = 0; i < models.size(); ++i)
+	{
+		Eigen::Isometry3f pose;
+		pose.setIdentity();
+
+		pose.linear() = pose_matrices[i].block<3, 3>(0, 0);
+		pose.translation() = pose_matrices[i].block<3, 1>(0, 3);
+
+		instances.emplace_back(models[i].get(), pose, static_cast<int>(i) + 1);
+	}
+
+	// all models in one pass, depth and ids come straight from the shader
+	if (shader_painter)
+	{
+		const cv::Rect image_rect(0, 0, shader_painter->getWidth(), shader_painter->getHeight());
+		shader_painter->draw(intrinsics, instances);
+		shader_painter->readDepth(image_rect, depth);
+		shader_painter->readObjectIds(image_rect, object_ids);
+		return;
+	}
 
-	int x = 0, y = 0, w = 0, h = 0;
+	// poses are given per model, the camera stays at the origin
+	Eigen::Isometry3f camera_pose = Eigen::Isometry3f::Identity();
+	RealWorldCamera cam(intrinsics, camera_pose, painter->getNear(), painter->getFar());
 
-	painter.clearObjects();
-	painter.setBackground(0, 0, 0);
-	painter.addPaintObject(&cam);
-	painter.addPaintObject(&model);
-	painter.paint(x, y, w, h);
-	painter.copyDepthTo(depth);
-	painter.copyColorTo(color);
+	painter->clearObjects();
+	painter->setBackground(0, 0, 0);
+	painter->addPaintObject(&cam);
+	for (auto& instance : instances) painter->addPaintObject(&instance);
+	painter->draw();
+
+	const cv::Rect image_rect(0, 0, painter->getWidth(), painter->getHeight());
+	painter->readDepth(image_rect, depth);
+	painter->readColor(image_rect, id_color);
+
+	// ids are encoded as red + 256 * green, color is stored as BGR
+	object_ids.create(id_color.rows, id_color.cols, CV_16UC1);
+	for (int i = 0; i < id_color.rows; ++i)
+	{
+		const cv::Vec3b* color_row = id_color.ptr<cv::Vec3b>(i);
+		ushort* ids_row = object_ids.ptr<ushort>(i);
+
+		for (int j = 0; j < id_color.cols; ++j)
+		{
+			ids_row[j] = static_cast<ushort>(color_row[j][2] | (color_row[j][1] << 8));
+		}
+	}
+}
+
+#ifdef _WIN32
+RendererAPI
+#endif
+void initialize_rendering(RenderBackend backend)
+{
+	// the cpu backend needs no context
+	if (backend != RENDER_BACKEND_CPU) Painter::initialize(backend);
 }
 
 #ifdef _WIN32
@@ -46,5 +275,15 @@ RendererAPI
 #endif
 RendererInterfaceHandle get_depth_renderer(RendererConfiguration &configuration)
 {
+	if (configuration.backend == RENDER_BACKEND_CPU) return new CpuRenderer(configuration);
 	return new Renderer(configuration);
+}
+
+#ifdef _WIN32
+RendererAPI
+#endif
+SceneRendererInterfaceHandle get_scene_renderer(SceneRendererConfiguration &configuration)
+{
+	if (configuration.backend == RENDER_BACKEND_CPU) return new CpuSceneRenderer(configuration);
+	return new SceneRenderer(configuration);
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+//######################################################################
+//#   Liboffscreenrenderer Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+// Compares the OpenGL renderer with the cpu rasterizer: time per rendered depth + color image, time per pose
+// of render_batch, and the differences of the depth images, at 640x480 and 1920x1080 or the given size:
+//   renderer_benchmark <model.ply> [widget|headless] [width height]
+
+#include <opencv2/core.hpp>
+#include "renderer.h"
+#include <Eigen/Geometry>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+namespace
+{
+	const int NUMBER_OF_POSES = 100;
+	const int BATCH_SIZE = 16;
+
+	// poses around the model at a distance of 2.5 model diameters
+	std::vector<Eigen::Matrix4f> get_poses(float diameter)
+	{
+		std::vector<Eigen::Matrix4f> poses;
+		for (int i = 0; i < NUMBER_OF_POSES; ++i)
+		{
+			const float angle = 2.0f * static_cast<float>(M_PI) * i / NUMBER_OF_POSES;
+
+			Eigen::Matrix4f pose = Eigen::Matrix4f::Identity();
+			pose.block<3, 3>(0, 0) = (Eigen::AngleAxisf(angle, Eigen::Vector3f::UnitY()) * Eigen::AngleAxisf(0.5f * angle, Eigen::Vector3f::UnitX())).toRotationMatrix();
+			pose.block<3, 1>(0, 3) = Eigen::Vector3f(0, 0, 2.5f * diameter);
+			poses.push_back(pose);
+		}
+		return poses;
+	}
+
+	struct Timings
+	{
+		double single_ms;
+		double batch_ms;
+	};
+
+	Timings measure(RendererInterface &renderer, std::vector<Eigen::Matrix4f> &poses, std::vector<cv::Mat> &depths)
+	{
+		cv::Mat color;
+		depths.resize(poses.size());
+
+		// warm up, e.g. the allocation of the framebuffers
+		renderer.render(poses[0], depths[0], color);
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < poses.size(); ++i) renderer.render(poses[i], depths[i], color);
+		const double single_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		std::vector<cv::Mat> batch_depths;
+		start = std::chrono::steady_clock::now();
+		for (size_t begin = 0; begin < poses.size(); begin += BATCH_SIZE)
+		{
+			std::vector<Eigen::Matrix4f> batch(poses.begin() + begin, poses.begin() + std::min(poses.size(), begin + BATCH_SIZE));
+			renderer.render_batch(batch, 1.0f, batch_depths);
+		}
+		const double batch_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		return { single_ms / poses.size(), batch_ms / poses.size() };
+	}
+
+	void benchmark(const std::string &model_file, RenderBackend backend, int width, int height)
+	{
+		// primesense intrinsics scaled to the resolution
+		Eigen::Matrix3f intrinsics;
+		intrinsics << 614.141479f * width / 640, 0, 0.5f * width,
+			0, 613.991272f * height / 480, 0.5f * height,
+			0, 0, 1;
+
+		RendererConfiguration configuration;
+		configuration.width = width;
+		configuration.height = height;
+		configuration.intrinsics = intrinsics;
+		configuration.z_near = 0.01f;
+		configuration.z_far = 10.0f;
+		configuration.model_file = model_file;
+		configuration.backend = backend;
+
+		std::unique_ptr<RendererInterface> gl_renderer(get_depth_renderer(configuration));
+
+		configuration.backend = RENDER_BACKEND_CPU;
+		std::unique_ptr<RendererInterface> cpu_renderer(get_depth_renderer(configuration));
+
+		// the bounding box is in the units of the model file, meters for the refiner
+		std::shared_ptr<Model> model = get_shared_model(model_file);
+		std::vector<Eigen::Matrix4f> poses = get_poses((model->bb_max - model->bb_min).norm());
+
+		std::vector<cv::Mat> gl_depths, cpu_depths;
+		const Timings gl_timings = measure(*gl_renderer, poses, gl_depths);
+		const Timings cpu_timings = measure(*cpu_renderer, poses, cpu_depths);
+
+		// pixels covered by only one of the renderers are mostly on the silhouette
+		double depth_difference_sum = 0, max_depth_difference = 0;
+		size_t common_pixels = 0, differently_covered_pixels = 0;
+		for (size_t i = 0; i < poses.size(); ++i)
+		{
+			for (int r = 0; r < height; ++r)
+			{
+				const float* gl_row = gl_depths[i].ptr<float>(r);
+				const float* cpu_row = cpu_depths[i].ptr<float>(r);
+				for (int c = 0; c < width; ++c)
+				{
+					if ((gl_row[c] > 0) != (cpu_row[c] > 0)) ++differently_covered_pixels;
+					if (gl_row[c] <= 0 || cpu_row[c] <= 0) continue;
+
+					const double difference = std::abs(gl_row[c] - cpu_row[c]);
+					depth_difference_sum += difference;
+					max_depth_difference = std::max(max_depth_difference, difference);
+					++common_pixels;
+				}
+			}
+		}
+
+		std::cout << std::fixed << std::setprecision(3);
+		std::cout << width << "x" << height << ", " << poses.size() << " poses" << std::endl;
+		std::cout << "opengl: " << gl_timings.single_ms << " ms per render, " << gl_timings.batch_ms << " ms per pose in batches of " << BATCH_SIZE << std::endl;
+		std::cout << "cpu:    " << cpu_timings.single_ms << " ms per render, " << cpu_timings.batch_ms << " ms per pose in batches of " << BATCH_SIZE << std::endl;
+		std::cout << std::setprecision(6);
+		std::cout << "depth difference: mean " << (common_pixels ? depth_difference_sum / common_pixels : 0.0) << ", max " << max_depth_difference
+		          << ", pixels covered by one renderer only: " << differently_covered_pixels << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " <model.ply> [widget|headless] [width height]" << std::endl;
+		return 1;
+	}
+
+	const RenderBackend backend = (argc > 2 && std::string(argv[2]) == "headless") ? RENDER_BACKEND_HEADLESS : RENDER_BACKEND_WIDGET;
+
+	if (argc > 4)
+	{
+		benchmark(argv[1], backend, std::stoi(argv[3]), std::stoi(argv[4]));
+	}
+	else
+	{
+		benchmark(argv[1], backend, 640, 480);
+		benchmark(argv[1], backend, 1920, 1080);
+	}
+
+	return 0;
+}
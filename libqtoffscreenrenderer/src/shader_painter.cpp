@@ -0,0 +1,521 @@
+//######################################################################
+//#   Liboffscreenrenderer Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#include "shader_painter.h"
+#include <Eigen/StdVector>
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+
+
+using namespace std;
+using namespace cv;
+using namespace Eigen;
+
+
+// instances per uniform buffer upload, 96 bytes each stay below the minimum block size of 16KB
+const int MAX_OBJECTS = 128;
+// tile transformation of images covering the whole framebuffer
+const GLfloat FULL_IMAGE_TILE[4] = {1.0f, 1.0f, 0.0f, 0.0f};
+
+// std140 layout of an element of the Objects block
+struct ObjectData
+{
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    Matrix4f model_view;
+    GLint id[4];
+    // scale and offset from the normalized device coordinates of the image to those of its tile in the framebuffer
+    GLfloat tile[4];
+};
+
+static const char *VERTEX_SHADER = R"(
+#version 330 core
+#define MAX_OBJECTS 128
+
+struct Object
+{
+    mat4 model_view;
+    ivec4 id;
+    vec4 tile;
+};
+
+layout(std140) uniform Objects
+{
+    Object objects[MAX_OBJECTS];
+};
+
+uniform mat4 projection;
+uniform int first_object;
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 color;
+
+out vec3 vertex_color;
+out float camera_depth;
+flat out uint object_id;
+
+void main()
+{
+    Object object = objects[first_object + gl_InstanceID];
+    vec4 camera_position = object.model_view * vec4(position, 1.0);
+
+    vertex_color = color;
+    camera_depth = camera_position.z;
+    object_id = uint(object.id.x);
+
+    // the image of a batch tile is clipped to the tile, the clip distances are only enabled for batches
+    vec4 image_position = projection * camera_position;
+    gl_ClipDistance[0] = image_position.w + image_position.x;
+    gl_ClipDistance[1] = image_position.w - image_position.x;
+    gl_ClipDistance[2] = image_position.w + image_position.y;
+    gl_ClipDistance[3] = image_position.w - image_position.y;
+
+    gl_Position = vec4(image_position.xy * object.tile.xy + image_position.w * object.tile.zw, image_position.zw);
+}
+)";
+
+static const char *FRAGMENT_SHADER = R"(
+#version 330 core
+
+in vec3 vertex_color;
+in float camera_depth;
+flat in uint object_id;
+
+layout(location = 0) out vec4 color;
+layout(location = 1) out float depth;
+layout(location = 2) out uint id;
+
+void main()
+{
+    color = vec4(vertex_color, 1.0);
+    depth = camera_depth;
+    id = object_id;
+}
+)";
+
+
+std::map<const Model*, ShaderPainter::MeshBuffers> ShaderPainter::s_mesh_buffers;
+std::mutex ShaderPainter::s_mesh_buffers_mutex;
+
+
+std::shared_ptr<ShaderPainter> ShaderPainter::acquire(int width, int height, float z_near, float z_far)
+{
+    typedef std::tuple<int,int,float,float> PainterKey;
+    // destroyed with the thread, whose id may be reused by a later one that must not get its contexts
+    static thread_local std::map<PainterKey,std::shared_ptr<ShaderPainter>> painters;
+    static std::mutex share_mutex;
+    // core context owned by no painter, all painters share the model buffers with it
+    static RenderContext *share_context = 0;
+    static bool unsupported = false;
+
+    std::shared_ptr<ShaderPainter> &painter = painters[PainterKey(width,height,z_near,z_far)];
+    if (!painter)
+    {
+        RenderContext *context;
+        {
+            std::lock_guard<std::mutex> lock(share_mutex);
+            if (unsupported) return nullptr;
+            if (!share_context) share_context = new HeadlessRenderContext(Painter::getOffscreenSurface(true),0,true);
+            context = share_context->createShared();
+        }
+        painter.reset(new ShaderPainter(z_near,z_far,width,height,context));
+
+        if (!painter->m_valid)
+        {
+            cerr << "ShaderPainter: no OpenGL 3.3 core profile, using the fixed function painter" << endl;
+            std::lock_guard<std::mutex> lock(share_mutex);
+            unsupported = true;
+            painter.reset();
+            return nullptr;
+        }
+    }
+
+    return painter;
+}
+
+
+ShaderPainter::ShaderPainter(float p_near,float p_far,int width,int height,RenderContext *context):
+    m_near(p_near),m_far(p_far),m_width(width),m_height(height),m_context(context)
+{
+    if (!m_context->isValid()) return;
+
+    makeCurrent();
+    m_valid = initialize();
+    doneCurrent();
+}
+
+
+ShaderPainter::~ShaderPainter()
+{
+    if (m_valid)
+    {
+        makeCurrent();
+        for (auto &vertex_array : m_vertex_arrays) glDeleteVertexArrays(1,&vertex_array.second);
+        glDeleteFramebuffers(1,&m_fbo);
+        glDeleteRenderbuffers(3,m_attachments);
+        glDeleteRenderbuffers(1,&m_depth_buffer);
+        glDeleteBuffers(1,&m_objects_ubo);
+        glDeleteProgram(m_program);
+        if (m_batch_fbo != 0)
+        {
+            glDeleteFramebuffers(1,&m_batch_fbo);
+            glDeleteRenderbuffers(2,m_batch_buffers);
+        }
+        m_batch.destroy();
+        doneCurrent();
+    }
+    delete m_context;
+}
+
+
+bool ShaderPainter::initialize()
+{
+    if (QOpenGLContext::currentContext()->format().version() < qMakePair(3,3)) return false;
+    initializeOpenGLFunctions();
+
+    const GLuint vertex_shader = compileShader(GL_VERTEX_SHADER,VERTEX_SHADER);
+    const GLuint fragment_shader = compileShader(GL_FRAGMENT_SHADER,FRAGMENT_SHADER);
+    if (vertex_shader == 0 || fragment_shader == 0) return false;
+
+    m_program = glCreateProgram();
+    glAttachShader(m_program,vertex_shader);
+    glAttachShader(m_program,fragment_shader);
+    glLinkProgram(m_program);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(m_program,GL_LINK_STATUS,&linked);
+    if (linked != GL_TRUE)
+    {
+        char log[1024];
+        glGetProgramInfoLog(m_program,sizeof(log),nullptr,log);
+        cerr << "ShaderPainter: linking failed: " << log << endl;
+        return false;
+    }
+
+    m_projection_location = glGetUniformLocation(m_program,"projection");
+    m_first_object_location = glGetUniformLocation(m_program,"first_object");
+    glUniformBlockBinding(m_program,glGetUniformBlockIndex(m_program,"Objects"),0);
+
+    glGenBuffers(1,&m_objects_ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER,m_objects_ubo);
+    glBufferData(GL_UNIFORM_BUFFER,MAX_OBJECTS*sizeof(ObjectData),nullptr,GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER,0);
+
+    // color, metric depth and object ids
+    const GLenum formats[3] = {GL_RGBA8, GL_R32F, GL_R16UI};
+    glGenRenderbuffers(3,m_attachments);
+    glGenRenderbuffers(1,&m_depth_buffer);
+    glGenFramebuffers(1,&m_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER,m_fbo);
+    for (int i = 0; i < 3; ++i)
+    {
+        glBindRenderbuffer(GL_RENDERBUFFER,m_attachments[i]);
+        glRenderbufferStorage(GL_RENDERBUFFER,formats[i],m_width,m_height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0+i,GL_RENDERBUFFER,m_attachments[i]);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER,m_depth_buffer);
+    glRenderbufferStorage(GL_RENDERBUFFER,GL_DEPTH_COMPONENT24,m_width,m_height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_DEPTH_ATTACHMENT,GL_RENDERBUFFER,m_depth_buffer);
+    glBindRenderbuffer(GL_RENDERBUFFER,0);
+
+    const GLenum draw_buffers[3] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+    glDrawBuffers(3,draw_buffers);
+
+    const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER,0);
+    if (!complete) cerr << "ShaderPainter: incomplete framebuffer" << endl;
+
+    return complete;
+}
+
+
+GLuint ShaderPainter::compileShader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader,1,&source,nullptr);
+    glCompileShader(shader);
+
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader,GL_COMPILE_STATUS,&compiled);
+    if (compiled != GL_TRUE)
+    {
+        char log[1024];
+        glGetShaderInfoLog(shader,sizeof(log),nullptr,log);
+        cerr << "ShaderPainter: compiling a shader failed: " << log << endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+
+GLuint ShaderPainter::getVertexArray(const Model *model)
+{
+    GLuint &vertex_array = m_vertex_arrays[model];
+    if (vertex_array != 0) return vertex_array;
+
+    MeshBuffers buffers;
+    {
+        std::lock_guard<std::mutex> lock(s_mesh_buffers_mutex);
+        buffers = s_mesh_buffers[model];
+        if (buffers.vertices == 0)
+        {
+            // interleaved position and color
+            vector<Vector3f> vertex_data(model->m_points.size()*2);
+            for (size_t i = 0; i < model->m_points.size(); ++i)
+            {
+                vertex_data[i*2+0] = model->m_points[i];
+                vertex_data[i*2+1] = model->m_colors[i];
+            }
+
+            glGenBuffers(1,&buffers.vertices);
+            glBindBuffer(GL_ARRAY_BUFFER,buffers.vertices);
+            glBufferData(GL_ARRAY_BUFFER,sizeof(Vector3f)*vertex_data.size(),vertex_data.data(),GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER,0);
+
+            if (!model->m_faces.empty())
+            {
+                glGenBuffers(1,&buffers.indices);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,buffers.indices);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER,sizeof(Vector3i)*model->m_faces.size(),model->m_faces.data(),GL_STATIC_DRAW);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+            }
+
+            // the contexts of other threads may draw with the buffers right away
+            glFinish();
+            s_mesh_buffers[model] = buffers;
+        }
+    }
+
+    glGenVertexArrays(1,&vertex_array);
+    glBindVertexArray(vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER,buffers.vertices);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,2*sizeof(Vector3f),0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1,3,GL_FLOAT,GL_FALSE,2*sizeof(Vector3f),reinterpret_cast<void*>(sizeof(Vector3f)));
+    if (buffers.indices != 0) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,buffers.indices);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
+
+    return vertex_array;
+}
+
+
+// The projection of RealWorldCamera: pixel coordinates onto the viewport, depths in [near, far] onto [-1, 1]
+Matrix4f ShaderPainter::getProjection(const Matrix3f &intrinsics)
+{
+    Matrix4f camera = Matrix4f::Zero();
+    camera.block<2,3>(0,0) = intrinsics.block<2,3>(0,0);
+    camera(2,2) = -(m_near+m_far);
+    camera(2,3) = m_near*m_far;
+    camera(3,2) = 1.0f;
+
+    Matrix4f ortho = Matrix4f::Identity();
+    ortho(0,0) = 2.0f/m_width;
+    ortho(0,3) = -1.0f;
+    ortho(1,1) = 2.0f/m_height;
+    ortho(1,3) = -1.0f;
+    ortho(2,2) = -2.0f/(m_far-m_near);
+    ortho(2,3) = -(m_far+m_near)/(m_far-m_near);
+
+    return ortho*camera;
+}
+
+
+void ShaderPainter::draw(const Matrix3f &intrinsics, const ModelInstances &instances)
+{
+    makeCurrent();
+    glBindFramebuffer(GL_FRAMEBUFFER,m_fbo);
+    glViewport(0,0,m_width,m_height);
+
+    const GLfloat no_color[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    const GLuint no_id[4] = {0, 0, 0, 0};
+    const GLfloat far_depth = 1.0f;
+    glClearBufferfv(GL_COLOR,0,no_color);
+    glClearBufferfv(GL_COLOR,1,no_color);
+    glClearBufferuiv(GL_COLOR,2,no_id);
+    glClearBufferfv(GL_DEPTH,0,&far_depth);
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glDepthMask(GL_TRUE);
+
+    glUseProgram(m_program);
+    const Matrix4f projection = getProjection(intrinsics);
+    glUniformMatrix4fv(m_projection_location,1,GL_FALSE,projection.data());
+    glBindBufferBase(GL_UNIFORM_BUFFER,0,m_objects_ubo);
+
+    // instances of the same model next to each other, so that each run is one instanced draw call
+    vector<size_t> order(instances.size());
+    std::iota(order.begin(),order.end(),0);
+    std::stable_sort(order.begin(),order.end(),[&](size_t a, size_t b){return instances[a].m_model < instances[b].m_model;});
+
+    vector<ObjectData,aligned_allocator<ObjectData>> objects(std::min(instances.size(),static_cast<size_t>(MAX_OBJECTS)));
+    for (size_t chunk_begin = 0; chunk_begin < order.size(); chunk_begin += MAX_OBJECTS)
+    {
+        const size_t chunk_end = std::min(chunk_begin+MAX_OBJECTS,order.size());
+        for (size_t i = chunk_begin; i < chunk_end; ++i)
+        {
+            const ModelInstance &instance = instances[order[i]];
+            objects[i-chunk_begin].model_view = instance.m_pose.matrix();
+            objects[i-chunk_begin].id[0] = instance.m_id;
+            std::copy_n(FULL_IMAGE_TILE,4,objects[i-chunk_begin].tile);
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER,m_objects_ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER,0,(chunk_end-chunk_begin)*sizeof(ObjectData),objects.data());
+        glBindBuffer(GL_UNIFORM_BUFFER,0);
+
+        for (size_t run_begin = chunk_begin, run_end; run_begin < chunk_end; run_begin = run_end)
+        {
+            const Model *model = instances[order[run_begin]].m_model;
+            for (run_end = run_begin+1; run_end < chunk_end && instances[order[run_end]].m_model == model; ++run_end) {}
+
+            const GLsizei count = static_cast<GLsizei>(run_end-run_begin);
+            glUniform1i(m_first_object_location,static_cast<GLint>(run_begin-chunk_begin));
+            glBindVertexArray(getVertexArray(model));
+            if (!model->m_faces.empty()) glDrawElementsInstanced(GL_TRIANGLES,model->m_faces.size()*3,GL_UNSIGNED_INT,0,count);
+            else glDrawArraysInstanced(GL_POINTS,0,model->m_points.size(),count);
+        }
+    }
+
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER,0);
+    doneCurrent();
+}
+
+
+void ShaderPainter::createBatchFramebuffer()
+{
+    if (m_batch_fbo == 0)
+    {
+        glGenFramebuffers(1,&m_batch_fbo);
+        glGenRenderbuffers(2,m_batch_buffers);
+    }
+    const int width = m_batch.getWidth(), height = m_batch.getHeight();
+
+    // only the metric depth, the shader writes it to its second output
+    glBindFramebuffer(GL_FRAMEBUFFER,m_batch_fbo);
+    glBindRenderbuffer(GL_RENDERBUFFER,m_batch_buffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER,GL_R32F,width,height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT1,GL_RENDERBUFFER,m_batch_buffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER,m_batch_buffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER,GL_DEPTH_COMPONENT24,width,height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_DEPTH_ATTACHMENT,GL_RENDERBUFFER,m_batch_buffers[1]);
+    glBindRenderbuffer(GL_RENDERBUFFER,0);
+
+    const GLenum draw_buffers[2] = {GL_NONE, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(2,draw_buffers);
+    glReadBuffer(GL_COLOR_ATTACHMENT1);
+    glBindFramebuffer(GL_FRAMEBUFFER,0);
+}
+
+
+void ShaderPainter::paintBatch(const Matrix3f &intrinsics, const Model *model, const vector<Isometry3f,aligned_allocator<Isometry3f>> &poses,
+                               const Rect &read_rect, vector<Mat> &depths)
+{
+    depths.resize(poses.size());
+    if (poses.empty()) return;
+
+    makeCurrent();
+    if (m_batch.prepare(static_cast<int>(poses.size()),m_width,m_height)) createBatchFramebuffer();
+    const float batch_width = static_cast<float>(m_batch.getWidth());
+    const float batch_height = static_cast<float>(m_batch.getHeight());
+
+    glUseProgram(m_program);
+    const Matrix4f projection = getProjection(intrinsics);
+    glUniformMatrix4fv(m_projection_location,1,GL_FALSE,projection.data());
+    glUniform1i(m_first_object_location,0);
+    glBindBufferBase(GL_UNIFORM_BUFFER,0,m_objects_ubo);
+    glBindVertexArray(getVertexArray(model));
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glDepthMask(GL_TRUE);
+    for (int i = 0; i < 4; ++i) glEnable(GL_CLIP_DISTANCE0+i);
+
+    vector<ObjectData,aligned_allocator<ObjectData>> objects(m_batch.getChunkSize());
+
+    // the metric depth needs no conversion
+    m_batch.paint(poses.size(), [&](size_t chunk_begin, size_t chunk_end)
+    {
+        for (size_t i = chunk_begin; i < chunk_end; ++i)
+        {
+            ObjectData &object = objects[i-chunk_begin];
+            const Point origin = m_batch.getTileOrigin(static_cast<int>(i - chunk_begin));
+            object.model_view = poses[i].matrix();
+            object.id[0] = 1;
+            object.tile[0] = m_width/batch_width;
+            object.tile[1] = m_height/batch_height;
+            object.tile[2] = (2.0f*origin.x + m_width)/batch_width - 1.0f;
+            object.tile[3] = (2.0f*origin.y + m_height)/batch_height - 1.0f;
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER,m_objects_ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER,0,(chunk_end-chunk_begin)*sizeof(ObjectData),objects.data());
+        glBindBuffer(GL_UNIFORM_BUFFER,0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER,m_batch_fbo);
+        glViewport(0,0,m_batch.getWidth(),m_batch.getHeight());
+        const GLfloat no_depth[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        const GLfloat far_depth = 1.0f;
+        glClearBufferfv(GL_COLOR,1,no_depth);
+        glClearBufferfv(GL_DEPTH,0,&far_depth);
+
+        // all poses of the chunk in one call, each into its own tile
+        const GLsizei count = static_cast<GLsizei>(chunk_end-chunk_begin);
+        if (!model->m_faces.empty()) glDrawElementsInstanced(GL_TRIANGLES,model->m_faces.size()*3,GL_UNSIGNED_INT,0,count);
+        else glDrawArraysInstanced(GL_POINTS,0,model->m_points.size(),count);
+    }, GL_RED, read_rect, depths, nullptr);
+
+    glBindFramebuffer(GL_FRAMEBUFFER,0);
+    for (int i = 0; i < 4; ++i) glDisable(GL_CLIP_DISTANCE0+i);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    doneCurrent();
+}
+
+
+void ShaderPainter::readAttachment(GLenum attachment, GLenum format, GLenum type, int mat_type, const Rect &rect, Mat &dest)
+{
+    dest.create(rect.height,rect.width,mat_type);
+
+    makeCurrent();
+    glBindFramebuffer(GL_READ_FRAMEBUFFER,m_fbo);
+    glReadBuffer(attachment);
+    // the row length also covers dest being a view into a larger image
+    glPixelStorei(GL_PACK_ALIGNMENT,(dest.step & 3) ? 1 : 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH,dest.step/dest.elemSize());
+    glReadPixels(rect.x,rect.y,rect.width,rect.height,format,type,dest.data);
+    glPixelStorei(GL_PACK_ALIGNMENT,4);
+    glPixelStorei(GL_PACK_ROW_LENGTH,0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER,0);
+    doneCurrent();
+}
+
+
+void ShaderPainter::readColor(const Rect &rect, Mat &dest)
+{
+    readAttachment(GL_COLOR_ATTACHMENT0,GL_BGR,GL_UNSIGNED_BYTE,CV_8UC3,rect,dest);
+}
+
+
+void ShaderPainter::readDepth(const Rect &rect, Mat &dest)
+{
+    readAttachment(GL_COLOR_ATTACHMENT1,GL_RED,GL_FLOAT,CV_32FC1,rect,dest);
+}
+
+
+void ShaderPainter::readObjectIds(const Rect &rect, Mat &dest)
+{
+    readAttachment(GL_COLOR_ATTACHMENT2,GL_RED_INTEGER,GL_UNSIGNED_SHORT,CV_16UC1,rect,dest);
+}
@@ -0,0 +1,68 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#ifndef REFINER_BATCH_REFINER_H
+#define REFINER_BATCH_REFINER_H
+
+#include "configuration.h"
+#include "refiner_interface.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Refines the objects of many scenes in one process. Each object (or each scene with joint refinement) is a job 
+// for a pool of workers, the calling thread owns the GL context and serves their rendering meanwhile.
+// Reference models stay loaded across scenes.
+class BatchRefiner
+{
+public:
+	BatchRefiner(const Configuration &configuration, int number_of_workers);
+
+	void add_scene(const RefinementInput &input);
+
+	void run(const std::function<void(const std::string &scene_dir, int model_id, const Eigen::Matrix4d &pose)> &on_model_refined);
+
+private:
+	struct Scene
+	{
+		RefinementInput input;
+
+		// visibility is computed by the first job of the scene for all its objects
+		std::once_flag visibility_flag;
+		std::map<int, std::vector<size_t>> visible_frame_ids;
+	};
+
+	struct Job
+	{
+		size_t scene_idx;
+		// -1 refines all objects of the scene jointly
+		int model_id;
+	};
+
+	void run_worker();
+	void run_job(const Job &job);
+	void report_progress(const Job &job, double job_seconds);
+
+	Configuration configuration;
+	int number_of_workers;
+
+	std::vector<std::unique_ptr<Scene>> scenes;
+	std::vector<Job> jobs;
+
+	std::mutex jobs_mutex;
+	size_t next_job = 0;
+	size_t finished_jobs = 0;
+	size_t refined_objects = 0;
+	double start_time = 0;
+
+	std::function<void(const std::string &, int, const Eigen::Matrix4d &)> model_refined_callback;
+};
+
+#endif
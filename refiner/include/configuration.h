@@ -67,6 +67,94 @@ public:
 	return object_visibility_threshold;
   }
 
+  bool get_joint_refinement() const {
+    return joint_refinement;
+  }
+
+  int get_pyramid_levels() const {
+    return pyramid_levels;
+  }
+
+  int get_pyramid_level_iterations() const {
+    return pyramid_level_iterations;
+  }
+
+  double get_min_rotation_update() const {
+    return min_rotation_update;
+  }
+
+  double get_min_translation_update() const {
+    return min_translation_update;
+  }
+
+  int get_max_frames() const {
+    return max_frames;
+  }
+
+  bool get_rotate_frame_subsets() const {
+    return rotate_frame_subsets;
+  }
+
+  std::string get_depth_edge_extractor() const {
+    return depth_edge_extractor;
+  }
+
+  float get_depth_edge_threshold() const {
+    return depth_edge_threshold;
+  }
+
+  std::string get_model_edge_source() const {
+    return model_edge_source;
+  }
+
+  float get_crease_angle() const {
+    return crease_angle;
+  }
+
+  int get_edge_render_interval() const {
+    return edge_render_interval;
+  }
+
+  bool get_visibility_cache() const {
+    return visibility_cache;
+  }
+
+  bool get_correspondence_cache() const {
+    return correspondence_cache;
+  }
+
+  bool get_subpixel_edges() const {
+    return subpixel_edges;
+  }
+
+  bool get_weighted_correspondences() const {
+    return weighted_correspondences;
+  }
+
+  float get_depth_weight() const {
+    return depth_weight;
+  }
+
+  int get_depth_sampling_step() const {
+    return depth_sampling_step;
+  }
+
+  std::string get_render_backend() const {
+    return render_backend;
+  }
+
+  int get_render_batch_size() const {
+    return render_batch_size;
+  }
+
+  int get_cpu_render_threads() const {
+    return cpu_render_threads;
+  }
+
+  bool get_write_reports() const {
+    return write_reports;
+  }
+
   void set_model_padding_pixels(int padding_pixels) {
     model_padding_pixels = padding_pixels;
   }
@@ -106,6 +194,94 @@ public:
 	object_visibility_threshold = p_object_visibility_thredhold;
   }
 
+  void set_joint_refinement(bool p_joint_refinement) {
+    joint_refinement = p_joint_refinement;
+  }
+
+  void set_pyramid_levels(int levels) {
+    pyramid_levels = levels;
+  }
+
+  void set_pyramid_level_iterations(int iterations) {
+    pyramid_level_iterations = iterations;
+  }
+
+  void set_min_rotation_update(double p_min_rotation_update) {
+    min_rotation_update = p_min_rotation_update;
+  }
+
+  void set_min_translation_update(double p_min_translation_update) {
+    min_translation_update = p_min_translation_update;
+  }
+
+  void set_max_frames(int p_max_frames) {
+    max_frames = p_max_frames;
+  }
+
+  void set_rotate_frame_subsets(bool p_rotate_frame_subsets) {
+    rotate_frame_subsets = p_rotate_frame_subsets;
+  }
+
+  void set_depth_edge_extractor(const std::string &p_depth_edge_extractor) {
+    depth_edge_extractor = p_depth_edge_extractor;
+  }
+
+  void set_depth_edge_threshold(float p_depth_edge_threshold) {
+    depth_edge_threshold = p_depth_edge_threshold;
+  }
+
+  void set_model_edge_source(const std::string &p_model_edge_source) {
+    model_edge_source = p_model_edge_source;
+  }
+
+  void set_crease_angle(float p_crease_angle) {
+    crease_angle = p_crease_angle;
+  }
+
+  void set_edge_render_interval(int p_edge_render_interval) {
+    edge_render_interval = p_edge_render_interval;
+  }
+
+  void set_visibility_cache(bool p_visibility_cache) {
+    visibility_cache = p_visibility_cache;
+  }
+
+  void set_correspondence_cache(bool p_correspondence_cache) {
+    correspondence_cache = p_correspondence_cache;
+  }
+
+  void set_subpixel_edges(bool p_subpixel_edges) {
+    subpixel_edges = p_subpixel_edges;
+  }
+
+  void set_weighted_correspondences(bool p_weighted_correspondences) {
+    weighted_correspondences = p_weighted_correspondences;
+  }
+
+  void set_depth_weight(float p_depth_weight) {
+    depth_weight = p_depth_weight;
+  }
+
+  void set_depth_sampling_step(int p_depth_sampling_step) {
+    depth_sampling_step = p_depth_sampling_step;
+  }
+
+  void set_render_backend(const std::string &p_render_backend) {
+    render_backend = p_render_backend;
+  }
+
+  void set_render_batch_size(int p_render_batch_size) {
+    render_batch_size = p_render_batch_size;
+  }
+
+  void set_cpu_render_threads(int p_cpu_render_threads) {
+    cpu_render_threads = p_cpu_render_threads;
+  }
+
+  void set_write_reports(bool p_write_reports) {
+    write_reports = p_write_reports;
+  }
+
 
 private:
   std::string reference_models_dir;
@@ -122,6 +298,61 @@ private:
 
   float z_near;
   float z_far;
+
+// refine all objects of the scene together, sharing frame loading and rendering
+  bool joint_refinement = false;
+
+// number of image pyramid levels, each coarser level halves the resolution
+  int pyramid_levels = 1;
+// max iterations on each of the coarse levels, the full resolution uses max_iterations
+  int pyramid_level_iterations = 3;
+
+// iterations stop once the pose changes less than this (degrees and meters), 0 disables the check
+  double min_rotation_update = 0.0;
+  double min_translation_update = 0.0;
+
+// max number of viewpoint-diverse frames used per object, 0 uses all visible frames
+  int max_frames = 0;
+// pick a different frame subset in every iteration instead of a fixed one
+  bool rotate_frame_subsets = false;
+
+// "lsd" runs the line detector on the normalized rendered depth, 
+// "gradient" fits segments to depth discontinuities larger than depth_edge_threshold (meters)
+  std::string depth_edge_extractor = "lsd";
+  float depth_edge_threshold = 0.01f;
+
+// "depth" finds the model edges in the rendered depth every iteration, "mesh" projects the silhouette and 
+// crease edges (dihedral angle above crease_angle degrees) of the mesh and renders depth only every 
+// edge_render_interval iterations to drop edges hidden by the model itself
+  std::string model_edge_source = "depth";
+  float crease_angle = 30.0f;
+  int edge_render_interval = 5;
+
+// store the visible frames of each object in the scene directory and reuse them while the input poses stay the same
+  bool visibility_cache = true;
+// store the correspondences of every frame and pose in the scene directory, re-runs with the same poses skip their search
+  bool correspondence_cache = false;
+
+// localize the matched rgb edge points with sub-pixel accuracy on the image gradient along the search direction
+  bool subpixel_edges = false;
+// weight correspondences by their gradient strength and the agreement of model and image edge directions
+  bool weighted_correspondences = false;
+
+// weight of the point-to-plane residuals between the rendered model and the measured depth relative to the edge residuals, 
+// 0 disables the depth term. The model is sampled every depth_sampling_step pixels of the rendered depth
+  float depth_weight = 0.0f;
+  int depth_sampling_step = 4;
+
+// "widget" renders with a hidden Qt window (needs a display), "headless" with an offscreen EGL context, 
+// "cpu" with the multi-threaded software rasterizer, without OpenGL and without serializing the renderer calls
+  std::string render_backend = "widget";
+// number of frames whose depth is rendered together in one batch (depth edges only), 1 renders every frame on its own
+  int render_batch_size = 8;
+// threads of a cpu render call, 0 uses all cores with a single worker and one thread per worker with several
+  int cpu_render_threads = 0;
+
+// write a json report with the iterations, convergence and stage timings of every object to refinement_reports in the scene directory
+  bool write_reports = false;
 };
 
 #endif
@@ -0,0 +1,41 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#ifndef REFINER_CORRESPONDENCE_CACHE_H
+#define REFINER_CORRESPONDENCE_CACHE_H
+
+#include "correspondence_finder.h"
+#include "configuration.h"
+#include <Eigen/Core>
+#include <cstdint>
+#include <string>
+
+// On-disk cache of per-frame correspondences, one binary file per model, frame, pyramid level and iteration, which
+// every run overwrites, so the cache does not grow across runs. The file holds a fixed header with the key of the pose
+// followed by the flat arrays of Correspondence, so it can be read (or memory mapped) without parsing; re-runs reaching
+// the same pose in an iteration reuse it. Settings affecting the correspondences are part of the key.
+class CorrespondenceCache
+{
+public:
+	CorrespondenceCache(const std::string &cache_dir, const Configuration &configuration);
+
+	bool load(int model_id, size_t frame_id, int pyramid_level, int iteration, const Eigen::Matrix4d &world_to_camera,
+	          float scale, Correspondence &correspondence) const;
+	void store(int model_id, size_t frame_id, int pyramid_level, int iteration, const Eigen::Matrix4d &world_to_camera,
+	           float scale, const Correspondence &correspondence) const;
+
+private:
+	uint64_t get_key(const Eigen::Matrix4d &world_to_camera, float scale) const;
+	std::string get_cache_file(int model_id, size_t frame_id, int pyramid_level, int iteration) const;
+
+	std::string cache_dir;
+	uint64_t configuration_hash;
+};
+
+#endif
@@ -24,6 +24,9 @@ struct Correspondence
 	std::vector<size_t> rgb_edges_ids;
 	std::vector<Eigen::Vector2f> rgb_edge_normals;
 
+	// per correspondence weights in [0, 1], all correspondences weigh 1 if empty
+	std::vector<float> weights;
+
 	Eigen::Vector2f get_rgb_normal(size_t id) const {
 	 size_t edge_id = rgb_edges_ids[id];
       return rgb_edge_normals[edge_id];
@@ -33,19 +36,67 @@ struct Correspondence
 	{
 		return corresponding_points.size();
 	}
+
+	float get_weight(size_t id) const
+	{
+		return weights.empty() ? 1.0f : weights[id];
+	}
+};
+
+// Points of the rendered model associated with the measured depth at the same pixel, for point-to-plane residuals
+struct DepthCorrespondence
+{
+	// model coordinates
+	std::vector<Eigen::Vector3f> model_points;
+	// camera coordinates, normals point towards the camera
+	std::vector<Eigen::Vector3f> measured_points;
+	std::vector<Eigen::Vector3f> measured_normals;
+
+	size_t get_number_of_correspondences() const
+	{
+		return model_points.size();
+	}
 };
 
 class CorrespondenceFinder
 {
 public:
 	CorrespondenceFinder(const Configuration &configuration);
-	void find_correspondences(const cv::Mat& depth_img, const cv::Mat& edge_id_img, const Eigen::Matrix4d &to_world_transformation_m, const std::vector<Eigen::Vector4f> &edges, Correspondence &correspondence);
+	void find_correspondences(const cv::Mat& depth_img, const cv::Mat& edge_id_img, const Eigen::Matrix4d &to_world_transformation_m, const std::vector<Eigen::Vector4f> &edges, Correspondence &correspondence,
+		const cv::Mat& occlusion_mask = cv::Mat(), const cv::Mat& gradient_magnitude = cv::Mat());
+
+	// Samples the projected 3D model edges (pairs of points in model coordinates) instead of depth edges, no back-projection needed. 
+	// visibility_depth is a rendered depth crop starting at visibility_offset, used to drop points hidden by the model itself.
+	void find_mesh_edge_correspondences(const cv::Mat& visibility_depth, const cv::Point& visibility_offset, const cv::Mat& edge_id_img,
+		const Eigen::Matrix4d &world_to_camera, const std::vector<Eigen::Vector3f> &edge_points, Correspondence &correspondence,
+		const cv::Mat& gradient_magnitude = cv::Mat());
+
+	// Projective data association of the rendered depth, a crop starting at rendered_offset, 
+	// with the full measured depth (CV_32FC1, meters) of the same resolution
+	void find_depth_correspondences(const cv::Mat& rendered_depth, const cv::Point& rendered_offset, const cv::Mat& measured_depth,
+		const Eigen::Matrix4d &to_world_transformation_m, DepthCorrespondence &depth_correspondence) const;
 private:
 	bool match_closest(const cv::Mat &edge_id_img, const Eigen::Vector4f &perpendicular_direction, float pi, float pj, Correspondence &correspondence);
 
+	// Moves the last match to the gradient maximum along the search direction and records its gradient strength
+	void refine_last_match(const cv::Mat &gradient_magnitude, const Eigen::Vector4f &perpendicular_direction, 
+		Correspondence &correspondence, std::vector<float> &match_strengths) const;
+
+	void add_match_quality(const cv::Mat &gradient_magnitude, const Eigen::Vector4f &perpendicular_direction, 
+		Correspondence &correspondence, std::vector<float> &match_strengths, std::vector<float> &normal_agreements) const;
+
+	// Weights of the matches from first_match on, gradient strength relative to the median times normal agreement
+	void compute_weights(size_t first_match, const std::vector<float> &match_strengths, 
+		const std::vector<float> &normal_agreements, Correspondence &correspondence) const;
+
 	Eigen::Matrix3d intrinsics;
 	int edge_search_span;
 	int point_sampling_step;
+	float visibility_tolerance;
+	int depth_sampling_step;
+	float depth_association_distance;
+	bool subpixel_edges;
+	bool weighted_correspondences;
 };
 
 #endif
\ No newline at end of file
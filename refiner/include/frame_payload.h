@@ -18,6 +18,23 @@ struct FramePayload
 {
 	Eigen::Matrix4d scene_pose;
 	Correspondence correspondence;
+	DepthCorrespondence depth_correspondence;
+};
+
+// Frame data shared by all objects refined jointly in a scene, prepared at the first rendering of the frame.
+// Only the region covering the visible objects is kept, the images are cropped to it.
+struct SceneFrame
+{
+	size_t frame_id;
+	Eigen::Matrix4d scene_pose;
+
+	// empty until the frame is prepared
+	cv::Rect scene_box;
+	cv::Mat gradient_magnitude;
+	// measured depth in meters, only loaded with the depth term
+	cv::Mat measured_depth;
+	std::vector<Eigen::Vector4f> rgb_edges;
+	std::vector<Eigen::Vector2f> rgb_edge_normals;
 };
 
 #endif
\ No newline at end of file
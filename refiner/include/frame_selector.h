@@ -0,0 +1,24 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#ifndef REFINER_FRAME_SELECTOR_H
+#define REFINER_FRAME_SELECTOR_H
+
+#include <vector>
+#include <Eigen/Core>
+
+// Selects up to max_frames indices of camera poses with viewing directions towards object_center spread 
+// as far apart as possible (angular farthest point sampling starting from seed_idx). Returned indices are sorted.
+std::vector<size_t> select_diverse_frames(const std::vector<Eigen::Matrix4d> &camera_poses, const Eigen::Vector3d &object_center,
+                                          size_t max_frames, size_t seed_idx = 0);
+
+// Seed for a subset rotated by iteration, consecutive iterations start from distant frames of the sequence
+size_t get_rotated_seed(int iteration, size_t number_of_frames);
+
+#endif
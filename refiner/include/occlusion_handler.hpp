@@ -14,24 +14,37 @@
 #include <Eigen/Dense>
 #include "configuration.h"
 #include <opencv2/core/core.hpp>
+#include <map>
 
 
 class OcclusionHandler {
 
 public:
 
+  // cache_file stores the visible frames of a run and is reused while the poses and thresholds stay the same, empty disables caching
   OcclusionHandler(Configuration configuration,
-      std::vector<RgbdFile> rgbd_image_files, std::vector<Eigen::Matrix4d> camera_poses);
+      std::vector<RgbdFile> rgbd_image_files, std::vector<Eigen::Matrix4d> camera_poses, std::string cache_file = "");
 
-  std::vector<size_t> get_frame_ids_with_visible_model(int model_id, const Eigen::Matrix4d &model_pose);
+  // Ids of the frames in which each model is visible. Every model is rendered on its own inside its projected bounding
+  // box, so pixels hidden by the other objects count as occluded like those hidden by the rest of the scene.
+  std::map<int, std::vector<size_t>> get_frame_ids_with_visible_models(const std::map<int, Eigen::Matrix4d> &model_poses);
 
 private:
 
-  bool is_object_visible(const cv::Mat& gt_depth, const cv::Mat& rendered_depth);
+  std::map<int, std::vector<size_t>> compute_frame_ids_with_visible_models(const std::map<int, Eigen::Matrix4d> &model_poses);
+
+  bool is_object_visible(const cv::Mat& gt_depth, const cv::Mat& rendered_depth, const cv::Mat& object_mask);
+
+  // Image region covered by the projected corners of the bounding box, the whole image if a corner is behind the camera
+  cv::Rect get_projected_box(const Eigen::Matrix<double, 3, 8>& corners, const Eigen::Matrix4d& world_to_camera,
+      int width, int height) const;
+
+  std::string get_cache_key(const std::map<int, Eigen::Matrix4d> &model_poses) const;
 
   Configuration configuration;
   std::vector<RgbdFile> rgbd_image_files;
   std::vector<Eigen::Matrix4d> camera_poses;
+  std::string cache_file;
 
   float object_visibility_threshold;
   float occlusion_threshold;
@@ -14,5 +14,7 @@
 #include <Eigen/Core>
 #include "frame_payload.h"
 
-Eigen::Matrix4d optimize_model_pose(const std::vector<FramePayload> &frame_payloads, const Eigen::Matrix4d &model_pose, const Eigen::Matrix3d &intrinsics, double residuals_std_dev);
+// depth_weight scales the point-to-plane residuals of the payload depth correspondences relative to the edge residuals
+Eigen::Matrix4d optimize_model_pose(const std::vector<FramePayload> &frame_payloads, const Eigen::Matrix4d &model_pose, const Eigen::Matrix3d &intrinsics, double residuals_std_dev,
+	double depth_weight = 0.0);
 #endif
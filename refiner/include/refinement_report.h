@@ -0,0 +1,78 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#ifndef REFINER_REFINEMENT_REPORT_H
+#define REFINER_REFINEMENT_REPORT_H
+
+#include <Eigen/Core>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Seconds spent in each stage of the refinement of one object
+struct StageTimings
+{
+	double loading = 0.0;
+	// shared by all objects of a scene, computed once for all of them
+	double visibility = 0.0;
+	double rendering = 0.0;
+	double edge_extraction = 0.0;
+	double correspondence = 0.0;
+	double solve = 0.0;
+	double total = 0.0;
+};
+
+struct IterationReport
+{
+	int pyramid_level = 0;
+	int iteration = 0;
+	size_t frames = 0;
+	size_t correspondences = 0;
+	size_t depth_correspondences = 0;
+	double residual_std_dev = 0.0;
+	// pose change applied by the iteration, degrees and meters, 0 if the iteration stopped before solving
+	double rotation_update = 0.0;
+	double translation_update = 0.0;
+};
+
+struct ModelReport
+{
+	int model_id = -1;
+	size_t visible_frames = 0;
+	size_t used_frames = 0;
+	bool converged = false;
+	// "inliers", "small_update", "max_iterations", "no_frames" or "no_correspondences"
+	std::string stop_reason = "max_iterations";
+
+	Eigen::Matrix4d initial_pose = Eigen::Matrix4d::Identity();
+	Eigen::Matrix4d refined_pose = Eigen::Matrix4d::Identity();
+
+	std::vector<IterationReport> iterations;
+	StageTimings timings;
+};
+
+// Adds the seconds spent in its scope to the given stage total
+class ScopedStageTimer
+{
+public:
+	explicit ScopedStageTimer(double &stage_seconds) : stage_seconds(stage_seconds), start(std::chrono::steady_clock::now()) {}
+
+	~ScopedStageTimer() {
+		stage_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+private:
+	double &stage_seconds;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Writes the report to refinement_reports/<model id>.json in the scene directory
+void store_model_report(const ModelReport &report, const std::string &scene_dir);
+
+#endif
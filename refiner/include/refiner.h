@@ -15,6 +15,12 @@
 #include <opencv/cv.hpp>
 #include "configuration.h"
 #include "frame_payload.h"
+#include "rendering_helper.h"
+#include "correspondence_cache.h"
+#include "refinement_report.h"
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include "refiner_interface.h"
 using json = nlohmann::json;
@@ -24,11 +30,44 @@ class Refiner
 public:
 	Refiner(const Configuration &p_configuration);
 	std::map<int, Eigen::Matrix4d> refine_model_poses(const RefinementInput& input);
+	std::map<int, Eigen::Matrix4d> refine_scene_poses(const RefinementInput& input);
+
+	// Building blocks of refine_model_poses, to schedule the objects of a scene separately
+	std::map<int, std::vector<size_t>> get_visible_frame_ids(const RefinementInput& input);
+	Eigen::Matrix4d refine_single_model_pose(const RefinementInput& input, int model_id, const std::vector<size_t>& visible_frame_ids);
+
+	// Called with the final pose of every object as soon as its refinement is done, e.g. to store results incrementally
+	void set_model_refined_callback(std::function<void(int, const Eigen::Matrix4d&)> callback) {
+		model_refined_callback = std::move(callback);
+	}
 
 private:
-  Eigen::Matrix4d refine_model_pose(const std::vector<Eigen::Matrix4d> &camera_poses, const std::vector<cv::Mat> &grayscale_images,
-                    const Eigen::Matrix4d &model_pose, int model_id);
+  std::map<int, Eigen::Matrix4d> refine_scene_poses_jointly(const RefinementInput& input);
+
+  Eigen::Matrix4d refine_model_pose(const std::vector<Eigen::Matrix4d> &camera_poses, const std::vector<size_t> &frame_ids,
+                    const std::vector<cv::Mat> &grayscale_images, const std::vector<cv::Mat> &depth_images,
+                    const Eigen::Matrix4d &model_pose, int model_id, ModelReport &report);
+
+  Eigen::Matrix4d refine_model_pose_at_scale(const std::vector<Eigen::Matrix4d> &camera_poses, const std::vector<size_t> &frame_ids,
+                    const std::vector<cv::Mat> &grayscale_images, const std::vector<cv::Mat> &depth_images,
+                    const Eigen::Matrix4d &model_pose, int model_id, RenderingHelper &rendering_helper,
+                    float scale, int number_of_iterations, ModelReport &report);
+
+  void prepare_scene_frame(SceneFrame &scene_frame, const RefinementInput& input, const cv::Mat &depth_img,
+                    const cv::Mat &object_ids, const std::vector<bool> &visible_models, StageTimings &timings);
+
+  void store_scene_reports(const RefinementInput& input, std::vector<ModelReport> &reports, const std::vector<Eigen::Matrix4d> &model_poses,
+                    const StageTimings &scene_timings, std::chrono::steady_clock::time_point start_time) const;
+
+  std::string get_visibility_cache_file(const RefinementInput& input) const;
+
+  std::vector<size_t> select_fixed_frame_subset(const std::vector<size_t> &frame_ids, const RefinementInput& input,
+                    const Eigen::Matrix4d &model_pose) const;
 
   Configuration configuration;
+  std::unique_ptr<CorrespondenceCache> correspondence_cache;
+  std::function<void(int, const Eigen::Matrix4d&)> model_refined_callback;
+  // seconds of the last get_visible_frame_ids call, 0 if the visible frames were computed by another refiner
+  double visibility_seconds = 0.0;
 };
 #endif
\ No newline at end of file
@@ -35,6 +35,8 @@ struct RefinementInput
   std::map<int, Eigen::Matrix4d> model_poses;
   std::vector<RgbdFile> rgbd_image_files;
   std::vector<Eigen::Matrix4d> camera_poses;
+  // scene directory, holds caches of intermediate results if set
+  std::string scene_dir;
 };
 
 
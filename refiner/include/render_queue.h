@@ -0,0 +1,45 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#ifndef REFINER_RENDER_QUEUE_H
+#define REFINER_RENDER_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+// The GL context of the renderer belongs to one thread. While a thread serves the queue, renderer calls 
+// from other threads are executed there and the callers wait for the result, otherwise they run in place.
+class RenderQueue
+{
+public:
+	static RenderQueue& instance();
+
+	void execute(const std::function<void()> &task);
+
+	// Makes the calling thread the one executing the tasks, to be called before the other threads start rendering
+	void open();
+	// Executes queued tasks on the opening thread until stop() is called
+	void serve();
+	void stop();
+
+private:
+	std::mutex queue_mutex;
+	std::condition_variable queue_condition;
+	std::deque<std::packaged_task<void()>> tasks;
+
+	bool is_served = false;
+	bool is_stopped = false;
+	std::thread::id server_id;
+};
+
+#endif
@@ -12,6 +12,7 @@
 #include <Eigen/Core>
 #include <iostream>
 #include <memory>
+#include <vector>
 
 #ifdef _WIN32
 
@@ -25,6 +26,16 @@
 
 #endif
 
+// OpenGL context of the renderers: a hidden Qt widget, which needs a display, or a headless offscreen context (EGL).
+// The backend is chosen by the first renderer of a process and shared by all later ones.
+// The cpu backend rasterizes in software and does not use the painter at all.
+enum RenderBackend
+{
+	RENDER_BACKEND_WIDGET = 0,
+	RENDER_BACKEND_HEADLESS = 1,
+	RENDER_BACKEND_CPU = 2
+};
+
 struct RendererConfiguration
 {
 	int width;
@@ -36,16 +47,79 @@ struct RendererConfiguration
 	float z_far;
 
 	std::string model_file;
+	RenderBackend backend = RENDER_BACKEND_WIDGET;
+	// threads of a cpu backend render call, 0 for all cores; 1 if the callers already render in parallel
+	int cpu_threads = 0;
+};
+
+// Buffers read back by a render call
+enum RenderBuffers
+{
+	RENDER_DEPTH = 1,
+	RENDER_COLOR = 2
 };
 
 class RendererInterface {
 
 public:
+	virtual ~RendererInterface() = default;
+
 	virtual void render(Eigen::Matrix4f &pose_matrix, cv::Mat &depth, cv::Mat &color) = 0;
+
+	// Renders with the intrinsics scaled by scale (0 < scale <= 1) into an image of 
+	// the correspondingly reduced size, e.g. for coarse levels of an image pyramid.
+	virtual void render(Eigen::Matrix4f &pose_matrix, float scale, cv::Mat &depth, cv::Mat &color) = 0;
+
+	// Endpoints of the silhouette and crease edges of the model (pairs of points in model coordinates)
+	// for the pose, computed from the mesh without rendering. Edges hidden by other parts of the model are included.
+	virtual void get_model_edges(Eigen::Matrix4f &pose_matrix, float crease_angle, std::vector<Eigen::Vector3f> &edge_points) = 0;
+
+	// Reads back only the requested buffers (RenderBuffers flags) and only the roi in pixels of the scaled image,
+	// an empty roi covers the whole image. Mats already of the roi size and type, e.g. buffers reused across frames 
+	// or views into larger images, are written in place without allocations.
+	virtual void render(Eigen::Matrix4f &pose_matrix, float scale, int buffers, const cv::Rect &roi, cv::Mat &depth, cv::Mat &color) = 0;
+
+	// Renders the depth of many poses at once, tiled into one framebuffer and read back asynchronously. 
+	// depths gets one image per pose, images of the right size are reused.
+	virtual void render_batch(std::vector<Eigen::Matrix4f> &pose_matrices, float scale, std::vector<cv::Mat> &depths) = 0;
+
+	// Axis aligned bounding box of the model in model coordinates, e.g. to cull poses outside the image before rendering
+	virtual void get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max) = 0;
+
+	// Vertices of the convex hull of the model in model coordinates, their projections bound the model in any image
+	virtual void get_model_hull_vertices(std::vector<Eigen::Vector3f> &hull_vertices) = 0;
 };
 
 typedef RendererInterface* RendererInterfaceHandle;
 
+struct SceneRendererConfiguration
+{
+	int width;
+	int height;
+
+	Eigen::Matrix3f intrinsics;
+
+	float z_near;
+	float z_far;
+
+	std::vector<std::string> model_files;
+	RenderBackend backend = RENDER_BACKEND_WIDGET;
+	// threads of a cpu backend render call, 0 for all cores; 1 if the callers already render in parallel
+	int cpu_threads = 0;
+};
+
+class SceneRendererInterface {
+
+public:
+	virtual ~SceneRendererInterface() = default;
+
+	// Renders all models in a single pass, one pose per model file. Object ids (CV_16UC1) hold
+	// the index of the closest model + 1 for every pixel and 0 for the background.
+	virtual void render(std::vector<Eigen::Matrix4f> &pose_matrices, cv::Mat &depth, cv::Mat &object_ids) = 0;
+};
+
+typedef SceneRendererInterface* SceneRendererInterfaceHandle;
+
 #ifdef _WIN32
 
 #ifdef __cplusplus
@@ -56,9 +130,21 @@ typedef RendererInterface* RendererInterfaceHandle;
 
 #endif
 
+// Creates the OpenGL application and contexts shared by all renderers of the backend. Qt needs them on the main thread:
+// call it there before renderers are created on other threads.
+#ifdef _WIN32
+EXTERN_C RendererAPI
+#endif
+void initialize_rendering(RenderBackend backend);
+
 #ifdef _WIN32
 EXTERN_C RendererAPI
 #endif
 RendererInterfaceHandle get_depth_renderer(RendererConfiguration &configuration);
 
+#ifdef _WIN32
+EXTERN_C RendererAPI
+#endif
+SceneRendererInterfaceHandle get_scene_renderer(SceneRendererConfiguration &configuration);
+
 #endif
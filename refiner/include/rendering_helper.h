@@ -13,16 +13,45 @@
 #include "renderer.h"
 #include <Eigen/Dense>
 
+RenderBackend get_render_backend(const Configuration &configuration);
+
+// Path of the reference model of model_id
+std::string get_model_file(const std::string &reference_models_dir, int model_id);
+
 class RenderingHelper
 {
   public:
 	  RenderingHelper(const Configuration &configuration, int model_id, int width, int height);
 
-	  void render(const Eigen::Matrix4d& world_to_camera, cv::Mat &depth, cv::Mat &color);
+	  void render(const Eigen::Matrix4d& world_to_camera, cv::Mat &depth, cv::Mat &color, float scale = 1.0f);
+
+	  // Reads back only the depth of the roi (whole image if empty), into depth in place if it already has the roi size
+	  void render_depth(const Eigen::Matrix4d& world_to_camera, cv::Mat &depth, float scale = 1.0f, const cv::Rect &roi = cv::Rect());
+
+	  // Depth of all poses rendered in one batch, depths of the right size are reused
+	  void render_depth_batch(const std::vector<Eigen::Matrix4d>& world_to_camera_poses, std::vector<cv::Mat> &depths, float scale = 1.0f);
+
+	  void get_model_edges(const Eigen::Matrix4d& world_to_camera, float crease_angle, std::vector<Eigen::Vector3f> &edge_points);
+
+	  // Axis aligned bounding box of the model in model coordinates
+	  void get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max);
 
   private:
 	  void initialize_depth_renderer(const Configuration &configuration, int model_id, int width, int height);
+	  RenderBackend backend;
 	  std::shared_ptr<RendererInterface> renderer;
 };
 
+class SceneRenderingHelper
+{
+  public:
+	  SceneRenderingHelper(const Configuration &configuration, const std::vector<int> &model_ids, int width, int height);
+
+	  void render(const std::vector<Eigen::Matrix4d>& world_to_camera_poses, cv::Mat &depth, cv::Mat &object_ids);
+
+  private:
+	  RenderBackend backend;
+	  std::shared_ptr<SceneRendererInterface> renderer;
+};
+
 #endif
\ No newline at end of file
@@ -15,31 +15,36 @@
 #include <string>
 #include <fstream>
 #include <iterator>
+#include <vector>
+#include <algorithm>
 #include <Eigen/Core>
 #include <Eigen/Dense>
+#include <cstdint>
 
+// Median by selection in O(n), the values are reordered in place
 template<typename T>
-Eigen::Matrix<T, Eigen::Dynamic, 1> operator-(const Eigen::Matrix<T, Eigen::Dynamic, 1> &vec, T s)
-{
-  return vec - s * Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>::Ones(vec.rows(), vec.cols());
+T select_median(std::vector<T> &values) {
+  const size_t len = values.size();
+  auto middle = values.begin() + len / 2;
+  std::nth_element(values.begin(), middle, values.end());
+
+  if (len % 2 != 0) {
+    return *middle;
+  }
+
+  // the lower half precedes the middle element after the selection
+  T lower = *std::max_element(values.begin(), middle);
+  return (lower + *middle) / static_cast<T>(2);
 }
 
+// Median absolute deviation, the values are overwritten with the absolute deviations
 template<typename T>
-T get_median(const Eigen::Matrix<T, Eigen::Dynamic, 1> &v) {
-  Eigen::Matrix<T, Eigen::Dynamic, 1> copy = v;
-  const int len = copy.derived().size();
-
-  if (len % 2 == 0) {
-    std::nth_element(copy.data(), copy.data() + len / 2 - 1, copy.data() + len);
-    T n1 = copy(len / 2 - 1);
-    std::nth_element(copy.data(), copy.data() + len / 2, copy.data() + len);
-    T n2 = copy(len / 2);
-    return (n1 + n2) / static_cast<T>(2);
-
-  } else {
-    std::nth_element( copy.data(), copy.data() + len / 2, copy.data() + len);
-    return copy(len / 2 );
+T select_median_absolute_deviation(std::vector<T> &values) {
+  const T median = select_median(values);
+  for (T &value : values) {
+    value = std::abs(value - median);
   }
+  return select_median(values);
 }
 
 
@@ -81,6 +86,21 @@ inline Eigen::Matrix4d create_transformation(const Eigen::Matrix3d &rotation_mat
   return transformation;
 }
 
+// Intrinsics for an image resized by scale, e.g. a level of an image pyramid
+template<typename T>
+inline Eigen::Matrix<T, 3, 3> scale_intrinsics(const Eigen::Matrix<T, 3, 3> &intrinsics, T scale) {
+  Eigen::Matrix<T, 3, 3> scaled_intrinsics = intrinsics;
+  scaled_intrinsics.template block<2, 3>(0, 0) *= scale;
+  return scaled_intrinsics;
+}
+
+// Rotation angle in degrees and translation distance between two poses
+inline void get_pose_difference(const Eigen::Matrix4d &pose_1, const Eigen::Matrix4d &pose_2, double &rotation_angle, double &translation) {
+  const Eigen::Matrix3d relative_rotation = pose_1.block<3, 3>(0, 0).transpose() * pose_2.block<3, 3>(0, 0);
+  rotation_angle = Eigen::AngleAxisd(relative_rotation).angle() * 180.0 / EIGEN_PI;
+  translation = (pose_1.block<3, 1>(0, 3) - pose_2.block<3, 1>(0, 3)).norm();
+}
+
 inline Eigen::Vector2f get_edge_normal(const Eigen::Vector4f &line_endpoints) {
   float v_x = line_endpoints[0] - line_endpoints[2];
   float v_y = line_endpoints[1] - line_endpoints[3];
@@ -97,5 +117,15 @@ inline Eigen::Vector2f get_edge_normal(const Eigen::Vector4f &line_endpoints) {
   return {nv_x, nv_y};
 }
 
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+// FNV-1a over the raw bytes, unlike std::hash stable between runs, e.g. for keys of on-disk caches
+inline void hash_bytes(uint64_t &hash, const void *data, size_t size) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+}
 
 #endif //EDGE_ALIGNMENT_UTIL_H
\ No newline at end of file
@@ -0,0 +1,151 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#include "batch_refiner.h"
+#include "refiner.h"
+#include "render_queue.h"
+#include "rendering_helper.h"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+
+using namespace Eigen;
+using namespace std;
+
+
+inline double get_seconds()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+BatchRefiner::BatchRefiner(const Configuration& configuration, int number_of_workers) :
+	configuration(configuration), number_of_workers(max(1, number_of_workers))
+{
+	// the workers already keep the cores busy
+	if (this->number_of_workers > 1 && configuration.get_cpu_render_threads() == 0)
+	{
+		this->configuration.set_cpu_render_threads(1);
+	}
+}
+
+void BatchRefiner::add_scene(const RefinementInput& input)
+{
+	const size_t scene_idx = scenes.size();
+
+	auto scene = make_unique<Scene>();
+	scene->input = input;
+	scenes.push_back(move(scene));
+
+	if (configuration.get_joint_refinement())
+	{
+		jobs.push_back({scene_idx, -1});
+		return;
+	}
+
+	for (const auto& model_pose : input.model_poses)
+	{
+		jobs.push_back({scene_idx, model_pose.first});
+	}
+}
+
+void BatchRefiner::run(const function<void(const string&, int, const Matrix4d&)>& on_model_refined)
+{
+	model_refined_callback = on_model_refined;
+	start_time = get_seconds();
+
+	cout << "Refining " << jobs.size() << " jobs of " << scenes.size() << " scenes with " << number_of_workers << " workers" << endl;
+
+	atomic<int> running_workers(number_of_workers);
+	vector<thread> workers;
+
+	// the application and the shared contexts belong to this thread, the workers only create their own contexts
+	initialize_rendering(get_render_backend(configuration));
+	RenderQueue::instance().open();
+
+	for (int i = 0; i < number_of_workers; ++i)
+	{
+		workers.emplace_back([this, &running_workers]()
+		{
+			run_worker();
+			if (--running_workers == 0) RenderQueue::instance().stop();
+		});
+	}
+
+	// widget rendering of all workers happens here, on the gui thread owning the contexts
+	RenderQueue::instance().serve();
+
+	for (auto& worker : workers) worker.join();
+}
+
+void BatchRefiner::run_worker()
+{
+	while (true)
+	{
+		Job job;
+		{
+			lock_guard<mutex> lock(jobs_mutex);
+			if (next_job == jobs.size()) return;
+			job = jobs[next_job++];
+		}
+
+		const double job_start = get_seconds();
+
+		try
+		{
+			run_job(job);
+		}
+		catch (const exception& e)
+		{
+			cerr << "Refinement failed for scene " << scenes[job.scene_idx]->input.scene_dir << ": " << e.what() << endl;
+		}
+
+		report_progress(job, get_seconds() - job_start);
+	}
+}
+
+void BatchRefiner::run_job(const Job& job)
+{
+	Scene& scene = *scenes[job.scene_idx];
+	const string& scene_dir = scene.input.scene_dir;
+
+	Refiner refiner(configuration);
+	refiner.set_model_refined_callback([this, &scene_dir](int model_id, const Matrix4d& pose)
+	{
+		model_refined_callback(scene_dir, model_id, pose);
+	});
+
+	if (job.model_id < 0)
+	{
+		refiner.refine_scene_poses(scene.input);
+		return;
+	}
+
+	call_once(scene.visibility_flag, [&]() { scene.visible_frame_ids = refiner.get_visible_frame_ids(scene.input); });
+
+	const auto visible_frame_ids = scene.visible_frame_ids.find(job.model_id);
+	const Matrix4d refined_pose = refiner.refine_single_model_pose(scene.input, job.model_id, visible_frame_ids != scene.visible_frame_ids.end() ?
+	                                                               visible_frame_ids->second : vector<size_t>());
+	model_refined_callback(scene_dir, job.model_id, refined_pose);
+}
+
+void BatchRefiner::report_progress(const Job& job, double job_seconds)
+{
+	lock_guard<mutex> lock(jobs_mutex);
+
+	finished_jobs++;
+	refined_objects += job.model_id < 0 ? scenes[job.scene_idx]->input.model_poses.size() : 1;
+
+	const double elapsed_minutes = (get_seconds() - start_time) / 60.0;
+
+	cout << fixed << setprecision(1) << "[" << finished_jobs << "/" << jobs.size() << "] " << scenes[job.scene_idx]->input.scene_dir;
+	if (job.model_id >= 0) cout << " model #" << job.model_id;
+	cout << " done in " << job_seconds << " s, " << refined_objects / max(elapsed_minutes, 1e-6) << " objects/min" << endl;
+	cout << defaultfloat;
+}
@@ -88,5 +88,135 @@ bool parse_configuration(const std::string& config_file, Configuration& configur
 		configuration.set_z_far(config_json["z_far"].get<float>());
 	}
 
+	if (!config_json["joint_refinement"].is_null())
+	{
+		configuration.set_joint_refinement(config_json["joint_refinement"].get<bool>());
+	}
+
+	if (!config_json["pyramid_levels"].is_null())
+	{
+		configuration.set_pyramid_levels(max(1, config_json["pyramid_levels"].get<int>()));
+	}
+
+	if (!config_json["pyramid_level_iterations"].is_null())
+	{
+		configuration.set_pyramid_level_iterations(config_json["pyramid_level_iterations"].get<int>());
+	}
+
+	if (!config_json["min_rotation_update"].is_null())
+	{
+		configuration.set_min_rotation_update(config_json["min_rotation_update"].get<double>());
+	}
+
+	if (!config_json["min_translation_update"].is_null())
+	{
+		configuration.set_min_translation_update(config_json["min_translation_update"].get<double>());
+	}
+
+	if (!config_json["max_frames"].is_null())
+	{
+		configuration.set_max_frames(std::max(0, config_json["max_frames"].get<int>()));
+	}
+
+	if (!config_json["rotate_frame_subsets"].is_null())
+	{
+		configuration.set_rotate_frame_subsets(config_json["rotate_frame_subsets"].get<bool>());
+	}
+
+	if (!config_json["depth_edge_extractor"].is_null())
+	{
+		string depth_edge_extractor = config_json["depth_edge_extractor"].get<std::string>();
+		if (depth_edge_extractor != "lsd" && depth_edge_extractor != "gradient")
+		{
+			cerr << "Unknown depth_edge_extractor " << depth_edge_extractor << ", expected lsd or gradient" << endl;
+			return false;
+		}
+
+		configuration.set_depth_edge_extractor(depth_edge_extractor);
+	}
+
+	if (!config_json["depth_edge_threshold"].is_null())
+	{
+		configuration.set_depth_edge_threshold(config_json["depth_edge_threshold"].get<float>());
+	}
+
+	if (!config_json["model_edge_source"].is_null())
+	{
+		string model_edge_source = config_json["model_edge_source"].get<string>();
+		if (model_edge_source != "depth" && model_edge_source != "mesh")
+		{
+			cerr << "Unknown model_edge_source " << model_edge_source << ", expected depth or mesh" << endl;
+			return false;
+		}
+
+		configuration.set_model_edge_source(model_edge_source);
+	}
+
+	if (!config_json["crease_angle"].is_null())
+	{
+		configuration.set_crease_angle(config_json["crease_angle"].get<float>());
+	}
+
+	if (!config_json["edge_render_interval"].is_null())
+	{
+		configuration.set_edge_render_interval(std::max(1, config_json["edge_render_interval"].get<int>()));
+	}
+
+	if (!config_json["visibility_cache"].is_null())
+	{
+		configuration.set_visibility_cache(config_json["visibility_cache"].get<bool>());
+	}
+
+	if (!config_json["correspondence_cache"].is_null())
+	{
+		configuration.set_correspondence_cache(config_json["correspondence_cache"].get<bool>());
+	}
+
+	if (!config_json["subpixel_edges"].is_null())
+	{
+		configuration.set_subpixel_edges(config_json["subpixel_edges"].get<bool>());
+	}
+
+	if (!config_json["weighted_correspondences"].is_null())
+	{
+		configuration.set_weighted_correspondences(config_json["weighted_correspondences"].get<bool>());
+	}
+
+	if (!config_json["depth_weight"].is_null())
+	{
+		configuration.set_depth_weight(config_json["depth_weight"].get<float>());
+	}
+
+	if (!config_json["depth_sampling_step"].is_null())
+	{
+		configuration.set_depth_sampling_step(config_json["depth_sampling_step"].get<int>());
+	}
+
+	if (!config_json["render_backend"].is_null())
+	{
+		string render_backend = config_json["render_backend"].get<string>();
+		if (render_backend != "widget" && render_backend != "headless" && render_backend != "cpu")
+		{
+			cerr << "Invalid render_backend: " << render_backend << ", expected widget, headless or cpu" << endl;
+			return false;
+		}
+		configuration.set_render_backend(render_backend);
+	}
+
+	if (!config_json["render_batch_size"].is_null())
+	{
+		configuration.set_render_batch_size(config_json["render_batch_size"].get<int>());
+	}
+
+	if (!config_json["cpu_render_threads"].is_null())
+	{
+		configuration.set_cpu_render_threads(config_json["cpu_render_threads"].get<int>());
+	}
+
+	if (!config_json["write_reports"].is_null())
+	{
+		configuration.set_write_reports(config_json["write_reports"].get<bool>());
+	}
+
 	return true;
 }
@@ -0,0 +1,166 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#include "correspondence_cache.h"
+#include "util.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+using namespace Eigen;
+using namespace std;
+namespace fs = std::filesystem;
+
+const uint32_t CACHE_MAGIC = 0x32434352; // "RCC2"
+
+struct CacheHeader
+{
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t key;
+	uint64_t number_of_correspondences;
+	uint64_t number_of_perpendicular_lines;
+	uint64_t number_of_rgb_edge_normals;
+	uint64_t number_of_weights;
+};
+
+template <typename T>
+inline void hash_value(uint64_t& hash, const T& value)
+{
+	hash_bytes(hash, &value, sizeof(T));
+}
+
+inline void hash_string(uint64_t& hash, const string& value)
+{
+	hash_bytes(hash, value.data(), value.size());
+}
+
+CorrespondenceCache::CorrespondenceCache(const string& cache_dir, const Configuration& configuration) : cache_dir(cache_dir)
+{
+	configuration_hash = FNV_OFFSET_BASIS;
+
+	const Matrix3f intrinsics = configuration.get_intrinsics();
+	hash_bytes(configuration_hash, intrinsics.data(), sizeof(float) * 9);
+	hash_value(configuration_hash, configuration.get_model_padding_pixels());
+	hash_value(configuration_hash, configuration.get_edge_search_span());
+	hash_value(configuration_hash, configuration.get_point_sampling_step());
+	hash_string(configuration_hash, configuration.get_depth_edge_extractor());
+	hash_value(configuration_hash, configuration.get_depth_edge_threshold());
+	hash_string(configuration_hash, configuration.get_model_edge_source());
+	hash_value(configuration_hash, configuration.get_crease_angle());
+	hash_value(configuration_hash, configuration.get_edge_render_interval());
+	hash_value(configuration_hash, configuration.get_subpixel_edges());
+	hash_value(configuration_hash, configuration.get_weighted_correspondences());
+
+	fs::create_directories(cache_dir);
+}
+
+uint64_t CorrespondenceCache::get_key(const Matrix4d& world_to_camera, float scale) const
+{
+	uint64_t key = configuration_hash;
+	hash_bytes(key, world_to_camera.data(), sizeof(double) * 16);
+	hash_value(key, scale);
+	return key;
+}
+
+string CorrespondenceCache::get_cache_file(int model_id, size_t frame_id, int pyramid_level, int iteration) const
+{
+	stringstream filename_ss;
+	filename_ss << "obj_" << setfill('0') << setw(6) << model_id << "_frame_" << setw(6) << frame_id
+		<< "_level_" << pyramid_level << "_iteration_" << setw(3) << iteration << ".bin";
+
+	return (fs::path(cache_dir) / filename_ss.str()).string();
+}
+
+template <typename T>
+inline void write_array(ofstream& out, const vector<T>& values)
+{
+	out.write(reinterpret_cast<const char*>(values.data()), static_cast<streamsize>(sizeof(T) * values.size()));
+}
+
+template <typename T>
+inline bool read_array(ifstream& in, vector<T>& values, uint64_t size)
+{
+	values.resize(size);
+	in.read(reinterpret_cast<char*>(values.data()), static_cast<streamsize>(sizeof(T) * size));
+	return static_cast<bool>(in);
+}
+
+bool CorrespondenceCache::load(int model_id, size_t frame_id, int pyramid_level, int iteration, const Matrix4d& world_to_camera,
+                               float scale, Correspondence& correspondence) const
+{
+	const uint64_t key = get_key(world_to_camera, scale);
+	const string cache_file = get_cache_file(model_id, frame_id, pyramid_level, iteration);
+
+	ifstream in(cache_file, ios::binary);
+	if (!in) return false;
+
+	CacheHeader header;
+	in.read(reinterpret_cast<char*>(&header), sizeof(header));
+	// stored for another pose or configuration, overwritten by the caller
+	if (!in || header.magic != CACHE_MAGIC || header.key != key) return false;
+
+	// rgb edge ids are stored as 64 bit to keep the layout independent of size_t
+	vector<uint64_t> rgb_edges_ids;
+
+	Correspondence cached;
+	const bool is_valid = read_array(in, cached.corresponding_points, header.number_of_correspondences) &&
+		read_array(in, cached.world_points, header.number_of_correspondences) &&
+		read_array(in, rgb_edges_ids, header.number_of_correspondences) &&
+		read_array(in, cached.perpendicular_lines, header.number_of_perpendicular_lines) &&
+		read_array(in, cached.rgb_edge_normals, header.number_of_rgb_edge_normals) &&
+		read_array(in, cached.weights, header.number_of_weights);
+
+	// truncated by an interrupted run
+	if (!is_valid) return false;
+
+	cached.rgb_edges_ids.assign(rgb_edges_ids.begin(), rgb_edges_ids.end());
+	correspondence = move(cached);
+	return true;
+}
+
+void CorrespondenceCache::store(int model_id, size_t frame_id, int pyramid_level, int iteration, const Matrix4d& world_to_camera,
+                                float scale, const Correspondence& correspondence) const
+{
+	const uint64_t key = get_key(world_to_camera, scale);
+	const string cache_file = get_cache_file(model_id, frame_id, pyramid_level, iteration);
+	const string temporary_file = cache_file + ".tmp";
+
+	CacheHeader header{};
+	header.magic = CACHE_MAGIC;
+	header.key = key;
+	header.number_of_correspondences = correspondence.get_number_of_correspondences();
+	header.number_of_perpendicular_lines = correspondence.perpendicular_lines.size();
+	header.number_of_rgb_edge_normals = correspondence.rgb_edge_normals.size();
+	header.number_of_weights = correspondence.weights.size();
+
+	vector<uint64_t> rgb_edges_ids(correspondence.rgb_edges_ids.begin(), correspondence.rgb_edges_ids.end());
+
+	{
+		ofstream out(temporary_file, ios::binary);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		write_array(out, correspondence.corresponding_points);
+		write_array(out, correspondence.world_points);
+		write_array(out, rgb_edges_ids);
+		write_array(out, correspondence.perpendicular_lines);
+		write_array(out, correspondence.rgb_edge_normals);
+		write_array(out, correspondence.weights);
+
+		if (!out)
+		{
+			cerr << "Failed to write correspondence cache " << cache_file << endl;
+			return;
+		}
+	}
+
+	// complete files only, a crash leaves at most a stale temporary file behind
+	error_code error;
+	fs::rename(temporary_file, cache_file, error);
+}
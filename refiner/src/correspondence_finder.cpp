@@ -10,6 +10,8 @@
 #include "correspondence_finder.h"
 #include <util.h>
 #include <cmath>
+#include <limits>
+#include <algorithm>
 
 using namespace Eigen;
 using namespace std;
@@ -22,6 +24,11 @@ CorrespondenceFinder::CorrespondenceFinder(const Configuration& configuration)
 	intrinsics = configuration.get_intrinsics().cast<double>();
 	edge_search_span = configuration.get_edge_search_span();
 	point_sampling_step = configuration.get_point_sampling_step();
+	visibility_tolerance = configuration.get_depth_edge_threshold();
+	depth_sampling_step = max(1, configuration.get_depth_sampling_step());
+	depth_association_distance = configuration.get_occlusion_threshold();
+	subpixel_edges = configuration.get_subpixel_edges();
+	weighted_correspondences = configuration.get_weighted_correspondences();
 }
 
 Vector4f get_perpendicular_direction(const Vector4f& line_endpoints)
@@ -105,6 +112,116 @@ float get_depth_in_the_neighborhood(const cv::Mat& depth_img, float x, float y)
 	return .0f;
 }
 
+inline bool is_masked(const cv::Mat& mask, float x, float y)
+{
+	int y_off = CAST_ROUND_INT(y);
+	int x_off = CAST_ROUND_INT(x);
+
+	return y_off < mask.rows && x_off < mask.cols && y_off >= 0 && x_off >= 0 && mask.at<uchar>(y_off, x_off) != 0;
+}
+
+// A point is hidden if the rendered surface around its pixel is closer by more than the tolerance,
+// points without rendered depth around (e.g. just outside the silhouette of an older pose) count as visible
+inline bool is_hidden(const cv::Mat& visibility_depth, const cv::Point& visibility_offset, float x, float y, double depth,
+                      float tolerance)
+{
+	float min_depth = numeric_limits<float>::max();
+
+	for (int i = -1; i <= 1; i++)
+	{
+		for (int j = -1; j <= 1; j++)
+		{
+			int y_off = CAST_ROUND_INT(y) + i - visibility_offset.y;
+			int x_off = CAST_ROUND_INT(x) + j - visibility_offset.x;
+
+			if (y_off < visibility_depth.rows && x_off < visibility_depth.cols && y_off >= 0 && x_off >= 0)
+			{
+				float val = visibility_depth.at<float>(y_off, x_off);
+				if (isfinite(val) && val > .0f) min_depth = min(min_depth, val);
+			}
+		}
+	}
+
+	return depth > static_cast<double>(min_depth) + tolerance;
+}
+
+inline float sample_bilinear(const cv::Mat& img, float x, float y)
+{
+	const int x0 = static_cast<int>(floor(x));
+	const int y0 = static_cast<int>(floor(y));
+
+	if (x0 < 0 || y0 < 0 || x0 + 1 >= img.cols || y0 + 1 >= img.rows) return 0.0f;
+
+	const float dx = x - static_cast<float>(x0);
+	const float dy = y - static_cast<float>(y0);
+
+	const float* row0 = img.ptr<float>(y0);
+	const float* row1 = img.ptr<float>(y0 + 1);
+
+	return (1 - dy) * ((1 - dx) * row0[x0] + dx * row0[x0 + 1]) + dy * ((1 - dx) * row1[x0] + dx * row1[x0 + 1]);
+}
+
+void CorrespondenceFinder::refine_last_match(const cv::Mat& gradient_magnitude, const Vector4f& perpendicular_direction,
+                                             Correspondence& correspondence, vector<float>& match_strengths) const
+{
+	Vector2f& point = correspondence.corresponding_points.back();
+	const Vector2f direction(perpendicular_direction[0], perpendicular_direction[1]);
+
+	const float g_minus = sample_bilinear(gradient_magnitude, point.x() - direction.x(), point.y() - direction.y());
+	const float g_center = sample_bilinear(gradient_magnitude, point.x(), point.y());
+	const float g_plus = sample_bilinear(gradient_magnitude, point.x() + direction.x(), point.y() + direction.y());
+
+	float strength = g_center;
+
+	// parabola through the three samples, only if the center is a local maximum
+	const float curvature = g_minus - 2.0f * g_center + g_plus;
+	if (subpixel_edges && curvature < 0.0f && g_center >= g_minus && g_center >= g_plus)
+	{
+		const float offset = max(-0.5f, min(0.5f, 0.5f * (g_minus - g_plus) / curvature));
+		point += offset * direction;
+		strength = g_center - 0.25f * (g_minus - g_plus) * offset;
+	}
+
+	match_strengths.push_back(strength);
+}
+
+void CorrespondenceFinder::add_match_quality(const cv::Mat& gradient_magnitude, const Vector4f& perpendicular_direction,
+                                             Correspondence& correspondence, vector<float>& match_strengths,
+                                             vector<float>& normal_agreements) const
+{
+	if (gradient_magnitude.empty())
+	{
+		match_strengths.push_back(1.0f);
+	}
+	else
+	{
+		refine_last_match(gradient_magnitude, perpendicular_direction, correspondence, match_strengths);
+	}
+
+	// model and image edges of a true match are parallel
+	const Vector2f& rgb_edge_normal = correspondence.get_rgb_normal(correspondence.get_number_of_correspondences() - 1);
+	normal_agreements.push_back(abs(rgb_edge_normal.dot(Vector2f(perpendicular_direction[0], perpendicular_direction[1]))));
+}
+
+void CorrespondenceFinder::compute_weights(size_t first_match, const vector<float>& match_strengths,
+                                           const vector<float>& normal_agreements, Correspondence& correspondence) const
+{
+	if (!weighted_correspondences) return;
+
+	// correspondences of earlier calls keep their weights
+	correspondence.weights.resize(first_match, 1.0f);
+	if (match_strengths.empty()) return;
+
+	vector<float> strengths = match_strengths;
+	const float median_strength = max(select_median(strengths), 1e-6f);
+
+	for (size_t i = 0; i < match_strengths.size(); ++i)
+	{
+		const float relative_strength = min(1.0f, match_strengths[i] / median_strength);
+		correspondence.weights.push_back(relative_strength * normal_agreements[i]);
+	}
+}
+
 bool CorrespondenceFinder::match_closest(const cv::Mat& edge_id_img, const Vector4f& perpendicular_direction, float pi, float pj,
                                           Correspondence& correspondence) {
 	for (int i = 1; i < edge_search_span; ++i)
@@ -139,11 +256,16 @@ bool CorrespondenceFinder::match_closest(const cv::Mat& edge_id_img, const Vecto
 
 void CorrespondenceFinder::find_correspondences(const cv::Mat& depth_img, const cv::Mat& edge_id_img,
                                                 const Matrix4d& to_world_transformation_m,
-                                                const vector<Vector4f>& edges, Correspondence& correspondence)
+                                                const vector<Vector4f>& edges, Correspondence& correspondence,
+                                                const cv::Mat& occlusion_mask, const cv::Mat& gradient_magnitude)
 {
 
 	Isometry3d to_world_transformation = to_isometry(to_world_transformation_m);
 
+	const size_t first_match = correspondence.get_number_of_correspondences();
+	vector<float> match_strengths;
+	vector<float> normal_agreements;
+
 	for (auto& line_endpoints : edges) {
 		Vector4f perpendicular_direction = get_perpendicular_direction(line_endpoints);
 		float line_length = get_line_length(line_endpoints);
@@ -159,6 +281,9 @@ void CorrespondenceFinder::find_correspondences(const cv::Mat& depth_img, const
 
 			if (!isfinite(depth) || abs(depth) < 1e-5) continue;
 
+			// edge point produced by another object in front of the model
+			if (!occlusion_mask.empty() && is_masked(occlusion_mask, pi, pj)) continue;
+
 			double xp = (pi - intrinsics(0, 2)) * depth / intrinsics(0, 0);
 			double yp = (pj - intrinsics(1, 2)) * depth / intrinsics(1, 1);
 
@@ -175,7 +300,147 @@ void CorrespondenceFinder::find_correspondences(const cv::Mat& depth_img, const
 			if (match_closest(edge_id_img, perpendicular_direction, pi, pj, correspondence))
 			{
 				correspondence.world_points.push_back(world_point.cast<float>());
+				add_match_quality(gradient_magnitude, perpendicular_direction, correspondence, match_strengths, normal_agreements);
+			}
+		}
+	}
+
+	compute_weights(first_match, match_strengths, normal_agreements, correspondence);
+}
+
+void CorrespondenceFinder::find_mesh_edge_correspondences(const cv::Mat& visibility_depth, const cv::Point& visibility_offset,
+                                                          const cv::Mat& edge_id_img, const Matrix4d& world_to_camera_m,
+                                                          const vector<Vector3f>& edge_points, Correspondence& correspondence,
+                                                          const cv::Mat& gradient_magnitude)
+{
+	Isometry3d world_to_camera = to_isometry(world_to_camera_m);
+
+	const size_t first_match = correspondence.get_number_of_correspondences();
+	vector<float> match_strengths;
+	vector<float> normal_agreements;
+
+	auto project = [this](const Vector3d& camera_point)
+	{
+		return Vector2d(intrinsics(0, 0) * camera_point.x() / camera_point.z() + intrinsics(0, 2),
+		                intrinsics(1, 1) * camera_point.y() / camera_point.z() + intrinsics(1, 2));
+	};
+
+	// mesh edges are often shorter than the sampling step, at most one sample is taken per cell of the step size
+	const int cell_size = max(1, point_sampling_step);
+	cv::Mat sampled_cells = cv::Mat::zeros(edge_id_img.rows / cell_size + 1, edge_id_img.cols / cell_size + 1, CV_8UC1);
+
+	for (size_t e = 0; e + 1 < edge_points.size(); e += 2)
+	{
+		const Vector3d start = edge_points[e].cast<double>();
+		const Vector3d end = edge_points[e + 1].cast<double>();
+
+		const Vector3d camera_start = world_to_camera * start;
+		const Vector3d camera_end = world_to_camera * end;
+
+		if (camera_start.z() <= 0 || camera_end.z() <= 0) continue;
+
+		const Vector2d pixel_start = project(camera_start);
+		const Vector2d pixel_end = project(camera_end);
+
+		const Vector4f line_endpoints(static_cast<float>(pixel_start.x()), static_cast<float>(pixel_start.y()),
+		                              static_cast<float>(pixel_end.x()), static_cast<float>(pixel_end.y()));
+		const float line_length = get_line_length(line_endpoints);
+		if (line_length < 1e-3f) continue;
+
+		Vector4f perpendicular_direction = get_perpendicular_direction(line_endpoints);
+		int num_of_edge_sample_points = max(1, static_cast<int>(line_length / static_cast<float>(point_sampling_step)));
+
+		for (int n = 0; n < num_of_edge_sample_points; ++n)
+		{
+			const double t = (static_cast<double>(n) + 0.5) / static_cast<double>(num_of_edge_sample_points);
+			const Vector3d world_point = start + t * (end - start);
+			const Vector3d camera_point = world_to_camera * world_point;
+			const Vector2d pixel = project(camera_point);
+
+			const float pi = static_cast<float>(pixel.x());
+			const float pj = static_cast<float>(pixel.y());
+
+			if (pi < 0 || pj < 0 || pi >= static_cast<float>(edge_id_img.cols) || pj >= static_cast<float>(edge_id_img.rows)) continue;
+
+			uchar& cell = sampled_cells.at<uchar>(static_cast<int>(pj) / cell_size, static_cast<int>(pi) / cell_size);
+			if (cell != 0) continue;
+
+			if (is_hidden(visibility_depth, visibility_offset, pi, pj, camera_point.z(), visibility_tolerance)) continue;
+
+			cell = 1;
+
+			float c_x = pi + perpendicular_direction[0] * static_cast<float>(edge_search_span);
+			float c_y = pj + perpendicular_direction[1] * static_cast<float>(edge_search_span);
+
+			float d_x = pi - perpendicular_direction[0] * static_cast<float>(edge_search_span);
+			float d_y = pj - perpendicular_direction[1] * static_cast<float>(edge_search_span);
+
+			correspondence.perpendicular_lines.push_back({c_x, c_y, d_x, d_y});
+
+			if (match_closest(edge_id_img, perpendicular_direction, pi, pj, correspondence))
+			{
+				correspondence.world_points.push_back(world_point.cast<float>());
+				add_match_quality(gradient_magnitude, perpendicular_direction, correspondence, match_strengths, normal_agreements);
 			}
 		}
 	}
+
+	compute_weights(first_match, match_strengths, normal_agreements, correspondence);
+}
+
+void CorrespondenceFinder::find_depth_correspondences(const cv::Mat& rendered_depth, const cv::Point& rendered_offset,
+                                                      const cv::Mat& measured_depth,
+                                                      const Matrix4d& to_world_transformation_m,
+                                                      DepthCorrespondence& depth_correspondence) const
+{
+	const Isometry3d to_world_transformation = to_isometry(to_world_transformation_m);
+
+	auto back_project = [this](int u, int v, float depth)
+	{
+		return Vector3d((u - intrinsics(0, 2)) * depth / intrinsics(0, 0), (v - intrinsics(1, 2)) * depth / intrinsics(1, 1), depth);
+	};
+
+	auto is_associated = [this](float depth, float reference_depth)
+	{
+		return depth > 1e-3f && abs(depth - reference_depth) < depth_association_distance;
+	};
+
+	// the normal is taken across half a sampling step, a single pixel is dominated by the sensor noise
+	const int normal_offset = max(1, depth_sampling_step / 2);
+
+	for (int crop_v = 0; crop_v + normal_offset < rendered_depth.rows; crop_v += depth_sampling_step)
+	{
+		for (int crop_u = 0; crop_u + normal_offset < rendered_depth.cols; crop_u += depth_sampling_step)
+		{
+			const int u = crop_u + rendered_offset.x;
+			const int v = crop_v + rendered_offset.y;
+
+			const float model_depth = rendered_depth.at<float>(crop_v, crop_u);
+			if (!isfinite(model_depth) || model_depth < 1e-5f) continue;
+
+			// occluded, missing or a different surface
+			const float depth = measured_depth.at<float>(v, u);
+			if (!is_associated(depth, model_depth)) continue;
+
+			const float right_depth = measured_depth.at<float>(v, u + normal_offset);
+			const float lower_depth = measured_depth.at<float>(v + normal_offset, u);
+			if (!is_associated(right_depth, depth) || !is_associated(lower_depth, depth)) continue;
+
+			const Vector3d measured_point = back_project(u, v, depth);
+			Vector3d normal = (back_project(u + normal_offset, v, right_depth) - measured_point)
+				.cross(back_project(u, v + normal_offset, lower_depth) - measured_point);
+
+			const double normal_length = normal.norm();
+			if (normal_length < 1e-12) continue;
+
+			normal /= normal_length;
+			if (normal.dot(measured_point) > 0) normal = -normal;
+
+			const Vector3d model_point = to_world_transformation * back_project(u, v, model_depth);
+
+			depth_correspondence.model_points.push_back(model_point.cast<float>());
+			depth_correspondence.measured_points.push_back(measured_point.cast<float>());
+			depth_correspondence.measured_normals.push_back(normal.cast<float>());
+		}
+	}
 }
@@ -0,0 +1,79 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#include "frame_selector.h"
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cmath>
+
+using namespace Eigen;
+using namespace std;
+
+
+vector<size_t> select_diverse_frames(const vector<Matrix4d>& camera_poses, const Vector3d& object_center,
+                                     size_t max_frames, size_t seed_idx)
+{
+	const size_t number_of_frames = camera_poses.size();
+
+	vector<size_t> selected(number_of_frames);
+	iota(selected.begin(), selected.end(), 0);
+
+	if (max_frames == 0 || max_frames >= number_of_frames)
+	{
+		return selected;
+	}
+
+	vector<Vector3d> view_directions(number_of_frames);
+	transform(camera_poses.begin(), camera_poses.end(), view_directions.begin(), [&object_center](const Matrix4d& pose)
+	{
+		Vector3d camera_center = pose.block<3, 1>(0, 3);
+		return Vector3d((camera_center - object_center).normalized());
+	});
+
+	selected.clear();
+
+	// angle between each frame and its closest selected frame
+	vector<double> min_angles(number_of_frames, numeric_limits<double>::max());
+	size_t next_idx = seed_idx % number_of_frames;
+
+	while (selected.size() < max_frames)
+	{
+		selected.push_back(next_idx);
+		min_angles[next_idx] = 0.0;
+
+		const Vector3d& selected_direction = view_directions[next_idx];
+		double max_angle = -1.0;
+
+		for (size_t i = 0; i < number_of_frames; ++i)
+		{
+			const double cos_angle = max(-1.0, min(1.0, view_directions[i].dot(selected_direction)));
+			min_angles[i] = min(min_angles[i], acos(cos_angle));
+
+			if (min_angles[i] > max_angle)
+			{
+				max_angle = min_angles[i];
+				next_idx = i;
+			}
+		}
+
+		// all remaining frames coincide with the selected ones
+		if (max_angle <= 0.0) break;
+	}
+
+	sort(selected.begin(), selected.end());
+	return selected;
+}
+
+size_t get_rotated_seed(int iteration, size_t number_of_frames)
+{
+	// golden ratio stride, the seeds do not repeat for a long time
+	const double stride = 0.6180339887 * static_cast<double>(number_of_frames);
+	return static_cast<size_t>(static_cast<double>(iteration) * stride) % max<size_t>(1, number_of_frames);
+}
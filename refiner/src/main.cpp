@@ -14,6 +14,7 @@
 #include <filesystem>
 #include "iomanip"
 #include <input_handler.h>
+#include "batch_refiner.h"
 
 using namespace Eigen;
 namespace fs = std::filesystem;
@@ -37,28 +38,126 @@ using namespace std;
         return EXIT_FAILURE;\
       }
 
-void store_refined_poses(const map<int, Matrix4d>& object_poses, const string& scene_dir)
+string get_refined_pose_file(const string& scene_dir, int model_id)
 {
-	string estimated_poses_dir = (fs::path(scene_dir)  / "refined_object_poses").string();
+	stringstream filename_ss;
+	filename_ss << std::setfill('0') << std::setw(6) << model_id << ".txt";
+	const string filename = filename_ss.str();
 
-	if (!fs::is_directory(estimated_poses_dir))
+	return (fs::path(scene_dir) / "refined_object_poses" / filename).string();
+}
+
+void store_refined_pose(int model_id, const Matrix4d& pose, const string& scene_dir)
+{
+	string out_file = get_refined_pose_file(scene_dir, model_id);
+	fs::create_directories(fs::path(out_file).parent_path());
+
+	// written next to the target and renamed, an interrupted run never leaves a partial pose behind
+	string temporary_file = out_file + ".tmp";
+
+	ofstream out_filestream;
+	out_filestream.open(temporary_file);
+	out_filestream << pose << std::endl;
+	out_filestream.close();
+
+	fs::rename(temporary_file, out_file);
+}
+
+// Removes the models which already have a refined pose from the input, returns their poses
+map<int, Matrix4d> take_completed_models(const string& scene_dir, map<int, Matrix4d>& model_poses)
+{
+	map<int, Matrix4d> completed_poses;
+
+	for (auto it = model_poses.begin(); it != model_poses.end();)
+	{
+		const string pose_file = get_refined_pose_file(scene_dir, it->first);
+		if (fs::is_regular_file(pose_file))
+		{
+			cout << "Model #" << it->first << " already refined, skipping" << endl;
+			completed_poses[it->first] = read_pose_from_file<double>(pose_file);
+			it = model_poses.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	return completed_poses;
+}
+
+
+// Reads the frames and poses of a scene, with resume only the models without a refined pose are kept
+bool read_refinement_input(const string& scene_dir, const string& model_ids_string, bool resume, RefinementInput& refinement_input)
+{
+	refinement_input.scene_dir = scene_dir;
+
+	if (!get_rgbd_files(scene_dir, refinement_input.rgbd_image_files)) return false;
+	if (!read_scene_camera_poses(scene_dir, refinement_input.camera_poses)) return false;
+
+	//number of frames must be equal to the number of poses
+	if (refinement_input.rgbd_image_files.size() != refinement_input.camera_poses.size())
+	{
+		cerr << "The number of frames does not match the number of poses" << endl;
+		return false;
+	}
+
+	if (refinement_input.rgbd_image_files.empty())
+	{
+		cerr << "No frames in scene " << scene_dir << endl;
+		return false;
+	}
+	
+	if (!get_model_poses(scene_dir, model_ids_string, refinement_input.model_poses)) return false;
+
+	if (resume)
+	{
+		take_completed_models(scene_dir, refinement_input.model_poses);
+	}
+
+	return true;
+}
+
+vector<string> read_scene_list(const string& scene_list_file)
+{
+	vector<string> scene_dirs;
+
+	ifstream scene_list_stream(scene_list_file);
+	for (string line; getline(scene_list_stream, line);)
 	{
-		fs::create_directories(estimated_poses_dir);
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (!line.empty() && line[0] != '#') scene_dirs.push_back(line);
 	}
 
-	for (auto const& [model_id, pose] : object_poses)
+	return scene_dirs;
+}
+
+int run_batch(const Configuration& configuration, const string& scene_list_file, const string& model_ids_string,
+              bool resume, int number_of_workers)
+{
+	BatchRefiner batch_refiner(configuration, number_of_workers);
+
+	for (const string& scene_dir : read_scene_list(scene_list_file))
 	{
-		stringstream filename_ss;
-		filename_ss << std::setfill('0') << std::setw(6) << model_id << ".txt";
-		const string filename = filename_ss.str();
+		RefinementInput refinement_input;
+		if (!fs::is_directory(scene_dir) || !read_refinement_input(scene_dir, model_ids_string, resume, refinement_input))
+		{
+			cerr << "Skipping invalid scene " << scene_dir << endl;
+			continue;
+		}
 
-		string out_file = (fs::path(estimated_poses_dir) / filename).string();
+		if (refinement_input.model_poses.empty()) continue;
 
-		ofstream out_filestream;
-		out_filestream.open(out_file);
-		out_filestream << pose << std::endl;
-		out_filestream.close();
+		// scenes of any image size, every thread keeps a painter per resolution
+		batch_refiner.add_scene(refinement_input);
 	}
+
+	batch_refiner.run([](const string& scene_dir, int model_id, const Matrix4d& pose)
+	{
+		store_refined_pose(model_id, pose, scene_dir);
+	});
+
+	return 0;
 }
 
 
@@ -66,8 +165,11 @@ int main(int argc, char* argv[])
 {
 	const string configuration_keys = "{help h usage ? |          | help on usage }"
 		"{scene_dir   |          | path to the scene}"
+		"{scene_list   |          | text file with one scene path per line, refined in one process instead of scene_dir}"
+		"{workers   |         1 | number of parallel refinement jobs with scene_list}"
 		"{model_ids   |         -1 | Model id, default -1, i.e. refinement for all}"
-		"{config_file   |          | path to config_json_file}";
+		"{config_file   |          | path to config_json_file}"
+		"{resume   |          | skip models which already have a pose in refined_object_poses}";
 
 	cv::CommandLineParser parser(argc, argv, configuration_keys);
 
@@ -75,13 +177,11 @@ int main(int argc, char* argv[])
 	string config_file = parser.get<string>("config_file");
 	CHECK_VALID_FILE(config_file)
 
-	CHECK_PARAM_EXISTS(parser, "scene_dir")
-	string scene_dir = parser.get<string>("scene_dir");
-	CHECK_VALID_DIR(scene_dir)
-
 	CHECK_PARAM_EXISTS(parser, "model_ids")
 	string model_ids_string = parser.get<string>("model_ids");
 
+	const bool resume = parser.has("resume");
+
 	Configuration configuration;
 
 	if (!parse_configuration(config_file, configuration))
@@ -90,23 +190,34 @@ int main(int argc, char* argv[])
 		return EXIT_FAILURE;
 	}
 
-	RefinementInput refinement_input;
+	if (parser.has("scene_list"))
+	{
+		string scene_list_file = parser.get<string>("scene_list");
+		CHECK_VALID_FILE(scene_list_file)
 
-	if (!get_rgbd_files(scene_dir, refinement_input.rgbd_image_files)) return EXIT_FAILURE;
-	if (!read_scene_camera_poses(scene_dir, refinement_input.camera_poses)) return EXIT_FAILURE;
+		return run_batch(configuration, scene_list_file, model_ids_string, resume, parser.get<int>("workers"));
+	}
 
-	//number of frames must be equal to the number of poses
-	if (refinement_input.rgbd_image_files.size() != refinement_input.camera_poses.size())
+	CHECK_PARAM_EXISTS(parser, "scene_dir")
+	string scene_dir = parser.get<string>("scene_dir");
+	CHECK_VALID_DIR(scene_dir)
+
+	RefinementInput refinement_input;
+	if (!read_refinement_input(scene_dir, model_ids_string, resume, refinement_input)) return EXIT_FAILURE;
+
+	if (refinement_input.model_poses.empty())
 	{
-		cerr << "The number of frames does not match the number of poses" << endl;
-		return EXIT_FAILURE;
+		cout << "No models to refine" << endl;
+		return 0;
 	}
-	
-	if (!get_model_poses(scene_dir, model_ids_string, refinement_input.model_poses)) return EXIT_FAILURE;
 
 	Refiner refiner(configuration);
-	const map<int, Matrix4d> refined_model_poses = refiner.refine_model_poses(refinement_input);
-	store_refined_poses(refined_model_poses, scene_dir);
+	// every pose is stored as soon as it is refined, so that a resumed run can continue after the last completed model
+	refiner.set_model_refined_callback([&scene_dir](int model_id, const Matrix4d& pose)
+	{
+		store_refined_pose(model_id, pose, scene_dir);
+	});
+	refiner.refine_model_poses(refinement_input);
 
 	return 0;
 }
@@ -10,63 +10,186 @@
 #include "occlusion_handler.hpp"
 
 #include <utility>
+#include <fstream>
+#include <filesystem>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <nlohmann/json.hpp>
 #include "rendering_helper.h"
+#include "util.h"
 
 using namespace Eigen;
 using namespace std;
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+static const int VISIBILITY_CACHE_VERSION = 3;
 
 
 OcclusionHandler::OcclusionHandler(Configuration configuration,
                                    vector<RgbdFile> rgbd_image_files,
-                                   vector<Matrix4d> camera_poses) :
-	configuration(move(configuration)), rgbd_image_files(move(rgbd_image_files)), camera_poses(move(camera_poses))
+                                   vector<Matrix4d> camera_poses,
+                                   string cache_file) :
+	configuration(move(configuration)), rgbd_image_files(move(rgbd_image_files)), camera_poses(move(camera_poses)),
+	cache_file(move(cache_file))
+{
+	object_visibility_threshold = this->configuration.get_object_visibility_threshold();
+	occlusion_threshold = this->configuration.get_occlusion_threshold();
+}
+
+
+bool OcclusionHandler::is_object_visible(const cv::Mat& gt_depth, const cv::Mat& rendered_depth, const cv::Mat& object_mask)
+{
+	const int total_object_pixels = cv::countNonZero(object_mask);
+	if (total_object_pixels == 0) return false;
+
+	// pixels without measured depth count as visible
+	cv::Mat no_measurement = gt_depth <= 1e-3f;
+	cv::Mat not_occluded = (rendered_depth - gt_depth) < occlusion_threshold;
+
+	cv::Mat visible_object_mask = (no_measurement | not_occluded) & object_mask;
+	const int visible_object_pixels = cv::countNonZero(visible_object_mask);
+
+	const float visible_fraction = static_cast<float>(visible_object_pixels) / static_cast<float>(total_object_pixels);
+
+	return visible_fraction > object_visibility_threshold;
+}
+
+
+cv::Rect OcclusionHandler::get_projected_box(const Matrix<double, 3, 8>& corners, const Matrix4d& world_to_camera,
+                                             int width, int height) const
+{
+	const cv::Rect image_rect(0, 0, width, height);
+	const Matrix3d intrinsics = configuration.get_intrinsics().cast<double>();
+	const Matrix<double, 3, 8> camera_corners = (world_to_camera.topLeftCorner<3, 3>() * corners).colwise()
+	                                            + world_to_camera.block<3, 1>(0, 3);
+
+	double min_x = numeric_limits<double>::max(), min_y = numeric_limits<double>::max();
+	double max_x = numeric_limits<double>::lowest(), max_y = numeric_limits<double>::lowest();
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		if (camera_corners(2, corner) <= 1e-3) return image_rect;
+
+		const Vector2d pixel = project_point<double>(camera_corners.col(corner), intrinsics);
+		min_x = min(min_x, pixel.x());
+		min_y = min(min_y, pixel.y());
+		max_x = max(max_x, pixel.x());
+		max_y = max(max_y, pixel.y());
+	}
+
+	// clamped before the conversion, boxes far outside the image would overflow int
+	const auto clamp_x = [width](double x) { return static_cast<int>(max(0.0, min(static_cast<double>(width), x))); };
+	const auto clamp_y = [height](double y) { return static_cast<int>(max(0.0, min(static_cast<double>(height), y))); };
+	return cv::Rect(cv::Point(clamp_x(floor(min_x)), clamp_y(floor(min_y))),
+	                cv::Point(clamp_x(ceil(max_x) + 1), clamp_y(ceil(max_y) + 1))) & image_rect;
+}
+
+
+// path, size and modification time, so replaced files change the key
+static void hash_file_stamp(uint64_t& hash, const string& file)
 {
-	object_visibility_threshold = configuration.get_object_visibility_threshold();
-	occlusion_threshold = configuration.get_occlusion_threshold();
+	hash_bytes(hash, file.data(), file.size());
+
+	error_code error;
+	const uintmax_t file_size = fs::file_size(file, error);
+	const uintmax_t size = error ? 0 : file_size;
+	hash_bytes(hash, &size, sizeof(size));
+
+	const auto write_time = fs::last_write_time(file, error);
+	const int64_t ticks = error ? 0 : static_cast<int64_t>(write_time.time_since_epoch().count());
+	hash_bytes(hash, &ticks, sizeof(ticks));
 }
 
 
-bool OcclusionHandler::is_object_visible(const cv::Mat& gt_depth, const cv::Mat& rendered_depth)
+string OcclusionHandler::get_cache_key(const map<int, Matrix4d>& model_poses) const
 {
-	int total_object_pixels = 0;
-	int visible_object_pixels = 0;
+	uint64_t hash = FNV_OFFSET_BASIS;
+
+	for (const auto& [model_id, model_pose] : model_poses)
+	{
+		hash_bytes(hash, &model_id, sizeof(model_id));
+		hash_bytes(hash, model_pose.data(), sizeof(double) * 16);
+		hash_file_stamp(hash, get_model_file(configuration.get_reference_models_dir(), model_id));
+	}
+
+	const Matrix3f intrinsics = configuration.get_intrinsics();
+	hash_bytes(hash, intrinsics.data(), sizeof(float) * 9);
 
-	for (int i = 0; i < gt_depth.rows; ++i)
+	// the image size comes from the depth images
+	for (const auto& rgbd_image_file : rgbd_image_files)
 	{
-		for (int j = 0; j < gt_depth.cols; ++j)
+		hash_file_stamp(hash, rgbd_image_file.second);
+	}
+
+	for (const auto& camera_pose : camera_poses)
+	{
+		hash_bytes(hash, camera_pose.data(), sizeof(double) * 16);
+	}
+
+	hash_bytes(hash, &object_visibility_threshold, sizeof(object_visibility_threshold));
+	hash_bytes(hash, &occlusion_threshold, sizeof(occlusion_threshold));
+	// caches of the frontmost pixel counting, which missed occlusions between the objects, are stale; the depth range of
+	// the renderers is fixed in the code and covered by the version as well
+	hash_bytes(hash, &VISIBILITY_CACHE_VERSION, sizeof(VISIBILITY_CACHE_VERSION));
+
+	stringstream key_ss;
+	key_ss << hex << setfill('0') << setw(16) << hash;
+	return key_ss.str();
+}
+
+
+map<int, vector<size_t>> OcclusionHandler::get_frame_ids_with_visible_models(const map<int, Matrix4d>& model_poses)
+{
+	const string cache_key = get_cache_key(model_poses);
+
+	if (!cache_file.empty() && fs::is_regular_file(cache_file))
+	{
+		try
 		{
-			float rendered_val = rendered_depth.at<float>(i, j);
+			ifstream cache_stream(cache_file);
+			json cache_json;
+			cache_stream >> cache_json;
 
-			if (isfinite(rendered_val) && rendered_val > 1e-3f)
+			if (cache_json["key"].get<string>() == cache_key)
 			{
-				float gt_val = gt_depth.at<float>(i, j);
+				cout << "Using cached frame visibility from " << cache_file << endl;
 
-				if (isfinite(gt_val) && gt_val > 1e-3f)
-				{
-					float diff = rendered_val - gt_val;
-					
-					// probably no occlusion
-					if (diff < occlusion_threshold)
-					{
-						visible_object_pixels++;
-					}
-				} else
+				map<int, vector<size_t>> visible_frame_ids;
+				for (const auto& [model_id, frame_ids] : cache_json["frame_ids"].items())
 				{
-					visible_object_pixels++;
+					visible_frame_ids[stoi(model_id)] = frame_ids.get<vector<size_t>>();
 				}
 
-				total_object_pixels++;
+				return visible_frame_ids;
 			}
 		}
+		catch (const std::exception& e)
+		{
+			cerr << "Ignoring invalid visibility cache " << cache_file << ": " << e.what() << endl;
+		}
 	}
 
-	const float visible_fraction = static_cast<float>(visible_object_pixels) / static_cast<float>(total_object_pixels);
+	map<int, vector<size_t>> visible_frame_ids = compute_frame_ids_with_visible_models(model_poses);
 
-	return visible_fraction > object_visibility_threshold;
+	if (!cache_file.empty())
+	{
+		json cache_json;
+		cache_json["key"] = cache_key;
+		for (const auto& [model_id, frame_ids] : visible_frame_ids)
+		{
+			cache_json["frame_ids"][to_string(model_id)] = frame_ids;
+		}
+
+		ofstream cache_stream(cache_file);
+		cache_stream << cache_json.dump() << endl;
+	}
+
+	return visible_frame_ids;
 }
 
 
-vector<size_t> OcclusionHandler::get_frame_ids_with_visible_model(int model_id, const Matrix4d& model_pose)
+map<int, vector<size_t>> OcclusionHandler::compute_frame_ids_with_visible_models(const map<int, Matrix4d>& model_poses)
 {
 	size_t number_of_frames = rgbd_image_files.size();
 
@@ -76,30 +199,70 @@ vector<size_t> OcclusionHandler::get_frame_ids_with_visible_model(int model_id,
 	int width = first_depth_image.cols;
 	int height = first_depth_image.rows;
 
-	RenderingHelper rendering_helper(configuration, model_id, width, height);
+	vector<int> model_ids;
+	vector<Matrix4d> model_pose_list;
+	for (const auto& [model_id, model_pose] : model_poses)
+	{
+		model_ids.push_back(model_id);
+		model_pose_list.push_back(model_pose);
+	}
+
+	const size_t number_of_models = model_ids.size();
 
-	vector<size_t> indices;
+	// the silhouette of every model on its own, the depth of its occluders comes from the measured depth
+	vector<RenderingHelper> rendering_helpers;
+	rendering_helpers.reserve(number_of_models);
+	vector<Matrix<double, 3, 8>> bbox_corners(number_of_models);
+	for (size_t model_idx = 0; model_idx < number_of_models; ++model_idx)
+	{
+		rendering_helpers.emplace_back(configuration, model_ids[model_idx], width, height);
 
+		Vector3f bb_min, bb_max;
+		rendering_helpers.back().get_model_bounding_box(bb_min, bb_max);
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			bbox_corners[model_idx].col(corner) = Vector3d(corner & 1 ? bb_max.x() : bb_min.x(),
+			                                               corner & 2 ? bb_max.y() : bb_min.y(),
+			                                               corner & 4 ? bb_max.z() : bb_min.z());
+		}
+	}
+
+	map<int, vector<size_t>> visible_frame_ids;
+	for (int model_id : model_ids) visible_frame_ids[model_id] = {};
+
+	cv::Mat rendered_depth;
 	for (size_t i = 0; i < number_of_frames; ++i)
 	{
 		const cv::Mat depth_img = cv::imread(rgbd_image_files[i].second, -1);
 		cv::Mat gt_depth_float;
 		depth_img.convertTo(gt_depth_float, CV_32FC1, 0.001);
 
-		cv::Mat rendered_depth;
-		cv::Mat rendered_rgb;
-
-		Matrix4d world_to_cam = camera_poses[i].inverse() * model_pose;
-		rendering_helper.render(world_to_cam, rendered_depth, rendered_rgb);
+		const Matrix4d camera_pose_inverse = camera_poses[i].inverse();
 
-		if (is_object_visible(gt_depth_float, rendered_depth))
+		for (size_t model_idx = 0; model_idx < number_of_models; ++model_idx)
 		{
-			indices.push_back(i);
-		} else
-		{
-			cout << "Model #" << model_id << " is invisible in frame #" << i << ", skipping" << endl;
+			const int model_id = model_ids[model_idx];
+			const Matrix4d world_to_camera = camera_pose_inverse * model_pose_list[model_idx];
+
+			bool is_visible = false;
+			const cv::Rect roi = get_projected_box(bbox_corners[model_idx], world_to_camera, width, height);
+			if (!roi.empty())
+			{
+				// only the depth inside the box is read back
+				rendering_helpers[model_idx].render_depth(world_to_camera, rendered_depth, 1.0f, roi);
+				cv::Mat object_mask = rendered_depth > 1e-3f;
+				is_visible = is_object_visible(gt_depth_float(roi), rendered_depth, object_mask);
+			}
+
+			if (is_visible)
+			{
+				visible_frame_ids[model_id].push_back(i);
+			} else
+			{
+				cout << "Model #" << model_id << " is invisible in frame #" << i << ", skipping" << endl;
+			}
 		}
 	}
 
-	return indices;
+	return visible_frame_ids;
 }
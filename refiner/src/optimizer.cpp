@@ -83,8 +83,80 @@ struct ModelPoseFunctor {
 	double std_dev;
 };
 
+struct PointToPlaneFunctor {
+	PointToPlaneFunctor(Eigen::Vector3d model_point, Eigen::Vector3d measured_point, Eigen::Vector3d measured_normal,
+		double* scene_inverse_angle_axis, double* scene_pose_inverse_translation, double std_dev)
+		:model_point(std::move(model_point)), measured_point(std::move(measured_point)), measured_normal(std::move(measured_normal)),
+		scene_inverse_angle_axis(scene_inverse_angle_axis), scene_pose_inverse_translation(scene_pose_inverse_translation),
+		std_dev(std_dev) {}
+
+	template <typename T>  bool operator()(const T* const rotation_to_optimize, const T* const translation_to_optimize, T* residual) const {
+
+		T p[3];
+
+		p[0] = T(model_point[0]);
+		p[1] = T(model_point[1]);
+		p[2] = T(model_point[2]);
+
+		ceres::AngleAxisRotatePoint(rotation_to_optimize, p, p);
+
+		p[0] += translation_to_optimize[0];
+		p[1] += translation_to_optimize[1];
+		p[2] += translation_to_optimize[2];
+
+		T scene_inverse_angle_axis_t[3];
+		scene_inverse_angle_axis_t[0] = T(scene_inverse_angle_axis[0]);
+		scene_inverse_angle_axis_t[1] = T(scene_inverse_angle_axis[1]);
+		scene_inverse_angle_axis_t[2] = T(scene_inverse_angle_axis[2]);
+
+		ceres::AngleAxisRotatePoint(scene_inverse_angle_axis_t, p, p);
+
+		p[0] += T(scene_pose_inverse_translation[0]);
+		p[1] += T(scene_pose_inverse_translation[1]);
+		p[2] += T(scene_pose_inverse_translation[2]);
+
+		residual[0] = ((p[0] - T(measured_point[0])) * T(measured_normal[0]) +
+			(p[1] - T(measured_point[1])) * T(measured_normal[1]) +
+			(p[2] - T(measured_point[2])) * T(measured_normal[2])) / T(std_dev);
+		return true;
+	}
+
+	Eigen::Vector3d model_point;
+	Eigen::Vector3d measured_point;
+	Eigen::Vector3d measured_normal;
 
-Eigen::Matrix4d optimize_model_pose(const vector<FramePayload> &frame_payloads, const Eigen::Matrix4d &model_pose, const Eigen::Matrix3d &intrinsics, double residuals_std_dev)
+	double* scene_inverse_angle_axis;
+	double* scene_pose_inverse_translation;
+	double std_dev;
+};
+
+// Robust std dev of the point-to-plane distances at the initial pose, scales the depth residuals like the edge ones
+double get_depth_residuals_std_dev(const vector<FramePayload> &frame_payloads, const Eigen::Matrix4d &model_pose)
+{
+	vector<double> residuals;
+	for (const FramePayload &payload : frame_payloads)
+	{
+		const DepthCorrespondence &depth_correspondence = payload.depth_correspondence;
+		const Eigen::Matrix4d world_to_camera = payload.scene_pose.inverse() * model_pose;
+
+		for (size_t i = 0; i < depth_correspondence.get_number_of_correspondences(); i++) {
+			const Eigen::Vector3d model_point = depth_correspondence.model_points[i].cast<double>();
+			const Eigen::Vector3d camera_point = world_to_camera.block<3, 3>(0, 0) * model_point + world_to_camera.block<3, 1>(0, 3);
+
+			residuals.push_back((camera_point - depth_correspondence.measured_points[i].cast<double>())
+				.dot(depth_correspondence.measured_normals[i].cast<double>()));
+		}
+	}
+
+	if (residuals.empty()) return 0.0;
+
+	// floor of a tenth of a millimeter, the distances vanish once the model fits the measured surface
+	return max(1.482579 * select_median_absolute_deviation(residuals), 1e-4);
+}
+
+
+Eigen::Matrix4d optimize_model_pose(const vector<FramePayload> &frame_payloads, const Eigen::Matrix4d &model_pose, const Eigen::Matrix3d &intrinsics, double residuals_std_dev,
+	double depth_weight)
 {
 	double* angle_axis_to_optimize = new double[3];
 	double* translation_to_optimize = new double[3];
@@ -108,6 +180,9 @@ Eigen::Matrix4d optimize_model_pose(const vector<FramePayload> &frame_payloads,
 	vector<double*> scene_invere_translations;
 	cout << "Residuals std dev: " << residuals_std_dev << endl;
 
+	const double depth_residuals_std_dev = depth_weight > 0.0 ? get_depth_residuals_std_dev(frame_payloads, model_pose) : 0.0;
+	if (depth_residuals_std_dev > 0.0) cout << "Depth residuals std dev: " << depth_residuals_std_dev << endl;
+
 	for (const FramePayload &payload : frame_payloads)
 	{
 		const Correspondence &correspondence = payload.correspondence;
@@ -137,7 +212,22 @@ Eigen::Matrix4d optimize_model_pose(const vector<FramePayload> &frame_payloads,
 					angle_axis_scene_inverse, scene_pose_inverse_translation_array,
 					rgb_edge_normal, residuals_std_dev));
 
-			TukeyLoss* loss_function = new TukeyLoss(4.365);
+			// the weight scales the robust cost, the outlier threshold of the residual stays the same
+			LossFunction* loss_function = new ScaledLoss(new TukeyLoss(4.365), correspondence.get_weight(i), TAKE_OWNERSHIP);
+			problem.AddResidualBlock(cost_function, loss_function, angle_axis_to_optimize, translation_to_optimize);
+		}
+
+		if (depth_residuals_std_dev <= 0.0) continue;
+
+		const DepthCorrespondence &depth_correspondence = payload.depth_correspondence;
+		for (size_t i = 0; i < depth_correspondence.get_number_of_correspondences(); i++) {
+			CostFunction *cost_function =
+				new AutoDiffCostFunction<PointToPlaneFunctor, 1, 3, 3>(new PointToPlaneFunctor(
+					depth_correspondence.model_points[i].cast<double>(), depth_correspondence.measured_points[i].cast<double>(),
+					depth_correspondence.measured_normals[i].cast<double>(), angle_axis_scene_inverse,
+					scene_pose_inverse_translation_array, depth_residuals_std_dev));
+
+			LossFunction* loss_function = new ScaledLoss(new TukeyLoss(4.365), depth_weight, TAKE_OWNERSHIP);
 			problem.AddResidualBlock(cost_function, loss_function, angle_axis_to_optimize, translation_to_optimize);
 		}
 	}
@@ -0,0 +1,82 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#include "refinement_report.h"
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <nlohmann/json.hpp>
+
+using namespace std;
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+
+json pose_to_json(const Eigen::Matrix4d& pose)
+{
+	// row-major, like the pose text files
+	vector<double> values;
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = 0; j < 4; ++j) values.push_back(pose(i, j));
+	}
+
+	return values;
+}
+
+void to_json(json& j, const IterationReport& iteration)
+{
+	j = json{
+		{"pyramid_level", iteration.pyramid_level},
+		{"iteration", iteration.iteration},
+		{"frames", iteration.frames},
+		{"correspondences", iteration.correspondences},
+		{"depth_correspondences", iteration.depth_correspondences},
+		{"residual_std_dev", iteration.residual_std_dev},
+		{"rotation_update", iteration.rotation_update},
+		{"translation_update", iteration.translation_update}
+	};
+}
+
+void to_json(json& j, const StageTimings& timings)
+{
+	j = json{
+		{"loading", timings.loading},
+		{"visibility", timings.visibility},
+		{"rendering", timings.rendering},
+		{"edge_extraction", timings.edge_extraction},
+		{"correspondence", timings.correspondence},
+		{"solve", timings.solve},
+		{"total", timings.total}
+	};
+}
+
+void store_model_report(const ModelReport& report, const string& scene_dir)
+{
+	json report_json;
+	report_json["model_id"] = report.model_id;
+	report_json["visible_frames"] = report.visible_frames;
+	report_json["used_frames"] = report.used_frames;
+	report_json["converged"] = report.converged;
+	report_json["stop_reason"] = report.stop_reason;
+	report_json["initial_pose"] = pose_to_json(report.initial_pose);
+	report_json["refined_pose"] = pose_to_json(report.refined_pose);
+	report_json["iterations"] = report.iterations;
+	report_json["timings"] = report.timings;
+
+	const fs::path reports_dir = fs::path(scene_dir) / "refinement_reports";
+	fs::create_directories(reports_dir);
+
+	stringstream filename_ss;
+	filename_ss << setfill('0') << setw(6) << report.model_id << ".json";
+
+	ofstream report_stream((reports_dir / filename_ss.str()).string());
+	report_stream << setw(2) << report_json << endl;
+}
@@ -14,8 +14,11 @@
 #include "optimizer.h"
 #include "correspondence_finder.h"
 #include <string>
+#include <limits>
 #include <Eigen/Geometry>
 #include "occlusion_handler.hpp"
+#include "frame_selector.h"
+#include "refinement_report.h"
 #include <filesystem>
 #include <vis_utils.h>
 
@@ -91,17 +94,24 @@ void add_padding(cv::Vec4i& vec, int padding_pixels) {
 }
 
 
-template <typename T>
-T get_median_absolute_deviation(const Matrix<T, Dynamic, 1>& v) {
-	T median = get_median(v);
-	Matrix<T, Dynamic, 1> res = (v - median).cwiseAbs();
-	return get_median(res);
-}
-
 void compute_residual_std_dev(const vector<FramePayload>& frame_payloads, const Matrix4d& model_pose_m,
                               const Matrix3d& intrinsics, double& std_dev, bool& has_converged)
 {
+	size_t number_of_residuals = 0;
+	for (const auto& payload : frame_payloads)
+	{
+		number_of_residuals += payload.correspondence.get_number_of_correspondences();
+	}
+
+	if (number_of_residuals == 0)
+	{
+		std_dev = 0.0;
+		has_converged = false;
+		return;
+	}
+
 	vector<double> residuals;
+	residuals.reserve(number_of_residuals);
 
 	int converged_num = 0;
 	const Isometry3d model_pose = to_isometry(model_pose_m);
@@ -133,12 +143,20 @@ void compute_residual_std_dev(const vector<FramePayload>& frame_payloads, const
 		}
 	}
 
-	VectorXd eigen_residuals = Eigen::Map<VectorXd, Unaligned>(residuals.data(), residuals.size());
-	double mad = get_median_absolute_deviation(eigen_residuals);
-	std_dev = 1.482579 * mad;
-
 	auto res_num = static_cast<double>(residuals.size());
 	has_converged = (converged_num / res_num) >= 0.9;
+
+	// also for converged iterations, whose reports record it
+	double mad = select_median_absolute_deviation(residuals);
+	std_dev = 1.482579 * mad;
+}
+
+bool is_pose_update_small(const Matrix4d& previous_pose, const Matrix4d& updated_pose, const Configuration& configuration)
+{
+	double rotation_angle, translation;
+	get_pose_difference(previous_pose, updated_pose, rotation_angle, translation);
+
+	return rotation_angle < configuration.get_min_rotation_update() && translation < configuration.get_min_translation_update();
 }
 
 cv::Rect get_roi_box(const cv::Mat& depth_img, int model_padding_pixels)
@@ -159,13 +177,174 @@ cv::Rect get_roi_box(const cv::Mat& depth_img, int model_padding_pixels)
 }
 
 
+// Bounding box of the projected model edges, padded and clipped to the image, empty if nothing projects into the image
+cv::Rect get_projected_roi_box(const vector<Vector3f>& edge_points, const Matrix4d& world_to_camera, const Matrix3d& intrinsics,
+                               int model_padding_pixels, int width, int height)
+{
+	vector<cv::Point2f> pixels;
+	pixels.reserve(edge_points.size());
+
+	for (const auto& point : edge_points)
+	{
+		Vector3d camera_point = world_to_camera.block<3, 3>(0, 0) * point.cast<double>() + world_to_camera.block<3, 1>(0, 3);
+		if (camera_point.z() <= 0) continue;
+
+		Vector3d pixel = intrinsics * (camera_point / camera_point.z());
+		pixels.emplace_back(static_cast<float>(pixel.x()), static_cast<float>(pixel.y()));
+	}
+
+	if (pixels.empty()) return cv::Rect();
+
+	cv::Rect box = cv::boundingRect(pixels);
+	box.x -= model_padding_pixels;
+	box.y -= model_padding_pixels;
+	box.width += 2 * model_padding_pixels;
+	box.height += 2 * model_padding_pixels;
+
+	return box & cv::Rect(0, 0, width, height);
+}
+
+
+// Gradient magnitude of the image inside the roi and zero elsewhere, empty if neither sub-pixel edges nor weights need it
+cv::Mat get_gradient_magnitude(const cv::Mat& grayscale_img, const cv::Rect& roi, const Configuration& configuration)
+{
+	if (!configuration.get_subpixel_edges() && !configuration.get_weighted_correspondences()) return cv::Mat();
+
+	cv::Mat gradient_x, gradient_y;
+	cv::Sobel(grayscale_img(roi), gradient_x, CV_32F, 1, 0, 3);
+	cv::Sobel(grayscale_img(roi), gradient_y, CV_32F, 0, 1, 3);
+
+	cv::Mat gradient_magnitude = cv::Mat::zeros(grayscale_img.size(), CV_32FC1);
+	cv::Mat roi_magnitude = gradient_magnitude(roi);
+	cv::magnitude(gradient_x, gradient_y, roi_magnitude);
+
+	return gradient_magnitude;
+}
+
+
+cv::Mat load_grayscale_image(const string& rgb_file)
+{
+	cv::Mat rgb = read_image(rgb_file);
+	cv::Mat grayscale;
+	cv::cvtColor(rgb, grayscale, CV_RGB2GRAY);
+	return grayscale;
+}
+
+// depth in meters, CV_32FC1
+cv::Mat load_depth_image(const string& depth_file)
+{
+	cv::Mat depth_img;
+	cv::imread(depth_file, -1).convertTo(depth_img, CV_32FC1, 0.001);
+
+	return depth_img;
+}
+
+cv::Mat get_object_depth(const cv::Mat& depth_img, const cv::Mat& object_ids, ushort object_id)
+{
+	cv::Mat object_depth(depth_img.size(), CV_32FC1, cv::Scalar::all(0));
+	depth_img.copyTo(object_depth, object_ids == object_id);
+	return object_depth;
+}
+
+// Marks pixels close to other objects lying in front of the object, 
+// the depth edges there belong to the occluder and not to the object
+cv::Mat get_occlusion_mask(const cv::Mat& depth_img, const cv::Mat& object_ids, const cv::Mat& object_depth, ushort object_id)
+{
+	cv::Mat neighborhood_depth;
+	cv::dilate(object_depth, neighborhood_depth, cv::Mat());
+
+	cv::Mat occluders = (object_ids != object_id) & (object_ids != 0) & (depth_img < neighborhood_depth);
+
+	cv::Mat occlusion_mask;
+	cv::dilate(occluders, occlusion_mask, cv::Mat(), cv::Point(-1, -1), 2);
+	return occlusion_mask;
+}
+
 Refiner::Refiner(const Configuration& p_configuration)
 {
 	configuration = p_configuration;
 }
 
-vector<Vector4f> get_depth_edges(const cv::Mat &depth_img, const cv::Rect &cropping_box)
+// Marks the pixels on the near side of depth discontinuities larger than the threshold (in meters), 
+// the object silhouette included since the background counts as infinitely far
+cv::Mat get_depth_discontinuities(const cv::Mat& depth_roi, float depth_threshold)
+{
+	cv::Mat foreground = depth_roi > 0.0f;
+
+	cv::Mat filled_depth(depth_roi.size(), CV_32FC1, cv::Scalar::all(numeric_limits<float>::max()));
+	depth_roi.copyTo(filled_depth, foreground);
+
+	// 4-neighborhood keeps the marked contours one pixel thin
+	cv::Mat neighborhood_max;
+	cv::dilate(filled_depth, neighborhood_max, cv::getStructuringElement(cv::MORPH_CROSS, cv::Size(3, 3)),
+	           cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar::all(numeric_limits<float>::max()));
+
+	cv::Mat discontinuities = (neighborhood_max - filled_depth) > depth_threshold;
+	return discontinuities & foreground;
+}
+
+// Adds the segment unless most of it runs over already emitted segments,
+// contours of one pixel thin curves are traced twice, once per side
+void add_unvisited_segment(const cv::Point& start, const cv::Point& end, cv::Mat& visited, vector<Vector4f>& edges)
+{
+	cv::LineIterator line_it(visited, start, end, 8);
+	int visited_points = 0;
+
+	for (int i = 0; i < line_it.count; ++i, ++line_it)
+	{
+		if (**line_it != 0) visited_points++;
+	}
+
+	if (2 * visited_points > line_it.count) return;
+
+	cv::line(visited, start, end, cv::Scalar::all(255), 3, 8);
+	edges.emplace_back(static_cast<float>(start.x), static_cast<float>(start.y),
+	                   static_cast<float>(end.x), static_cast<float>(end.y));
+}
+
+vector<Vector4f> extract_depth_discontinuity_edges(const cv::Mat& depth_img, const cv::Rect& cropping_box, float depth_threshold)
+{
+	const float min_segment_length = 2.0f;
+	const double max_fitting_error = 1.0;
+
+	cv::Mat discontinuities = get_depth_discontinuities(depth_img(cropping_box), depth_threshold);
+
+	vector<vector<cv::Point>> contours;
+	cv::findContours(discontinuities, contours, cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+
+	cv::Mat visited = cv::Mat::zeros(discontinuities.size(), CV_8UC1);
+	vector<Vector4f> edges;
+
+	for (const auto& contour : contours)
+	{
+		vector<cv::Point> polyline;
+		cv::approxPolyDP(contour, polyline, max_fitting_error, true);
+
+		for (size_t i = 0; i < polyline.size(); ++i)
+		{
+			const cv::Point& start = polyline[i];
+			const cv::Point& end = polyline[(i + 1) % polyline.size()];
+
+			if (cv::norm(end - start) < min_segment_length) continue;
+
+			add_unvisited_segment(start, end, visited, edges);
+		}
+	}
+
+	const Vector4f offset(static_cast<float>(cropping_box.x), static_cast<float>(cropping_box.y),
+	                      static_cast<float>(cropping_box.x), static_cast<float>(cropping_box.y));
+	for (auto& edge : edges) edge += offset;
+
+	return edges;
+}
+
+vector<Vector4f> get_depth_edges(const cv::Mat &depth_img, const cv::Rect &cropping_box, const Configuration& configuration)
 {
+	if (configuration.get_depth_edge_extractor() == "gradient")
+	{
+		return extract_depth_discontinuity_edges(depth_img, cropping_box, configuration.get_depth_edge_threshold());
+	}
+
 	cv::Mat norm_depth_img;
 	cv::normalize(depth_img, norm_depth_img, 255, 0, cv::NORM_MINMAX);
 	norm_depth_img.convertTo(norm_depth_img, CV_8UC1);
@@ -180,29 +359,147 @@ inline void draw_line_ids(cv::Mat &img, const vector<Vector4f> &edges) {
 	}
 }
 
-Matrix4d Refiner::refine_model_pose(const vector<Matrix4d>& camera_poses,
-                                           const vector<cv::Mat>& grayscale_images,
-                                           const Matrix4d& model_pose, int model_id)
+Matrix4d Refiner::refine_model_pose(const vector<Matrix4d>& camera_poses, const vector<size_t>& frame_ids,
+                                           const vector<cv::Mat>& grayscale_images, const vector<cv::Mat>& depth_images,
+                                           const Matrix4d& model_pose, int model_id, ModelReport& report)
+{
+	const auto& first_image = grayscale_images[0];
+
+	RenderingHelper rendering_helper(configuration, model_id, first_image.cols, first_image.rows);
+
+	const int pyramid_levels = configuration.get_pyramid_levels();
+
+	// image_pyramid[level][frame_idx], level 0 is the full resolution
+	vector<vector<cv::Mat>> image_pyramid(pyramid_levels);
+	image_pyramid[0] = grayscale_images;
+	// same levels for the measured depth, empty without the depth term
+	vector<vector<cv::Mat>> depth_pyramid(pyramid_levels);
+	depth_pyramid[0] = depth_images;
+
+	for (int level = 1; level < pyramid_levels; ++level)
+	{
+		ScopedStageTimer loading_timer(report.timings.loading);
+
+		const vector<cv::Mat>& finer_images = image_pyramid[level - 1];
+		vector<cv::Mat>& level_images = image_pyramid[level];
+		level_images.resize(finer_images.size());
+
+		for (size_t frame_idx = 0; frame_idx < finer_images.size(); ++frame_idx)
+		{
+			cv::pyrDown(finer_images[frame_idx], level_images[frame_idx]);
+		}
+
+		// nearest neighbour, averaging would create depths between the surfaces at discontinuities
+		for (const cv::Mat& finer_depth : depth_pyramid[level - 1])
+		{
+			cv::Mat level_depth;
+			cv::resize(finer_depth, level_depth, level_images[0].size(), 0, 0, cv::INTER_NEAREST);
+			depth_pyramid[level].push_back(level_depth);
+		}
+	}
+
+	Matrix4d current_model_pose = model_pose;
+
+	// coarse to fine, the coarse levels converge from worse initial poses at a fraction of the cost
+	for (int level = pyramid_levels - 1; level >= 0; --level)
+	{
+		const float scale = 1.0f / static_cast<float>(1 << level);
+		const int number_of_iterations = level == 0 ? configuration.get_max_iterations() : configuration.get_pyramid_level_iterations();
+
+		if (pyramid_levels > 1)
+		{
+			cout << "Pyramid level " << level << ", scale " << scale << endl;
+		}
+
+		current_model_pose = refine_model_pose_at_scale(camera_poses, frame_ids, image_pyramid[level], depth_pyramid[level],
+		                                                current_model_pose, model_id, rendering_helper, scale, 
+		                                                number_of_iterations, report);
+	}
+
+	return current_model_pose;
+}
+
+// indices of the frames used in an iteration, a fixed subset unless the subsets rotate
+vector<size_t> select_iteration_frames(const vector<Matrix4d>& camera_poses, const Matrix4d& model_pose,
+                                       const Configuration& configuration, int iteration)
+{
+	const size_t seed_idx = configuration.get_rotate_frame_subsets() ? get_rotated_seed(iteration, camera_poses.size()) : 0;
+	const Vector3d object_center = model_pose.block<3, 1>(0, 3);
+
+	return select_diverse_frames(camera_poses, object_center, static_cast<size_t>(configuration.get_max_frames()), seed_idx);
+}
+
+Matrix4d Refiner::refine_model_pose_at_scale(const vector<Matrix4d>& camera_poses, const vector<size_t>& frame_ids,
+                                             const vector<cv::Mat>& grayscale_images, const vector<cv::Mat>& depth_images,
+                                             const Matrix4d& model_pose, int model_id, RenderingHelper& rendering_helper,
+                                             float scale, int number_of_iterations, ModelReport& report)
 {
 	const auto& first_image = grayscale_images[0];
 
 	int height = first_image.rows;
 	int width = first_image.cols;
 
-	CorrespondenceFinder correspondence_finder(configuration);
-	RenderingHelper rendering_helper(configuration, model_id, width, height);
+	// search span and sampling step stay in pixels of the level, i.e. cover a larger part of the full image on coarse levels
+	Configuration level_configuration = configuration;
+	level_configuration.set_intrinsics(scale_intrinsics(configuration.get_intrinsics(), scale));
+
+	CorrespondenceFinder correspondence_finder(level_configuration);
 
-	const size_t number_of_frames = grayscale_images.size();
 	Matrix4d current_model_pose = model_pose;
 
-	int number_of_iterations = configuration.get_max_iterations();
-	const Matrix3d intrinsics = configuration.get_intrinsics().cast<double>();
+	const Matrix3d intrinsics = level_configuration.get_intrinsics().cast<double>();
+
+	const bool use_mesh_edges = configuration.get_model_edge_source() == "mesh";
+	const bool use_depth_term = !depth_images.empty();
+
+	// rendered depth crops kept between renderings to test the visibility of the mesh edges
+	vector<cv::Mat> visibility_depths(camera_poses.size());
+	vector<cv::Rect> visibility_boxes(camera_poses.size());
+
+	// full frame renderings of the depth edge path, rendered in batches of frames ahead of their processing. 
+	// The renderer writes into the same buffers for every batch
+	const size_t render_batch_size = static_cast<size_t>(max(1, configuration.get_render_batch_size()));
+	vector<cv::Mat> batch_depths;
+	vector<Matrix4d> batch_poses;
+	cv::Mat depth_img;
+
+	const int pyramid_level = static_cast<int>(lround(-log2(scale)));
+
+	// only the last level decides how the refinement stopped
+	report.stop_reason = "max_iterations";
+	report.converged = false;
 
 	for (int iteration = 0; iteration < number_of_iterations; iteration++)
 	{
-		vector<FramePayload> frame_payloads(number_of_frames);
-		for (size_t frame_idx = 0; frame_idx < number_of_frames; ++frame_idx)
+		IterationReport iteration_report;
+		iteration_report.pyramid_level = pyramid_level;
+		iteration_report.iteration = iteration;
+
+		const vector<size_t> iteration_frames = select_iteration_frames(camera_poses, current_model_pose, configuration, iteration);
+
+		// cached frames are looked up before rendering, so batches contain only the frames that need their depth
+		vector<Correspondence> cached_correspondences(iteration_frames.size());
+		vector<bool> is_cached(iteration_frames.size(), false);
+		vector<size_t> rendered_frames;
+		for (size_t i = 0; i < iteration_frames.size(); ++i)
 		{
+			const size_t frame_idx = iteration_frames[i];
+			const Matrix4d world_to_camera = camera_poses[frame_idx].inverse() * current_model_pose;
+			is_cached[i] = correspondence_cache &&
+			               correspondence_cache->load(model_id, frame_ids[frame_idx], pyramid_level, iteration, world_to_camera,
+			                                          scale, cached_correspondences[i]);
+			if (!is_cached[i]) rendered_frames.push_back(i);
+		}
+
+		// rendered frames [batch_begin, batch_end) have their depth in batch_depths, next_rendered is the one of frame i
+		size_t batch_begin = 0;
+		size_t batch_end = 0;
+		size_t next_rendered = 0;
+
+		vector<FramePayload> frame_payloads;
+		for (size_t i = 0; i < iteration_frames.size(); ++i)
+		{
+			const size_t frame_idx = iteration_frames[i];
 			FramePayload payload;
 
 			const Matrix4d& camera_pose = camera_poses[frame_idx];
@@ -210,25 +507,102 @@ Matrix4d Refiner::refine_model_pose(const vector<Matrix4d>& camera_poses,
 
 			Matrix4d world_to_camera = camera_pose.inverse() * current_model_pose;
 
-			cv::Mat depth_img;
-			cv::Mat rendered_color_img; // not used here
-			rendering_helper.render(world_to_camera, depth_img, rendered_color_img);
-			cv::Rect cropping_box = get_roi_box(depth_img, configuration.get_model_padding_pixels());
-			
-			vector<Vector4f> depth_edges = get_depth_edges(depth_img, cropping_box);
+			if (is_cached[i])
+			{
+				payload.correspondence = move(cached_correspondences[i]);
+				iteration_report.correspondences += payload.correspondence.get_number_of_correspondences();
+				frame_payloads.push_back(move(payload));
+				continue;
+			}
+
+			cv::Rect cropping_box;
+			vector<Vector4f> depth_edges;
+			vector<Vector3f> mesh_edge_points;
+
+			if (use_mesh_edges)
+			{
+				ScopedStageTimer rendering_timer(report.timings.rendering);
+				rendering_helper.get_model_edges(world_to_camera, configuration.get_crease_angle(), mesh_edge_points);
+				cropping_box = get_projected_roi_box(mesh_edge_points, world_to_camera, intrinsics, 
+				                                     configuration.get_model_padding_pixels(), width, height);
+				if (cropping_box.area() == 0) continue;
+
+				// the depth term samples the model from a rendering at the current pose
+				if (use_depth_term || visibility_depths[frame_idx].empty() || iteration % configuration.get_edge_render_interval() == 0)
+				{
+					// the projected edges bound the object, only their box is read back
+					rendering_helper.render_depth(world_to_camera, visibility_depths[frame_idx], scale, cropping_box);
+					visibility_boxes[frame_idx] = cropping_box;
+				}
+			}
+			else
+			{
+				const size_t rendered_idx = next_rendered++;
+				if (rendered_idx >= batch_end)
+				{
+					ScopedStageTimer rendering_timer(report.timings.rendering);
+
+					batch_begin = rendered_idx;
+					batch_end = min(rendered_idx + render_batch_size, rendered_frames.size());
+					batch_poses.clear();
+					for (size_t j = batch_begin; j < batch_end; ++j)
+					{
+						batch_poses.push_back(camera_poses[iteration_frames[rendered_frames[j]]].inverse() * current_model_pose);
+					}
+					rendering_helper.render_depth_batch(batch_poses, batch_depths, scale);
+				}
+				depth_img = batch_depths[rendered_idx - batch_begin];
+				ScopedStageTimer edge_extraction_timer(report.timings.edge_extraction);
+				cropping_box = get_roi_box(depth_img, configuration.get_model_padding_pixels());
+
+				depth_edges = get_depth_edges(depth_img, cropping_box, configuration);
+			}
 		
 			const cv::Mat& grayscale_img = grayscale_images[frame_idx];
-			cv::Mat edge_id_img = cv::Mat(height, width, CV_32SC1, cv::Scalar::all(-1));
-			vector<Vector4f> rgb_edges = extract_edges(cropping_box, grayscale_img);
+			cv::Mat edge_id_img;
+			vector<Vector4f> rgb_edges;
+			cv::Mat gradient_magnitude;
+			{
+				ScopedStageTimer edge_extraction_timer(report.timings.edge_extraction);
+				edge_id_img = cv::Mat(height, width, CV_32SC1, cv::Scalar::all(-1));
+				rgb_edges = extract_edges(cropping_box, grayscale_img);
+				gradient_magnitude = get_gradient_magnitude(grayscale_img, cropping_box, configuration);
 
-			draw_line_ids(edge_id_img, rgb_edges);
-			transform(rgb_edges.begin(), rgb_edges.end(), back_inserter(payload.correspondence.rgb_edge_normals),
-			          [](const Vector4f& edge) { return get_edge_normal(edge); });
-			
-			Matrix4d to_world_transformation = world_to_camera.inverse();
-			correspondence_finder.find_correspondences(depth_img, edge_id_img, to_world_transformation,
-			                                           depth_edges, payload.correspondence);
+				draw_line_ids(edge_id_img, rgb_edges);
+				transform(rgb_edges.begin(), rgb_edges.end(), back_inserter(payload.correspondence.rgb_edge_normals),
+				          [](const Vector4f& edge) { return get_edge_normal(edge); });
+			}
 			
+			ScopedStageTimer correspondence_timer(report.timings.correspondence);
+			if (use_mesh_edges)
+			{
+				correspondence_finder.find_mesh_edge_correspondences(visibility_depths[frame_idx], visibility_boxes[frame_idx].tl(),
+				                                                     edge_id_img, world_to_camera, mesh_edge_points,
+				                                                     payload.correspondence, gradient_magnitude);
+			}
+			else
+			{
+				Matrix4d to_world_transformation = world_to_camera.inverse();
+				correspondence_finder.find_correspondences(depth_img, edge_id_img, to_world_transformation,
+				                                           depth_edges, payload.correspondence, cv::Mat(), gradient_magnitude);
+			}
+
+			if (correspondence_cache)
+			{
+				correspondence_cache->store(model_id, frame_ids[frame_idx], pyramid_level, iteration, world_to_camera, scale,
+				                            payload.correspondence);
+			}
+			iteration_report.correspondences += payload.correspondence.get_number_of_correspondences();
+
+			if (use_depth_term)
+			{
+				const cv::Mat& model_depth = use_mesh_edges ? visibility_depths[frame_idx] : depth_img;
+				const cv::Point model_depth_offset = use_mesh_edges ? visibility_boxes[frame_idx].tl() : cv::Point();
+				correspondence_finder.find_depth_correspondences(model_depth, model_depth_offset, depth_images[frame_idx],
+				                                                 world_to_camera.inverse(), payload.depth_correspondence);
+				iteration_report.depth_correspondences += payload.depth_correspondence.get_number_of_correspondences();
+			}
+
 
 #ifdef _DEBUG
 				if (frame_idx % 20 == 0)
@@ -239,59 +613,542 @@ Matrix4d Refiner::refine_model_pose(const vector<Matrix4d>& camera_poses,
 				}
 			
 #endif
-			frame_payloads[frame_idx] = payload;
+			frame_payloads.push_back(move(payload));
 		}
 
-		double res_std_dev;
+		iteration_report.frames = frame_payloads.size();
+
+		// nothing to solve for, the residuals would look converged
+		if (iteration_report.correspondences == 0)
+		{
+			report.iterations.push_back(iteration_report);
+			report.converged = false;
+			report.stop_reason = "no_correspondences";
+			cerr << "No correspondences for model #" << model_id << " in iteration " << iteration << ", stopping" << endl;
+			break;
+		}
+
+		double res_std_dev = 0.0;
 		bool has_converged;
-		compute_residual_std_dev(frame_payloads, current_model_pose, intrinsics, res_std_dev, has_converged);
+		Matrix4d updated_model_pose;
+		{
+			ScopedStageTimer solve_timer(report.timings.solve);
+			compute_residual_std_dev(frame_payloads, current_model_pose, intrinsics, res_std_dev, has_converged);
+			iteration_report.residual_std_dev = res_std_dev;
+
+			if (!has_converged)
+			{
+				updated_model_pose = optimize_model_pose(frame_payloads, current_model_pose, intrinsics, res_std_dev,
+				                                         configuration.get_depth_weight());
+				get_pose_difference(current_model_pose, updated_model_pose, iteration_report.rotation_update,
+				                    iteration_report.translation_update);
+			}
+		}
+		report.iterations.push_back(iteration_report);
+
+		if (has_converged)
+		{
+			report.converged = true;
+			report.stop_reason = "inliers";
+			break;
+		}
 
-		if (has_converged) break;
+		const bool is_update_small = is_pose_update_small(current_model_pose, updated_model_pose, configuration);
+		current_model_pose = updated_model_pose;
 
-		current_model_pose = optimize_model_pose(frame_payloads, current_model_pose, intrinsics, res_std_dev);
+		if (is_update_small)
+		{
+			report.converged = true;
+			report.stop_reason = "small_update";
+			cout << "Pose update below threshold after iteration " << iteration << ", stopping" << endl;
+			break;
+		}
 	}
 
 	return current_model_pose;
 }
 
 
+vector<size_t> Refiner::select_fixed_frame_subset(const vector<size_t>& frame_ids, const RefinementInput& input,
+                                                  const Matrix4d& model_pose) const
+{
+	vector<Matrix4d> camera_poses(frame_ids.size());
+	transform(frame_ids.begin(), frame_ids.end(), camera_poses.begin(),
+	          [&input](const auto& frame_id) { return input.camera_poses[frame_id]; });
+
+	vector<size_t> selected_frame_ids;
+	for (size_t frame_idx : select_iteration_frames(camera_poses, model_pose, configuration, 0))
+	{
+		selected_frame_ids.push_back(frame_ids[frame_idx]);
+	}
+
+	return selected_frame_ids;
+}
+
+
+string Refiner::get_visibility_cache_file(const RefinementInput& input) const
+{
+	if (!configuration.get_visibility_cache() || input.scene_dir.empty()) return "";
+
+	return (filesystem::path(input.scene_dir) / "visible_frames.json").string();
+}
+
+
 map<int, Matrix4d> Refiner::refine_model_poses(const RefinementInput& input)
 {
-	OcclusionHandler occlusion_handler(configuration, input.rgbd_image_files, input.camera_poses);
+	if (configuration.get_joint_refinement())
+	{
+		return refine_scene_poses(input);
+	}
+
+	map<int, vector<size_t>> visible_frame_ids = get_visible_frame_ids(input);
 
 	map<int, Matrix4d> refined_model_poses;
 
 	for (const auto& [model_id, model_pose] : input.model_poses)
 	{
-		vector<size_t> valid_frame_ids = occlusion_handler.get_frame_ids_with_visible_model(model_id, model_pose);
-		if (!valid_frame_ids.empty())
+		refined_model_poses[model_id] = refine_single_model_pose(input, model_id, visible_frame_ids[model_id]);
+
+		if (model_refined_callback) model_refined_callback(model_id, refined_model_poses[model_id]);
+	}
+
+	return refined_model_poses;
+}
+
+
+map<int, vector<size_t>> Refiner::get_visible_frame_ids(const RefinementInput& input)
+{
+	visibility_seconds = 0.0;
+	ScopedStageTimer visibility_timer(visibility_seconds);
+
+	OcclusionHandler occlusion_handler(configuration, input.rgbd_image_files, input.camera_poses, get_visibility_cache_file(input));
+	return occlusion_handler.get_frame_ids_with_visible_models(input.model_poses);
+}
+
+
+Matrix4d Refiner::refine_single_model_pose(const RefinementInput& input, int model_id, const vector<size_t>& visible_frame_ids)
+{
+	const Matrix4d& model_pose = input.model_poses.at(model_id);
+
+	ModelReport report;
+	report.model_id = model_id;
+	report.visible_frames = visible_frame_ids.size();
+	report.initial_pose = model_pose;
+	report.refined_pose = model_pose;
+	report.timings.visibility = visibility_seconds;
+
+	if (visible_frame_ids.empty())
+	{
+		cerr << "No valid frames for model #" << model_id << ", skipping refinement" << endl;
+		report.stop_reason = "no_frames";
+		if (configuration.get_write_reports() && !input.scene_dir.empty()) store_model_report(report, input.scene_dir);
+		return model_pose;
+	}
+
+	const auto start_time = chrono::steady_clock::now();
+
+	const bool use_depth_term = configuration.get_depth_weight() > 0.0f;
+
+	// correspondences depend on all poses in the joint refinement, only the per-object refinement is cached.
+	// The cache holds only the edge correspondences, the depth term always searches. Mesh edge correspondences depend on
+	// the visibility depth of an earlier iteration, which frames served from the cache would not have rendered
+	const bool use_mesh_edges = configuration.get_model_edge_source() == "mesh";
+	correspondence_cache.reset();
+	if (configuration.get_correspondence_cache() && !use_depth_term && !use_mesh_edges && !input.scene_dir.empty())
+	{
+		const string cache_dir = (filesystem::path(input.scene_dir) / "correspondence_cache").string();
+		correspondence_cache = make_unique<CorrespondenceCache>(cache_dir, configuration);
+	}
+
+	vector<size_t> valid_frame_ids = visible_frame_ids;
+
+	// a fixed subset is selected upfront, so that the other frames are not even loaded
+	if (!configuration.get_rotate_frame_subsets())
+	{
+		valid_frame_ids = select_fixed_frame_subset(valid_frame_ids, input, model_pose);
+	}
+
+	cout << "Running optimization for model #" << model_id << " on " << valid_frame_ids.size() << " frames" << endl;
+	report.used_frames = valid_frame_ids.size();
+
+	vector<Matrix4d> camera_poses(valid_frame_ids.size());
+	vector<cv::Mat> grayscale_images(valid_frame_ids.size());
+	vector<cv::Mat> depth_images;
+
+	transform(valid_frame_ids.begin(), valid_frame_ids.end(), camera_poses.begin(),
+	          [&input](const auto& frame_id) { return input.camera_poses[frame_id]; });
+	{
+		ScopedStageTimer loading_timer(report.timings.loading);
+		transform(valid_frame_ids.begin(), valid_frame_ids.end(), grayscale_images.begin(),
+		          [&input](const auto& frame_id)
+		          {
+			          return load_grayscale_image(input.rgbd_image_files[frame_id].first);
+		          });
+
+		if (use_depth_term)
 		{
-			cout << "Running optimization for model #" << model_id << " on " << valid_frame_ids.size() << " frames" << endl;
+			transform(valid_frame_ids.begin(), valid_frame_ids.end(), back_inserter(depth_images),
+			          [&input](const auto& frame_id) { return load_depth_image(input.rgbd_image_files[frame_id].second); });
+		}
+	}
 
-			vector<Matrix4d> camera_poses(valid_frame_ids.size());
-			vector<cv::Mat> grayscale_images(valid_frame_ids.size());
+	report.refined_pose = refine_model_pose(camera_poses, valid_frame_ids, grayscale_images, depth_images, model_pose, model_id,
+	                                        report);
+	report.timings.total = chrono::duration<double>(chrono::steady_clock::now() - start_time).count() + visibility_seconds;
 
-			transform(valid_frame_ids.begin(), valid_frame_ids.end(), camera_poses.begin(),
-			          [&input](const auto& frame_id) { return input.camera_poses[frame_id]; });
-			transform(valid_frame_ids.begin(), valid_frame_ids.end(), grayscale_images.begin(),
-			          [&input](const auto& frame_id)
-			          {
-				          const string& rgb_file = input.rgbd_image_files[frame_id].first;
-				          cv::Mat rgb = read_image(rgb_file);
-						  cv::Mat grayscale;
-						  cv::cvtColor(rgb, grayscale, CV_RGB2GRAY);
-						  return grayscale;
-			          });
-
-
-			refined_model_poses[model_id] = refine_model_pose(camera_poses, grayscale_images, model_pose, model_id);
+	if (configuration.get_write_reports() && !input.scene_dir.empty()) store_model_report(report, input.scene_dir);
+
+	return report.refined_pose;
+}
+
+
+// Copy of a cropped image at its place in an image of the given size, zero elsewhere
+static cv::Mat uncrop_image(const cv::Mat& cropped_img, const cv::Rect& box, const cv::Size& size)
+{
+	if (cropped_img.empty()) return cv::Mat();
+
+	cv::Mat img = cv::Mat::zeros(size, cropped_img.type());
+	cv::Mat img_box = img(box);
+	cropped_img.copyTo(img_box);
+
+	return img;
+}
+
+
+void Refiner::prepare_scene_frame(SceneFrame& scene_frame, const RefinementInput& input, const cv::Mat& depth_img,
+                                  const cv::Mat& object_ids, const vector<bool>& visible_models, StageTimings& timings)
+{
+	// rgb edges are extracted once for the region covering all visible objects at their poses of the first rendering,
+	// widened by the search span to stay valid while the poses move
+	cv::Rect scene_box;
+	{
+		ScopedStageTimer edge_extraction_timer(timings.edge_extraction);
+		for (size_t model_idx = 0; model_idx < visible_models.size(); ++model_idx)
+		{
+			cv::Mat object_depth = get_object_depth(depth_img, object_ids, static_cast<ushort>(model_idx + 1));
+			if (!visible_models[model_idx] || cv::countNonZero(object_depth) == 0) continue;
+
+			cv::Rect object_box = get_roi_box(object_depth, configuration.get_model_padding_pixels() + configuration.get_edge_search_span());
+			scene_box = scene_box.area() == 0 ? object_box : (scene_box | object_box);
 		}
-		else
+
+		if (scene_box.area() == 0)
+		{
+			scene_box = cv::Rect(0, 0, depth_img.cols, depth_img.rows);
+		}
+	}
+
+	cv::Mat grayscale_img;
+	{
+		ScopedStageTimer loading_timer(timings.loading);
+		grayscale_img = load_grayscale_image(input.rgbd_image_files[scene_frame.frame_id].first);
+
+		if (configuration.get_depth_weight() > 0.0f)
+		{
+			scene_frame.measured_depth = load_depth_image(input.rgbd_image_files[scene_frame.frame_id].second)(scene_box).clone();
+		}
+	}
+
+	ScopedStageTimer edge_extraction_timer(timings.edge_extraction);
+
+	scene_frame.scene_box = scene_box;
+	scene_frame.rgb_edges = extract_edges(scene_box, grayscale_img);
+
+	const cv::Mat gradient_magnitude = get_gradient_magnitude(grayscale_img, scene_box, configuration);
+	if (!gradient_magnitude.empty()) scene_frame.gradient_magnitude = gradient_magnitude(scene_box).clone();
+
+	transform(scene_frame.rgb_edges.begin(), scene_frame.rgb_edges.end(), back_inserter(scene_frame.rgb_edge_normals),
+	          [](const Vector4f& edge) { return get_edge_normal(edge); });
+}
+
+
+map<int, Matrix4d> Refiner::refine_scene_poses(const RefinementInput& input)
+{
+	const map<int, Matrix4d> refined_model_poses = refine_scene_poses_jointly(input);
+
+	if (model_refined_callback)
+	{
+		for (const auto& [model_id, model_pose] : refined_model_poses) model_refined_callback(model_id, model_pose);
+	}
+
+	return refined_model_poses;
+}
+
+
+map<int, Matrix4d> Refiner::refine_scene_poses_jointly(const RefinementInput& input)
+{
+	const auto start_time = chrono::steady_clock::now();
+
+	map<int, vector<size_t>> visible_frame_ids = get_visible_frame_ids(input);
+
+	const size_t number_of_frames = input.rgbd_image_files.size();
+	const size_t number_of_models = input.model_poses.size();
+
+	vector<int> model_ids;
+	vector<Matrix4d> current_model_poses;
+	for (const auto& [model_id, model_pose] : input.model_poses)
+	{
+		model_ids.push_back(model_id);
+		current_model_poses.push_back(model_pose);
+	}
+
+	// visible_models[frame_idx][model_idx]
+	vector<vector<bool>> visible_models(number_of_frames, vector<bool>(number_of_models, false));
+	vector<vector<size_t>> model_frame_ids(number_of_models);
+	vector<bool> has_converged(number_of_models, false);
+
+	vector<ModelReport> reports(number_of_models);
+	// loading, rendering and rgb edge extraction are shared by all objects of the scene
+	StageTimings scene_timings;
+	scene_timings.visibility = visibility_seconds;
+
+	for (size_t model_idx = 0; model_idx < number_of_models; ++model_idx)
+	{
+		const int model_id = model_ids[model_idx];
+		vector<size_t> valid_frame_ids = visible_frame_ids[model_id];
+
+		ModelReport& report = reports[model_idx];
+		report.model_id = model_id;
+		report.visible_frames = valid_frame_ids.size();
+		report.initial_pose = current_model_poses[model_idx];
+
+		if (valid_frame_ids.empty())
 		{
-			refined_model_poses[model_id] = model_pose;
+			// still rendered as an occluder for the other objects
+			has_converged[model_idx] = true;
+			report.stop_reason = "no_frames";
 			cerr << "No valid frames for model #" << model_id << ", skipping refinement" << endl;
+			continue;
+		}
+
+		if (!configuration.get_rotate_frame_subsets())
+		{
+			valid_frame_ids = select_fixed_frame_subset(valid_frame_ids, input, current_model_poses[model_idx]);
 		}
+
+		cout << "Running joint optimization for model #" << model_id << " on " << valid_frame_ids.size() << " frames" << endl;
+		for (size_t frame_id : valid_frame_ids) visible_models[frame_id][model_idx] = true;
+		report.used_frames = valid_frame_ids.size();
+		model_frame_ids[model_idx] = move(valid_frame_ids);
+	}
+
+	map<int, Matrix4d> refined_model_poses;
+	if (all_of(has_converged.begin(), has_converged.end(), [](bool converged) { return converged; }))
+	{
+		refined_model_poses.insert(input.model_poses.begin(), input.model_poses.end());
+		store_scene_reports(input, reports, current_model_poses, scene_timings, start_time);
+		return refined_model_poses;
 	}
 
+	const cv::Mat first_image = read_image(input.rgbd_image_files[0].first);
+	SceneRenderingHelper rendering_helper(configuration, model_ids, first_image.cols, first_image.rows);
+
+	// images are loaded and rgb edges extracted only once per frame for all objects, at the first rendering of the frame
+	vector<SceneFrame> scene_frames;
+	for (size_t frame_id = 0; frame_id < number_of_frames; ++frame_id)
+	{
+		const vector<bool>& frame_visible_models = visible_models[frame_id];
+		if (none_of(frame_visible_models.begin(), frame_visible_models.end(), [](bool visible) { return visible; })) continue;
+
+		SceneFrame scene_frame;
+		scene_frame.frame_id = frame_id;
+		scene_frame.scene_pose = input.camera_poses[frame_id];
+		scene_frames.push_back(move(scene_frame));
+	}
+
+	CorrespondenceFinder correspondence_finder(configuration);
+	const Matrix3d intrinsics = configuration.get_intrinsics().cast<double>();
+	const int padding_pixels = configuration.get_model_padding_pixels();
+
+	for (int iteration = 0; iteration < configuration.get_max_iterations(); iteration++)
+	{
+		vector<vector<FramePayload>> frame_payloads(number_of_models);
+		vector<size_t> number_of_correspondences(number_of_models, 0);
+		vector<size_t> number_of_depth_correspondences(number_of_models, 0);
+
+		// active_models[frame_idx][model_idx], the frames of each model selected for this iteration
+		vector<vector<bool>> active_models(number_of_frames, vector<bool>(number_of_models, false));
+		for (size_t model_idx = 0; model_idx < number_of_models; ++model_idx)
+		{
+			const vector<size_t>& frame_ids = model_frame_ids[model_idx];
+			if (has_converged[model_idx] || frame_ids.empty()) continue;
+
+			vector<Matrix4d> camera_poses(frame_ids.size());
+			transform(frame_ids.begin(), frame_ids.end(), camera_poses.begin(),
+			          [&input](const auto& frame_id) { return input.camera_poses[frame_id]; });
+
+			for (size_t frame_idx : select_iteration_frames(camera_poses, current_model_poses[model_idx], configuration, iteration))
+			{
+				active_models[frame_ids[frame_idx]][model_idx] = true;
+			}
+		}
+
+		for (SceneFrame& scene_frame : scene_frames)
+		{
+			const vector<bool>& frame_active_models = active_models[scene_frame.frame_id];
+			if (none_of(frame_active_models.begin(), frame_active_models.end(), [](bool active) { return active; })) continue;
+
+			const Matrix4d scene_pose_inverse = scene_frame.scene_pose.inverse();
+			vector<Matrix4d> world_to_camera_poses(number_of_models);
+			transform(current_model_poses.begin(), current_model_poses.end(), world_to_camera_poses.begin(),
+			          [&scene_pose_inverse](const Matrix4d& model_pose) { return Matrix4d(scene_pose_inverse * model_pose); });
+
+			// single pass for all objects, which also resolves inter-object occlusions
+			cv::Mat depth_img;
+			cv::Mat object_ids;
+			{
+				ScopedStageTimer rendering_timer(scene_timings.rendering);
+				rendering_helper.render(world_to_camera_poses, depth_img, object_ids);
+			}
+
+			if (scene_frame.scene_box.area() == 0)
+			{
+				prepare_scene_frame(scene_frame, input, depth_img, object_ids, visible_models[scene_frame.frame_id], scene_timings);
+			}
+
+			// full sized images only for the frame at hand, the correspondence search works in image coordinates
+			cv::Mat edge_id_img;
+			cv::Mat gradient_magnitude;
+			cv::Mat measured_depth;
+			{
+				ScopedStageTimer edge_extraction_timer(scene_timings.edge_extraction);
+				edge_id_img = cv::Mat(depth_img.rows, depth_img.cols, CV_32SC1, cv::Scalar::all(-1));
+				draw_line_ids(edge_id_img, scene_frame.rgb_edges);
+				gradient_magnitude = uncrop_image(scene_frame.gradient_magnitude, scene_frame.scene_box, depth_img.size());
+				measured_depth = uncrop_image(scene_frame.measured_depth, scene_frame.scene_box, depth_img.size());
+			}
+
+			for (size_t model_idx = 0; model_idx < number_of_models; ++model_idx)
+			{
+				if (!frame_active_models[model_idx]) continue;
+
+				StageTimings& timings = reports[model_idx].timings;
+				const auto object_id = static_cast<ushort>(model_idx + 1);
+				cv::Mat object_depth = get_object_depth(depth_img, object_ids, object_id);
+
+				// fully occluded by other objects at the current poses
+				if (cv::countNonZero(object_depth) == 0) continue;
+
+				vector<Vector4f> depth_edges;
+				{
+					ScopedStageTimer edge_extraction_timer(timings.edge_extraction);
+					cv::Rect cropping_box = get_roi_box(object_depth, padding_pixels);
+					depth_edges = get_depth_edges(object_depth, cropping_box, configuration);
+				}
+
+				ScopedStageTimer correspondence_timer(timings.correspondence);
+				cv::Mat occlusion_mask = get_occlusion_mask(depth_img, object_ids, object_depth, object_id);
+
+				FramePayload payload;
+				payload.scene_pose = scene_frame.scene_pose;
+				payload.correspondence.rgb_edge_normals = scene_frame.rgb_edge_normals;
+
+				Matrix4d to_world_transformation = world_to_camera_poses[model_idx].inverse();
+				correspondence_finder.find_correspondences(object_depth, edge_id_img, to_world_transformation,
+				                                           depth_edges, payload.correspondence, occlusion_mask,
+				                                           gradient_magnitude);
+
+				number_of_correspondences[model_idx] += payload.correspondence.get_number_of_correspondences();
+
+				if (!measured_depth.empty())
+				{
+					correspondence_finder.find_depth_correspondences(object_depth, cv::Point(), measured_depth,
+					                                                 to_world_transformation, payload.depth_correspondence);
+					number_of_depth_correspondences[model_idx] += payload.depth_correspondence.get_number_of_correspondences();
+				}
+				frame_payloads[model_idx].push_back(move(payload));
+			}
+		}
+
+		for (size_t model_idx = 0; model_idx < number_of_models; ++model_idx)
+		{
+			if (has_converged[model_idx] || frame_payloads[model_idx].empty()) continue;
+
+			ModelReport& report = reports[model_idx];
+			ScopedStageTimer solve_timer(report.timings.solve);
+
+			IterationReport iteration_report;
+			iteration_report.iteration = iteration;
+			iteration_report.frames = frame_payloads[model_idx].size();
+			iteration_report.correspondences = number_of_correspondences[model_idx];
+			iteration_report.depth_correspondences = number_of_depth_correspondences[model_idx];
+
+			if (iteration_report.correspondences == 0)
+			{
+				// done with the model, which stays an occluder of the others
+				has_converged[model_idx] = true;
+				report.converged = false;
+				report.stop_reason = "no_correspondences";
+				report.iterations.push_back(iteration_report);
+				cerr << "No correspondences for model #" << model_ids[model_idx] << " in iteration " << iteration << ", stopping" << endl;
+				continue;
+			}
+
+			double res_std_dev = 0.0;
+			bool model_has_converged;
+			compute_residual_std_dev(frame_payloads[model_idx], current_model_poses[model_idx], intrinsics, res_std_dev,
+			                         model_has_converged);
+			iteration_report.residual_std_dev = res_std_dev;
+
+			if (model_has_converged)
+			{
+				has_converged[model_idx] = true;
+				report.converged = true;
+				report.stop_reason = "inliers";
+				report.iterations.push_back(iteration_report);
+				continue;
+			}
+
+			cout << "Optimizing model #" << model_ids[model_idx] << ", iteration " << iteration << endl;
+			Matrix4d updated_model_pose = optimize_model_pose(frame_payloads[model_idx], current_model_poses[model_idx],
+			                                                  intrinsics, res_std_dev, configuration.get_depth_weight());
+			get_pose_difference(current_model_poses[model_idx], updated_model_pose, iteration_report.rotation_update,
+			                    iteration_report.translation_update);
+			report.iterations.push_back(iteration_report);
+
+			has_converged[model_idx] = is_pose_update_small(current_model_poses[model_idx], updated_model_pose, configuration);
+			current_model_poses[model_idx] = updated_model_pose;
+
+			if (has_converged[model_idx])
+			{
+				report.converged = true;
+				report.stop_reason = "small_update";
+			}
+		}
+
+		if (all_of(has_converged.begin(), has_converged.end(), [](bool converged) { return converged; })) break;
+	}
+
+	for (size_t model_idx = 0; model_idx < number_of_models; ++model_idx)
+	{
+		refined_model_poses[model_ids[model_idx]] = current_model_poses[model_idx];
+	}
+
+	store_scene_reports(input, reports, current_model_poses, scene_timings, start_time);
+
 	return refined_model_poses;
 }
+
+
+void Refiner::store_scene_reports(const RefinementInput& input, vector<ModelReport>& reports, const vector<Matrix4d>& model_poses,
+                                  const StageTimings& scene_timings, chrono::steady_clock::time_point start_time) const
+{
+	if (!configuration.get_write_reports() || input.scene_dir.empty()) return;
+
+	const double total_seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+	for (size_t model_idx = 0; model_idx < reports.size(); ++model_idx)
+	{
+		ModelReport& report = reports[model_idx];
+		report.refined_pose = model_poses[model_idx];
+
+		// the shared stages are reported in full for every object, the total is the one of the whole scene
+		report.timings.loading += scene_timings.loading;
+		report.timings.visibility += scene_timings.visibility;
+		report.timings.rendering += scene_timings.rendering;
+		report.timings.edge_extraction += scene_timings.edge_extraction;
+		report.timings.total = total_seconds;
+
+		store_model_report(report, input.scene_dir);
+	}
+}
\ No newline at end of file
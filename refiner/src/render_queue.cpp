@@ -0,0 +1,86 @@
+//######################################################################
+//#   Refiner Module 
+//#   
+//#   Copyright (C) 2020 Siemens AG
+//#   SPDX-License-Identifier: MIT
+//#   Author 2020: This module has been developed by 
+//#                Roman Kaskman under supervision of Slobodan Ilic
+//#######################################################################
+
+#include "render_queue.h"
+
+using namespace std;
+
+
+RenderQueue& RenderQueue::instance()
+{
+	static RenderQueue render_queue;
+	return render_queue;
+}
+
+void RenderQueue::execute(const function<void()>& task)
+{
+	future<void> result;
+	{
+		unique_lock<mutex> lock(queue_mutex);
+
+		if (!is_served || this_thread::get_id() == server_id)
+		{
+			lock.unlock();
+			task();
+			return;
+		}
+
+		packaged_task<void()> queued_task(task);
+		result = queued_task.get_future();
+		tasks.push_back(move(queued_task));
+	}
+
+	queue_condition.notify_one();
+
+	// rethrows exceptions of the task
+	result.get();
+}
+
+void RenderQueue::open()
+{
+	lock_guard<mutex> lock(queue_mutex);
+	is_served = true;
+	server_id = this_thread::get_id();
+}
+
+void RenderQueue::serve()
+{
+	unique_lock<mutex> lock(queue_mutex);
+	is_served = true;
+	server_id = this_thread::get_id();
+
+	while (true)
+	{
+		queue_condition.wait(lock, [this] { return is_stopped || !tasks.empty(); });
+
+		// remaining tasks are still executed, their callers wait for them
+		if (tasks.empty()) break;
+
+		packaged_task<void()> task = move(tasks.front());
+		tasks.pop_front();
+
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+
+	// a stop requested before serving started ends the serving right away
+	is_served = false;
+	is_stopped = false;
+}
+
+void RenderQueue::stop()
+{
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		is_stopped = true;
+	}
+
+	queue_condition.notify_all();
+}
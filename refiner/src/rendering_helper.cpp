@@ -9,6 +9,7 @@
 
 #include "rendering_helper.h"
 #include "util.h"
+#include "render_queue.h"
 #include <opencv2/core/eigen.hpp>
 #include <iomanip>
 #include <filesystem>
@@ -16,8 +17,24 @@
 using namespace std;
 namespace fs = std::filesystem;
 
-RenderingHelper::RenderingHelper(const Configuration &configuration, int model_id, int width, int height) {
-  initialize_depth_renderer(configuration, model_id, width, height);
+RenderBackend get_render_backend(const Configuration &configuration) {
+  if (configuration.get_render_backend() == "cpu") return RENDER_BACKEND_CPU;
+  return configuration.get_render_backend() == "headless" ? RENDER_BACKEND_HEADLESS : RENDER_BACKEND_WIDGET;
+}
+
+// The widget contexts belong to the gui thread, their renderer calls go through the render queue. Headless renderers
+// get a context of the calling thread and the cpu renderers need none, so every thread renders with its own helpers in parallel.
+void execute_render_task(RenderBackend backend, const std::function<void()> &task) {
+  if (backend == RENDER_BACKEND_WIDGET) {
+    RenderQueue::instance().execute(task);
+  } else {
+    task();
+  }
+}
+
+RenderingHelper::RenderingHelper(const Configuration &configuration, int model_id, int width, int height) :
+  backend(get_render_backend(configuration)) {
+  execute_render_task(backend, [&]() { initialize_depth_renderer(configuration, model_id, width, height); });
 }
 
 string get_model_file(const string &reference_models_dir, int model_id) {
@@ -40,10 +57,63 @@ void RenderingHelper::initialize_depth_renderer(const Configuration &configurati
 
   renderer_configuration.z_near = 0.001f;
   renderer_configuration.z_far = 4.05f;
+  renderer_configuration.backend = backend;
+  renderer_configuration.cpu_threads = configuration.get_cpu_render_threads();
   renderer = std::shared_ptr<RendererInterface>(get_depth_renderer(renderer_configuration));
 }
 
-void RenderingHelper::render(const Eigen::Matrix4d &world_to_camera, cv::Mat &depth, cv::Mat &color) {
+void RenderingHelper::render(const Eigen::Matrix4d &world_to_camera, cv::Mat &depth, cv::Mat &color, float scale) {
+  Eigen::Matrix4f world_to_camera_f = world_to_camera.cast<float>();
+  execute_render_task(backend, [&]() { renderer->render(world_to_camera_f, scale, depth, color); });
+}
+
+void RenderingHelper::render_depth(const Eigen::Matrix4d &world_to_camera, cv::Mat &depth, float scale, const cv::Rect &roi) {
   Eigen::Matrix4f world_to_camera_f = world_to_camera.cast<float>();
-  renderer->render(world_to_camera_f, depth, color);
+  cv::Mat no_color;
+  execute_render_task(backend, [&]() { renderer->render(world_to_camera_f, scale, RENDER_DEPTH, roi, depth, no_color); });
+}
+
+void RenderingHelper::render_depth_batch(const vector<Eigen::Matrix4d> &world_to_camera_poses, vector<cv::Mat> &depths, float scale) {
+  vector<Eigen::Matrix4f> world_to_camera_poses_f(world_to_camera_poses.size());
+  transform(world_to_camera_poses.begin(), world_to_camera_poses.end(), world_to_camera_poses_f.begin(),
+            [](const Eigen::Matrix4d &pose) { return Eigen::Matrix4f(pose.cast<float>()); });
+  execute_render_task(backend, [&]() { renderer->render_batch(world_to_camera_poses_f, scale, depths); });
+}
+
+void RenderingHelper::get_model_edges(const Eigen::Matrix4d &world_to_camera, float crease_angle, vector<Eigen::Vector3f> &edge_points) {
+  Eigen::Matrix4f world_to_camera_f = world_to_camera.cast<float>();
+  execute_render_task(backend, [&]() { renderer->get_model_edges(world_to_camera_f, crease_angle, edge_points); });
+}
+
+void RenderingHelper::get_model_bounding_box(Eigen::Vector3f &bb_min, Eigen::Vector3f &bb_max) {
+  execute_render_task(backend, [&]() { renderer->get_model_bounding_box(bb_min, bb_max); });
+}
+
+SceneRenderingHelper::SceneRenderingHelper(const Configuration &configuration, const vector<int> &model_ids, int width, int height) :
+  backend(get_render_backend(configuration)) {
+  SceneRendererConfiguration renderer_configuration;
+
+  renderer_configuration.width = width;
+  renderer_configuration.height = height;
+
+  for (int model_id : model_ids) {
+    renderer_configuration.model_files.push_back(get_model_file(configuration.get_reference_models_dir(), model_id));
+  }
+
+  renderer_configuration.intrinsics = configuration.get_intrinsics();
+
+  renderer_configuration.z_near = 0.001f;
+  renderer_configuration.z_far = 4.05f;
+  renderer_configuration.backend = backend;
+  renderer_configuration.cpu_threads = configuration.get_cpu_render_threads();
+  execute_render_task(backend, [&]() {
+    renderer = std::shared_ptr<SceneRendererInterface>(get_scene_renderer(renderer_configuration));
+  });
+}
+
+void SceneRenderingHelper::render(const vector<Eigen::Matrix4d> &world_to_camera_poses, cv::Mat &depth, cv::Mat &object_ids) {
+  vector<Eigen::Matrix4f> world_to_camera_poses_f(world_to_camera_poses.size());
+  transform(world_to_camera_poses.begin(), world_to_camera_poses.end(), world_to_camera_poses_f.begin(),
+            [](const Eigen::Matrix4d &pose) { return Eigen::Matrix4f(pose.cast<float>()); });
+  execute_render_task(backend, [&]() { renderer->render(world_to_camera_poses_f, depth, object_ids); });
 }
\ No newline at end of file